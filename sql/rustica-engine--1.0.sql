@@ -20,7 +20,8 @@ CREATE TABLE rustica.modules(
     name text PRIMARY KEY,
     byte_code bytea NOT NULL,
     bin_code bytea NOT NULL,
-    heap_types int[] NOT NULL
+    heap_types int[] NOT NULL,
+    bin_hash bytea NOT NULL  -- sha256(bin_code), maintained by trigger
 );
 
 CREATE TABLE rustica.queries(
@@ -42,6 +43,17 @@ CREATE TABLE rustica.queries(
     FOREIGN KEY (module) REFERENCES rustica.modules(name)
 );
 
+-- Requests go to the module of the longest matching path prefix of their
+-- Host, or else of any host ('*'), or else to the module "main".
+CREATE TABLE rustica.routes(
+    host text NOT NULL DEFAULT '*',  -- without port
+    path_prefix text NOT NULL DEFAULT '/' CHECK (path_prefix LIKE '/%'),
+    module text NOT NULL,
+
+    PRIMARY KEY (host, path_prefix),
+    FOREIGN KEY (module) REFERENCES rustica.modules(name)
+);
+
 CREATE TYPE rustica.compile_result AS (
     bin_code bytea,
     heap_types int[],
@@ -58,17 +70,150 @@ CREATE FUNCTION rustica.compile_wasm(bytea, rustica.tid_oid[])
     AS 'MODULE_PATHNAME'
     LANGUAGE C STRICT;
 
+CREATE FUNCTION rustica.evict_code_cache(bytea)
+    RETURNS void
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT;
+
+REVOKE ALL ON FUNCTION rustica.evict_code_cache(bytea) FROM PUBLIC;
+
+CREATE FUNCTION rustica.stat_queries(
+    OUT module text,
+    OUT index int,
+    OUT calls bigint,
+    OUT rows bigint,
+    OUT total_time float8,
+    OUT min_time float8,
+    OUT max_time float8,
+    OUT mean_time float8,
+    OUT stddev_time float8,
+    OUT generic_plans bigint,
+    OUT custom_plans bigint
+)
+    RETURNS SETOF record
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT VOLATILE;
+
+CREATE FUNCTION rustica.stat_queries_reset()
+    RETURNS void
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT;
+
+-- Execution statistics of module queries, aggregated across all workers
+CREATE VIEW rustica.stat_queries AS
+    SELECT s.*, q.sql
+    FROM rustica.stat_queries() s
+    LEFT JOIN rustica.queries q USING (module, index);
+
+REVOKE ALL ON FUNCTION rustica.stat_queries_reset() FROM PUBLIC;
+
+-- Running workers with their counters, times are totals in milliseconds
+CREATE FUNCTION rustica.stat_workers(
+    OUT worker_id int,
+    OUT pid int,
+    OUT state text,
+    OUT started_at timestamptz,
+    OUT requests bigint,
+    OUT errors bigint,
+    OUT bytes_in bigint,
+    OUT bytes_out bigint,
+    OUT request_time float8,
+    OUT instantiate_time float8,
+    OUT handler_time float8,
+    OUT commit_time float8
+)
+    RETURNS SETOF record
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT VOLATILE;
+
+-- Master state and totals of all workers since server start
+CREATE FUNCTION rustica.stat_http(
+    OUT workers int,
+    OUT idle_workers int,
+    OUT queue_depth int,
+    OUT max_queue_depth int,
+    OUT queued bigint,
+    OUT dispatched bigint,
+    OUT rejected bigint,
+    OUT expired bigint,
+    OUT requests bigint,
+    OUT errors bigint,
+    OUT bytes_in bigint,
+    OUT bytes_out bigint
+)
+    RETURNS record
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT VOLATILE;
+
+-- Non-empty buckets of the latency histograms, bounds in milliseconds. The
+-- metric is one of request, instantiate, handler, commit and dispatch.
+CREATE FUNCTION rustica.stat_http_latency(
+    OUT metric text,
+    OUT lower_bound float8,
+    OUT upper_bound float8,
+    OUT count bigint
+)
+    RETURNS SETOF record
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT VOLATILE;
+
+-- Phase traces of the latest requests, see rustica.trace_buffer_size. Times
+-- are in milliseconds; the total counts from accepting the connection.
+CREATE FUNCTION rustica.stat_requests(
+    OUT finished_at timestamptz,
+    OUT worker_id int,
+    OUT error bool,
+    OUT keep_alive bool,
+    OUT spawned_worker bool,
+    OUT queue_time float8,
+    OUT handoff_time float8,
+    OUT load_time float8,
+    OUT instantiate_time float8,
+    OUT handler_time float8,
+    OUT commit_time float8,
+    OUT total_time float8
+)
+    RETURNS SETOF record
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT VOLATILE;
+
+CREATE OR REPLACE FUNCTION rustica.hash_bin_code() RETURNS TRIGGER AS $$
+    BEGIN
+        NEW.bin_hash := sha256(NEW.bin_code);
+        RETURN NEW;
+    END;
+$$ LANGUAGE plpgsql;
+
+CREATE TRIGGER module_bin_hash
+    BEFORE INSERT OR UPDATE ON rustica.modules
+    FOR EACH ROW EXECUTE FUNCTION rustica.hash_bin_code();
+
 CREATE OR REPLACE FUNCTION rustica.invalidate_module_cache() RETURNS TRIGGER AS $$
     BEGIN
         IF TG_OP = 'DELETE' THEN
             PERFORM pg_notify('rustica_module_cache_invalidation', OLD.name);
+            PERFORM rustica.evict_code_cache(OLD.bin_hash);
         ELSE
+            IF TG_OP = 'UPDATE' AND OLD.bin_hash <> NEW.bin_hash THEN
+                PERFORM rustica.evict_code_cache(OLD.bin_hash);
+            END IF;
             PERFORM pg_notify('rustica_module_cache_invalidation', NEW.name);
         END IF;
         RETURN NULL;
     END;
-$$ LANGUAGE plpgsql;
+$$ LANGUAGE plpgsql SECURITY DEFINER SET search_path = pg_catalog, pg_temp;
 
 CREATE TRIGGER module_change
     AFTER INSERT OR UPDATE OR DELETE ON rustica.modules
     FOR EACH ROW EXECUTE FUNCTION rustica.invalidate_module_cache();
+
+CREATE OR REPLACE FUNCTION rustica.invalidate_routes() RETURNS TRIGGER AS $$
+    BEGIN
+        PERFORM pg_notify('rustica_routes_invalidation', '');
+        RETURN NULL;
+    END;
+$$ LANGUAGE plpgsql;
+
+CREATE TRIGGER routes_change
+    AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON rustica.routes
+    FOR EACH STATEMENT EXECUTE FUNCTION rustica.invalidate_routes();
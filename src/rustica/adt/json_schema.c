@@ -0,0 +1,768 @@
+/*
+ * Copyright (c) 2025-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              https://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#include "postgres.h"
+#include "access/htup_details.h"
+#include "catalog/pg_type_d.h"
+#include "common/jsonapi.h"
+#include "common/shortest_dec.h"
+#include "executor/spi.h"
+#include "mb/pg_wchar.h"
+#include "utils/builtins.h"
+#include "utils/json.h"
+#include "utils/jsonb.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+
+#include "wasm_runtime_common.h"
+#include "rustica/datatypes.h"
+#include "rustica/module.h"
+#include "rustica/query.h"
+#include "rustica/wamr.h"
+
+#define JSON_DECODE_MAX_DEPTH 64
+
+typedef struct JsonSchemaField {
+    char *key;
+    uint32 keylen;
+    char *json_key; // escaped key with the colon, ready for the encoder
+    uint32 json_keylen;
+    JsonFieldKind kind;
+    bool required;
+    int32 nested;
+} JsonSchemaField;
+
+struct JsonSchema {
+    int32 type_idx;
+    uint32 nfields;
+    JsonSchemaField *fields;
+};
+
+typedef struct JsonDecodeFrame {
+    JsonSchema *schema;
+    wasm_struct_obj_t obj;
+    int32 field; // field of the pending value, or -1 to skip the value
+    bool *seen;
+} JsonDecodeFrame;
+
+typedef struct JsonDecodeState {
+    wasm_exec_env_t exec_env;
+    Context *ctx;
+    JsonSchema *root;
+    wasm_local_obj_ref_t root_ref;
+    int skip; // nesting level inside a skipped value
+    int depth;
+    JsonDecodeFrame frames[JSON_DECODE_MAX_DEPTH];
+} JsonDecodeState;
+
+JsonFieldKind
+rst_json_field_kind(wasm_ref_type_t type,
+                    const int32 *targets,
+                    uint32 ntargets,
+                    int32 *nested) {
+    *nested = -1;
+    switch (type.value_type) {
+        case VALUE_TYPE_I32:
+            return JSON_FIELD_I32;
+        case VALUE_TYPE_I64:
+            return JSON_FIELD_I64;
+        case VALUE_TYPE_F32:
+            return JSON_FIELD_F32;
+        case VALUE_TYPE_F64:
+            return JSON_FIELD_F64;
+        case VALUE_TYPE_EXTERNREF:
+            return JSON_FIELD_TEXT;
+        case VALUE_TYPE_HT_NULLABLE_REF:
+        case VALUE_TYPE_HT_NON_NULLABLE_REF:
+            if (type.heap_type == HEAP_TYPE_EXTERN)
+                return JSON_FIELD_TEXT;
+            for (uint32 i = 0; i < ntargets; i++) {
+                if (targets[i] == type.heap_type) {
+                    *nested = (int32)i;
+                    return JSON_FIELD_OBJECT;
+                }
+            }
+            return JSON_FIELD_INVALID;
+        default:
+            return JSON_FIELD_INVALID;
+    }
+}
+
+static JsonParseErrorType
+decode_object_start(void *pstate) {
+    JsonDecodeState *state = (JsonDecodeState *)pstate;
+    if (state->skip > 0) {
+        state->skip++;
+        return JSON_SUCCESS;
+    }
+
+    // Find out the schema of the new object
+    JsonSchema *schema;
+    JsonDecodeFrame *top = NULL;
+    if (state->depth == 0)
+        schema = state->root;
+    else {
+        top = &state->frames[state->depth - 1];
+        if (top->field < 0) {
+            state->skip = 1;
+            return JSON_SUCCESS;
+        }
+        JsonSchemaField *field = &top->schema->fields[top->field];
+        if (field->kind != JSON_FIELD_OBJECT)
+            return JSON_SEM_ACTION_FAILED;
+        schema = &state->ctx->json_schemas[field->nested];
+    }
+    if (state->depth == JSON_DECODE_MAX_DEPTH)
+        return JSON_SEM_ACTION_FAILED;
+
+    // Link the struct to its parent before filling, so that it's never
+    // unreachable while fields are being allocated.
+    wasm_struct_obj_t obj =
+        wasm_struct_obj_new_with_typeidx(state->exec_env, schema->type_idx);
+    if (top) {
+        wasm_value_t val = { .gc_obj = (wasm_obj_t)obj };
+        wasm_struct_obj_set_field(top->obj, top->field, &val);
+        top->seen[top->field] = true;
+    }
+    else
+        state->root_ref.val = (wasm_obj_t)obj;
+
+    JsonDecodeFrame *frame = &state->frames[state->depth++];
+    frame->schema = schema;
+    frame->obj = obj;
+    frame->field = -1;
+    frame->seen = (bool *)palloc0(sizeof(bool) * (schema->nfields + 1));
+    return JSON_SUCCESS;
+}
+
+static JsonParseErrorType
+decode_object_end(void *pstate) {
+    JsonDecodeState *state = (JsonDecodeState *)pstate;
+    if (state->skip > 0) {
+        state->skip--;
+        return JSON_SUCCESS;
+    }
+
+    // Fields of non-nullable reference types must be present
+    JsonDecodeFrame *frame = &state->frames[--state->depth];
+    for (uint32 i = 0; i < frame->schema->nfields; i++) {
+        if (frame->schema->fields[i].required && !frame->seen[i])
+            return JSON_SEM_ACTION_FAILED;
+    }
+    pfree(frame->seen);
+    return JSON_SUCCESS;
+}
+
+static JsonParseErrorType
+decode_array_start(void *pstate) {
+    JsonDecodeState *state = (JsonDecodeState *)pstate;
+    if (state->skip > 0) {
+        state->skip++;
+        return JSON_SUCCESS;
+    }
+
+    // Arrays are only accepted as values of unknown keys
+    if (state->depth > 0 && state->frames[state->depth - 1].field < 0) {
+        state->skip = 1;
+        return JSON_SUCCESS;
+    }
+    return JSON_SEM_ACTION_FAILED;
+}
+
+static JsonParseErrorType
+decode_array_end(void *pstate) {
+    JsonDecodeState *state = (JsonDecodeState *)pstate;
+    Assert(state->skip > 0);
+    state->skip--;
+    return JSON_SUCCESS;
+}
+
+static JsonParseErrorType
+decode_object_field_start(void *pstate, char *fname, bool isnull) {
+    JsonDecodeState *state = (JsonDecodeState *)pstate;
+    if (state->skip > 0)
+        return JSON_SUCCESS;
+
+    JsonDecodeFrame *top = &state->frames[state->depth - 1];
+    size_t len = strlen(fname);
+    top->field = -1;
+    for (uint32 i = 0; i < top->schema->nfields; i++) {
+        JsonSchemaField *field = &top->schema->fields[i];
+        if (field->keylen == len && memcmp(field->key, fname, len) == 0) {
+            top->field = (int32)i;
+            break;
+        }
+    }
+    return JSON_SUCCESS;
+}
+
+static bool
+parse_int64(const char *token, int64 *rv) {
+    char *end;
+    errno = 0;
+    long long val = strtoll(token, &end, 10);
+    if (errno != 0 || end == token || *end != '\0')
+        return false;
+    *rv = (int64)val;
+    return true;
+}
+
+static JsonParseErrorType
+decode_scalar(void *pstate, char *token, JsonTokenType tokentype) {
+    JsonDecodeState *state = (JsonDecodeState *)pstate;
+    if (state->skip > 0)
+        return JSON_SUCCESS;
+    if (state->depth == 0)
+        return JSON_SEM_ACTION_FAILED;
+    JsonDecodeFrame *top = &state->frames[state->depth - 1];
+    if (top->field < 0)
+        return JSON_SUCCESS;
+
+    // JSON null leaves the field as the zero value of its type
+    if (tokentype == JSON_TOKEN_NULL)
+        return JSON_SUCCESS;
+
+    JsonSchemaField *field = &top->schema->fields[top->field];
+    wasm_value_t val = { 0 };
+    int64 i64;
+    switch (field->kind) {
+        case JSON_FIELD_I32:
+            if (tokentype == JSON_TOKEN_TRUE || tokentype == JSON_TOKEN_FALSE)
+                val.i32 = tokentype == JSON_TOKEN_TRUE;
+            else if (tokentype == JSON_TOKEN_NUMBER && parse_int64(token, &i64)
+                     && i64 >= PG_INT32_MIN && i64 <= PG_INT32_MAX)
+                val.i32 = (int32)i64;
+            else
+                return JSON_SEM_ACTION_FAILED;
+            break;
+
+        case JSON_FIELD_I64:
+            if (tokentype != JSON_TOKEN_NUMBER || !parse_int64(token, &i64))
+                return JSON_SEM_ACTION_FAILED;
+            val.i64 = i64;
+            break;
+
+        case JSON_FIELD_F32:
+            if (tokentype != JSON_TOKEN_NUMBER)
+                return JSON_SEM_ACTION_FAILED;
+            val.f32 = strtof(token, NULL);
+            break;
+
+        case JSON_FIELD_F64:
+            if (tokentype != JSON_TOKEN_NUMBER)
+                return JSON_SEM_ACTION_FAILED;
+            val.f64 = strtod(token, NULL);
+            break;
+
+        case JSON_FIELD_TEXT:
+            if (tokentype != JSON_TOKEN_STRING)
+                return JSON_SEM_ACTION_FAILED;
+            val.gc_obj = (wasm_obj_t)cstring_into_varatt_obj(state->exec_env,
+                                                             token,
+                                                             strlen(token),
+                                                             TEXTOID);
+            break;
+
+        default:
+            return JSON_SEM_ACTION_FAILED;
+    }
+    wasm_struct_obj_set_field(top->obj, top->field, &val);
+    top->seen[top->field] = true;
+    return JSON_SUCCESS;
+}
+
+static wasm_obj_t
+env_json_decode(wasm_exec_env_t exec_env,
+                wasm_obj_t buf,
+                int32_t start,
+                int32_t length,
+                int32_t schema_idx) {
+    Context *ctx = (Context *)wasm_runtime_get_user_data(exec_env);
+    if (schema_idx < 0 || schema_idx >= (int32_t)ctx->njson_schemas)
+        ereport(ERROR, errmsg("no such JSON schema: #%d", schema_idx));
+    bytea *bytes =
+        (bytea *)DatumGetPointer(wasm_externref_obj_get_datum(buf, BYTEAOID));
+    if (start < 0 || length < 0
+        || (int64)start + length > VARSIZE_ANY_EXHDR(bytes))
+        ereport(ERROR, errmsg("index out of range"));
+
+    // Tokens and decoder frames are dropped together after parsing
+    MemoryContext decode_mctx = AllocSetContextCreate(CurrentMemoryContext,
+                                                      "json_decode",
+                                                      ALLOCSET_SMALL_SIZES);
+    MemoryContext old_mctx = MemoryContextSwitchTo(decode_mctx);
+    JsonDecodeState *state =
+        (JsonDecodeState *)palloc0(sizeof(JsonDecodeState));
+    state->exec_env = exec_env;
+    state->ctx = ctx;
+    state->root = &ctx->json_schemas[schema_idx];
+    wasm_runtime_push_local_obj_ref(exec_env, &state->root_ref);
+
+    wasm_obj_t rv = NULL;
+    PG_TRY();
+    {
+        JsonLexContext *lex =
+            makeJsonLexContextCstringLen(VARDATA_ANY(bytes) + start,
+                                         length,
+                                         PG_UTF8,
+                                         true);
+        JsonSemAction sem = {
+            .semstate = state,
+            .object_start = decode_object_start,
+            .object_end = decode_object_end,
+            .array_start = decode_array_start,
+            .array_end = decode_array_end,
+            .object_field_start = decode_object_field_start,
+            .scalar = decode_scalar,
+        };
+        if (pg_parse_json(lex, &sem) == JSON_SUCCESS)
+            rv = state->root_ref.val;
+    }
+    PG_FINALLY();
+    {
+        wasm_runtime_remove_local_obj_ref(exec_env, &state->root_ref);
+        MemoryContextSwitchTo(old_mctx);
+        MemoryContextDelete(decode_mctx);
+    }
+    PG_END_TRY();
+    return rv;
+}
+
+static void
+append_json_float8(StringInfo sb, double val) {
+    // JSON has no representation of NaN or infinity
+    if (isnan(val) || isinf(val)) {
+        appendBinaryStringInfo(sb, "null", 4);
+        return;
+    }
+    enlargeStringInfo(sb, DOUBLE_SHORTEST_DECIMAL_LEN);
+    sb->len += double_to_shortest_decimal_buf(val, sb->data + sb->len);
+}
+
+static void
+append_json_float4(StringInfo sb, float val) {
+    if (isnan(val) || isinf(val)) {
+        appendBinaryStringInfo(sb, "null", 4);
+        return;
+    }
+    enlargeStringInfo(sb, FLOAT_SHORTEST_DECIMAL_LEN);
+    sb->len += float_to_shortest_decimal_buf(val, sb->data + sb->len);
+}
+
+static void
+append_json_text(StringInfo sb, text *txt) {
+    char *str = text_to_cstring(txt);
+    escape_json(sb, str);
+    pfree(str);
+}
+
+static void
+encode_struct(StringInfo sb,
+              Context *ctx,
+              JsonSchema *schema,
+              wasm_struct_obj_t obj,
+              int depth) {
+    if (depth >= JSON_DECODE_MAX_DEPTH)
+        ereport(ERROR, errmsg("json_encode: nesting too deep"));
+    appendStringInfoChar(sb, '{');
+    for (uint32 f = 0; f < schema->nfields; f++) {
+        JsonSchemaField *field = &schema->fields[f];
+        if (f > 0)
+            appendStringInfoChar(sb, ',');
+        appendBinaryStringInfo(sb, field->json_key, (int)field->json_keylen);
+
+        wasm_value_t val;
+        wasm_struct_obj_get_field(obj, f, false, &val);
+        switch (field->kind) {
+            case JSON_FIELD_I32:
+                appendStringInfo(sb, "%d", val.i32);
+                break;
+            case JSON_FIELD_I64:
+                appendStringInfo(sb, INT64_FORMAT, val.i64);
+                break;
+            case JSON_FIELD_F32:
+                append_json_float4(sb, val.f32);
+                break;
+            case JSON_FIELD_F64:
+                append_json_float8(sb, val.f64);
+                break;
+            case JSON_FIELD_TEXT:
+                if (!val.gc_obj)
+                    appendBinaryStringInfo(sb, "null", 4);
+                else {
+                    Datum datum =
+                        wasm_externref_obj_get_datum(val.gc_obj, TEXTOID);
+                    text *txt = DatumGetTextPP(datum);
+                    append_json_text(sb, txt);
+                    RST_FREE_IF_COPY(txt, datum);
+                }
+                break;
+            case JSON_FIELD_OBJECT:
+                if (!val.gc_obj)
+                    appendBinaryStringInfo(sb, "null", 4);
+                else
+                    encode_struct(sb,
+                                  ctx,
+                                  &ctx->json_schemas[field->nested],
+                                  (wasm_struct_obj_t)val.gc_obj,
+                                  depth + 1);
+                break;
+            default:
+                pg_unreachable();
+        }
+    }
+    appendStringInfoChar(sb, '}');
+}
+
+static int32_t
+env_json_encode(wasm_exec_env_t exec_env,
+                wasm_obj_t sb_ref,
+                wasm_obj_t obj,
+                int32_t schema_idx) {
+    Context *ctx = (Context *)wasm_runtime_get_user_data(exec_env);
+    if (schema_idx < 0 || schema_idx >= (int32_t)ctx->njson_schemas)
+        ereport(ERROR, errmsg("no such JSON schema: #%d", schema_idx));
+    StringInfo sb =
+        wasm_externref_obj_get_obj(sb_ref, OBJ_STRING_INFO)->body.sb;
+    if (!obj)
+        appendBinaryStringInfo(sb, "null", 4);
+    else {
+        JsonSchema *schema = &ctx->json_schemas[schema_idx];
+        wasm_module_t module = (wasm_module_t)ctx->module->module;
+        if (!wasm_obj_is_struct_obj(obj)
+            || wasm_obj_get_defined_type_idx(module, obj) != schema->type_idx)
+            ereport(ERROR, errmsg("json_encode: object type mismatch"));
+        encode_struct(sb, ctx, schema, (wasm_struct_obj_t)obj, 0);
+    }
+    return sb->len;
+}
+
+void
+rst_init_json_column(JsonColumn *column, Form_pg_attribute attr) {
+    Oid typoid = getBaseType(attr->atttypid);
+    switch (typoid) {
+        case BOOLOID:
+            column->kind = JSON_COLUMN_BOOL;
+            break;
+        case INT2OID:
+            column->kind = JSON_COLUMN_INT2;
+            break;
+        case INT4OID:
+            column->kind = JSON_COLUMN_INT4;
+            break;
+        case INT8OID:
+            column->kind = JSON_COLUMN_INT8;
+            break;
+        case FLOAT4OID:
+            column->kind = JSON_COLUMN_FLOAT4;
+            break;
+        case FLOAT8OID:
+            column->kind = JSON_COLUMN_FLOAT8;
+            break;
+        case NUMERICOID:
+            column->kind = JSON_COLUMN_NUMERIC;
+            break;
+        case TEXTOID:
+        case VARCHAROID:
+        case BPCHAROID:
+            column->kind = JSON_COLUMN_TEXT;
+            break;
+        case JSONOID:
+            column->kind = JSON_COLUMN_JSON;
+            break;
+        case JSONBOID:
+            column->kind = JSON_COLUMN_JSONB;
+            break;
+        default:
+            column->kind = JSON_COLUMN_OTHER;
+    }
+    if (column->kind == JSON_COLUMN_NUMERIC
+        || column->kind == JSON_COLUMN_OTHER) {
+        Oid func;
+        bool is_varlena;
+        getTypeOutputInfo(typoid, &func, &is_varlena);
+        fmgr_info(func, &column->output);
+    }
+    initStringInfo(&column->json_key);
+    escape_json(&column->json_key, NameStr(attr->attname));
+    appendStringInfoChar(&column->json_key, ':');
+}
+
+static void
+encode_column(StringInfo sb, JsonColumn *column, Datum value) {
+    switch (column->kind) {
+        case JSON_COLUMN_BOOL:
+            if (DatumGetBool(value))
+                appendBinaryStringInfo(sb, "true", 4);
+            else
+                appendBinaryStringInfo(sb, "false", 5);
+            break;
+        case JSON_COLUMN_INT2:
+            appendStringInfo(sb, "%d", (int)DatumGetInt16(value));
+            break;
+        case JSON_COLUMN_INT4:
+            appendStringInfo(sb, "%d", DatumGetInt32(value));
+            break;
+        case JSON_COLUMN_INT8:
+            appendStringInfo(sb, INT64_FORMAT, DatumGetInt64(value));
+            break;
+        case JSON_COLUMN_FLOAT4:
+            append_json_float4(sb, DatumGetFloat4(value));
+            break;
+        case JSON_COLUMN_FLOAT8:
+            append_json_float8(sb, DatumGetFloat8(value));
+            break;
+        case JSON_COLUMN_NUMERIC:
+        {
+            // NaN and infinities are not valid JSON numbers
+            char *str = OutputFunctionCall(&column->output, value);
+            if (isdigit((unsigned char)str[0])
+                || (str[0] == '-' && isdigit((unsigned char)str[1])))
+                appendStringInfoString(sb, str);
+            else
+                appendBinaryStringInfo(sb, "null", 4);
+            pfree(str);
+            break;
+        }
+        case JSON_COLUMN_TEXT:
+        {
+            text *txt = DatumGetTextPP(value);
+            append_json_text(sb, txt);
+            RST_FREE_IF_COPY(txt, value);
+            break;
+        }
+        case JSON_COLUMN_JSON:
+        {
+            text *txt = DatumGetTextPP(value);
+            appendBinaryStringInfo(sb,
+                                   VARDATA_ANY(txt),
+                                   VARSIZE_ANY_EXHDR(txt));
+            RST_FREE_IF_COPY(txt, value);
+            break;
+        }
+        case JSON_COLUMN_JSONB:
+        {
+            Jsonb *jb = DatumGetJsonbP(value);
+            JsonbToCString(sb, &jb->root, VARSIZE(jb));
+            break;
+        }
+        case JSON_COLUMN_OTHER:
+        {
+            char *str = OutputFunctionCall(&column->output, value);
+            escape_json(sb, str);
+            pfree(str);
+            break;
+        }
+    }
+}
+
+void
+rst_encode_json_row(StringInfo sb,
+                    JsonColumn *columns,
+                    TupleDesc tupdesc,
+                    Datum *values,
+                    bool *nulls) {
+    bool first = true;
+
+    appendStringInfoChar(sb, '{');
+    for (int i = 0; i < tupdesc->natts; i++) {
+        if (TupleDescAttr(tupdesc, i)->attisdropped)
+            continue;
+        if (!first)
+            appendStringInfoChar(sb, ',');
+        first = false;
+        appendBinaryStringInfo(sb,
+                               columns[i].json_key.data,
+                               columns[i].json_key.len);
+        if (nulls[i])
+            appendBinaryStringInfo(sb, "null", 4);
+        else
+            encode_column(sb, &columns[i], values[i]);
+    }
+    appendStringInfoChar(sb, '}');
+}
+
+static int32_t
+env_tuple_table_json_encode(wasm_exec_env_t exec_env,
+                            wasm_obj_t sb_ref,
+                            wasm_obj_t tuptable_ref) {
+    StringInfo sb =
+        wasm_externref_obj_get_obj(sb_ref, OBJ_STRING_INFO)->body.sb;
+    SPITupleTable *tuptable =
+        wasm_externref_obj_get_obj(tuptable_ref, OBJ_TUPLE_TABLE)
+            ->body.tuptable;
+    appendStringInfoChar(sb, '[');
+    if (!tuptable) {
+        appendStringInfoChar(sb, ']');
+        return sb->len;
+    }
+
+    // Column keys and output functions are resolved once for all rows; the
+    // scratch memory goes away with the context after encoding.
+    TupleDesc tupdesc = tuptable->tupdesc;
+    MemoryContext encode_mctx = AllocSetContextCreate(CurrentMemoryContext,
+                                                      "json_encode",
+                                                      ALLOCSET_SMALL_SIZES);
+    MemoryContext old_mctx = MemoryContextSwitchTo(encode_mctx);
+    PG_TRY();
+    {
+        JsonColumn *columns =
+            (JsonColumn *)palloc(sizeof(JsonColumn) * tupdesc->natts);
+        for (int i = 0; i < tupdesc->natts; i++)
+            rst_init_json_column(&columns[i], TupleDescAttr(tupdesc, i));
+        Datum values[tupdesc->natts];
+        bool nulls[tupdesc->natts];
+        for (uint64 row = 0; row < tuptable->numvals; row++) {
+            if (row > 0)
+                appendStringInfoChar(sb, ',');
+            heap_deform_tuple(tuptable->vals[row], tupdesc, values, nulls);
+            rst_encode_json_row(sb, columns, tupdesc, values, nulls);
+        }
+    }
+    PG_FINALLY();
+    {
+        MemoryContextSwitchTo(old_mctx);
+        MemoryContextDelete(encode_mctx);
+    }
+    PG_END_TRY();
+    appendStringInfoChar(sb, ']');
+    return sb->len;
+}
+
+static NativeSymbol json_schema_symbols[] = {
+    { "json_decode", env_json_decode, "(riii)r" },
+    { "json_encode", env_json_encode, "(rri)i" },
+    { "tuple_table_json_encode", env_tuple_table_json_encode, "(rr)i" },
+};
+
+void
+rst_register_natives_json_schema() {
+    REGISTER_WASM_NATIVES("env", json_schema_symbols);
+}
+
+void
+rst_init_context_for_json_schema(wasm_exec_env_t exec_env) {
+    Context *ctx = (Context *)wasm_runtime_get_user_data(exec_env);
+    wasm_module_inst_t instance = wasm_exec_env_get_module_inst(exec_env);
+    wasm_function_inst_t func =
+        wasm_runtime_lookup_function(instance, "get_json_schemas");
+    if (!func)
+        return;
+
+    // The types were validated by rustica.compile_wasm()
+    wasm_module_t module = (wasm_module_t)ctx->module->module;
+    wasm_func_type_t func_type =
+        wasm_module_lookup_exported_func(module, "get_json_schemas");
+    wasm_struct_type_t schemas_type = wasm_ref_type_get_referred_struct(
+        wasm_func_type_get_result_type(func_type, 0),
+        module,
+        false);
+    uint32 nschemas = wasm_struct_type_get_field_count(schemas_type);
+    if (nschemas == 0)
+        return;
+    int32 targets[nschemas];
+    for (uint32 i = 0; i < nschemas; i++) {
+        wasm_struct_type_t schema_type = wasm_ref_type_get_referred_struct(
+            wasm_struct_type_get_field_type(schemas_type, i, NULL),
+            module,
+            false);
+        targets[i] =
+            wasm_struct_type_get_field_type(schema_type, 1, NULL).heap_type;
+    }
+
+    // Call get_json_schemas() for the keys and copy them out, the GC objects
+    // are not needed after this point.
+    wasm_val_t val;
+    if (!wasm_runtime_call_wasm_a(exec_env, func, 1, &val, 0, NULL))
+        ereport(ERROR, errmsg("failed to call get_json_schemas()"));
+    wasm_struct_obj_t schemas = (wasm_struct_obj_t)val.of.ref;
+    JsonSchema *rv = (JsonSchema *)palloc0(sizeof(JsonSchema) * nschemas);
+    ctx->json_schemas = rv;
+    ctx->njson_schemas = nschemas;
+    for (uint32 i = 0; i < nschemas; i++) {
+        wasm_value_t value;
+        wasm_struct_obj_get_field(schemas, i, false, &value);
+        wasm_struct_obj_t schema = (wasm_struct_obj_t)value.gc_obj;
+
+        // keys: Array[Bytes] { buf: array(externref), len: Int }
+        wasm_struct_obj_get_field(schema, 0, false, &value);
+        wasm_struct_obj_t keys_array = (wasm_struct_obj_t)value.gc_obj;
+        wasm_struct_obj_get_field(keys_array, 1, false, &value);
+        int32 nkeys = value.i32;
+        wasm_struct_obj_get_field(keys_array, 0, false, &value);
+        wasm_array_obj_t keys = (wasm_array_obj_t)value.gc_obj;
+
+        wasm_struct_type_t target_type =
+            (wasm_struct_type_t)wasm_get_defined_type(module, targets[i]);
+        uint32 nfields = wasm_struct_type_get_field_count(target_type);
+        if (nkeys != (int32)nfields)
+            ereport(ERROR,
+                    errmsg("JSON schema #%u has %d keys for %u fields",
+                           i,
+                           nkeys,
+                           nfields));
+        rv[i].type_idx = targets[i];
+        rv[i].nfields = nfields;
+        rv[i].fields =
+            (JsonSchemaField *)palloc0(sizeof(JsonSchemaField) * nfields);
+        for (uint32 f = 0; f < nfields; f++) {
+            JsonSchemaField *field = &rv[i].fields[f];
+            wasm_array_obj_get_elem(keys, f, false, &value);
+            bytea *key = DatumGetByteaPP(
+                wasm_externref_obj_get_datum(value.gc_obj, BYTEAOID));
+            field->keylen = VARSIZE_ANY_EXHDR(key);
+            field->key = pnstrdup(VARDATA_ANY(key), field->keylen);
+            StringInfoData json_key;
+            initStringInfo(&json_key);
+            escape_json(&json_key, field->key);
+            appendStringInfoChar(&json_key, ':');
+            field->json_key = json_key.data;
+            field->json_keylen = json_key.len;
+
+            wasm_ref_type_t type =
+                wasm_struct_type_get_field_type(target_type, f, NULL);
+            field->kind =
+                rst_json_field_kind(type, targets, nschemas, &field->nested);
+            if (field->kind == JSON_FIELD_INVALID)
+                ereport(ERROR,
+                        errmsg("bad type of field %u in JSON schema #%u",
+                               f,
+                               i));
+            field->required =
+                type.value_type == VALUE_TYPE_HT_NON_NULLABLE_REF;
+        }
+    }
+}
+
+void
+rst_free_context_for_json_schema(Context *ctx) {
+    for (uint32 i = 0; i < ctx->njson_schemas; i++) {
+        JsonSchema *schema = &ctx->json_schemas[i];
+        if (!schema->fields)
+            continue;
+        for (uint32 f = 0; f < schema->nfields; f++) {
+            if (schema->fields[f].key)
+                pfree(schema->fields[f].key);
+            if (schema->fields[f].json_key)
+                pfree(schema->fields[f].json_key);
+        }
+        pfree(schema->fields);
+    }
+    if (ctx->json_schemas)
+        pfree(ctx->json_schemas);
+    ctx->json_schemas = NULL;
+    ctx->njson_schemas = 0;
+}
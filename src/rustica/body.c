@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2024-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              https://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#include "postgres.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_type_d.h"
+#include "storage/buffile.h"
+#include "storage/large_object.h"
+#include "utils/memutils.h"
+#include "utils/varlena.h"
+
+#include "wasm_runtime_common.h"
+
+#include "rustica/body.h"
+#include "rustica/copy.h"
+#include "rustica/datatypes.h"
+
+#define SINK_NONE 0
+#define SINK_LARGE_OBJECT 1
+#define SINK_TEMP_FILE 2
+
+// The request body sink of the current request. Once set, body chunks from
+// llhttp are written here instead of being passed to the guest's on_body().
+static int sink = SINK_NONE;
+static LargeObjectDesc *sink_lobj = NULL;
+static BufFile *sink_file = NULL;
+static int64 sink_size = 0;
+static bool sink_rewound = false;
+
+bool
+rst_body_sink_active() {
+    return sink != SINK_NONE;
+}
+
+void
+rst_body_sink_write(const char *data, size_t len) {
+    if (sink_rewound)
+        ereport(ERROR, errmsg("request body sink is already being read"));
+    if (sink == SINK_LARGE_OBJECT)
+        inv_write(sink_lobj, data, (int)len);
+    else
+        BufFileWrite(sink_file, data, len);
+    sink_size += len;
+}
+
+void
+rst_body_sink_reset(bool release) {
+    // On errors, the transaction abort cleans up the descriptor and file
+    if (release) {
+        if (sink_lobj)
+            inv_close(sink_lobj);
+        if (sink_file)
+            BufFileClose(sink_file);
+    }
+    sink = SINK_NONE;
+    sink_lobj = NULL;
+    sink_file = NULL;
+    sink_size = 0;
+    sink_rewound = false;
+}
+
+static void
+ensure_no_sink() {
+    if (sink != SINK_NONE)
+        ereport(ERROR, errmsg("request body sink is already set"));
+}
+
+static void
+rewind_sink() {
+    if (sink == SINK_NONE)
+        ereport(ERROR, errmsg("request body sink is not set"));
+    if (!sink_rewound) {
+        if (sink == SINK_LARGE_OBJECT)
+            inv_seek(sink_lobj, 0, SEEK_SET);
+        else if (BufFileSeek(sink_file, 0, 0, SEEK_SET) != 0)
+            ereport(ERROR,
+                    errcode_for_file_access(),
+                    errmsg("could not rewind request body file: %m"));
+        sink_rewound = true;
+    }
+}
+
+static int32_t
+env_body_to_large_object(wasm_exec_env_t exec_env) {
+    ensure_no_sink();
+    Oid lobj_id = inv_create(InvalidOid);
+    sink_lobj = inv_open(lobj_id, INV_WRITE | INV_READ, TopTransactionContext);
+    sink = SINK_LARGE_OBJECT;
+    return (int32_t)lobj_id;
+}
+
+static int32_t
+env_body_to_temp_file(wasm_exec_env_t exec_env) {
+    ensure_no_sink();
+    MemoryContext mctx = MemoryContextSwitchTo(TopTransactionContext);
+    sink_file = BufFileCreateTemp(false);
+    MemoryContextSwitchTo(mctx);
+    sink = SINK_TEMP_FILE;
+    return 0;
+}
+
+static int64_t
+env_body_size(wasm_exec_env_t exec_env) {
+    return sink_size;
+}
+
+static int32_t
+env_body_read(wasm_exec_env_t exec_env,
+              wasm_obj_t refobj,
+              int32_t start,
+              int32_t len) {
+    Datum bytes = wasm_externref_obj_get_datum(refobj, BYTEAOID);
+    char *view = VARDATA_ANY(DatumGetPointer(bytes));
+    if (start < 0 || len < 0
+        || start + len > VARSIZE_ANY_EXHDR(DatumGetPointer(bytes)))
+        ereport(ERROR, errmsg("body_read: range out of bounds"));
+    rewind_sink();
+    if (sink == SINK_LARGE_OBJECT)
+        return inv_read(sink_lobj, view + start, len);
+    return (int32_t)BufFileReadMaybeEOF(sink_file, view + start, len, true);
+}
+
+static int
+copy_read_body(void *outbuf, int minread, int maxread) {
+    return (int)BufFileReadMaybeEOF(sink_file, outbuf, maxread, true);
+}
+
+static int64_t
+env_body_copy(wasm_exec_env_t exec_env,
+              wasm_obj_t table_ref,
+              wasm_obj_t format_ref) {
+    if (sink != SINK_TEMP_FILE)
+        ereport(ERROR,
+                errmsg("body_copy: request body is not in a temporary file"));
+    text *table =
+        DatumGetTextPP(wasm_externref_obj_get_datum(table_ref, TEXTOID));
+    char *format = wasm_text_copy_cstring(format_ref);
+
+    RangeVar *rv = makeRangeVarFromNameList(textToQualifiedNameList(table));
+    rewind_sink();
+    uint64 processed = rst_copy_from(rv, NIL, format, copy_read_body);
+    return (int64_t)processed;
+}
+
+static NativeSymbol body_symbols[] = {
+    { "body_to_large_object", env_body_to_large_object, "()i" },
+    { "body_to_temp_file", env_body_to_temp_file, "()i" },
+    { "body_size", env_body_size, "()I" },
+    { "body_read", env_body_read, "(rii)i" },
+    { "body_copy", env_body_copy, "(rr)I" },
+};
+
+void
+rst_register_natives_body() {
+    REGISTER_WASM_NATIVES("env", body_symbols);
+}
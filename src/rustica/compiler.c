@@ -91,6 +91,11 @@ compile_query(CommonHeapTypes *heap_types,
               wasm_ref_type_t ref_type,
               wasm_struct_obj_t query);
 
+static void
+compile_json_schemas(CommonHeapTypes *heap_types,
+                     wasm_func_type_t func_type,
+                     wasm_module_t module);
+
 static wasm_to_pg_fn
 wasm_to_pg(wasm_exec_env_t exec_env,
            CommonHeapTypes *heap_types,
@@ -286,6 +291,9 @@ run_and_compile(wasm_module_t module,
     if ((func_type = wasm_module_lookup_exported_func(module, "get_queries")))
         *queries_out =
             compile_queries(&heap_types, query_oid, func_type, module);
+    if ((func_type =
+             wasm_module_lookup_exported_func(module, "get_json_schemas")))
+        compile_json_schemas(&heap_types, func_type, module);
 
     // Construct result array of heap_types
     int size = sizeof(CommonHeapTypes) / sizeof(int32_t);
@@ -698,6 +706,79 @@ compile_query(CommonHeapTypes *heap_types,
                                                          'i'));
 }
 
+static void
+compile_json_schemas(CommonHeapTypes *heap_types,
+                     wasm_func_type_t func_type,
+                     wasm_module_t module) {
+    // Validate the signature of get_json_schemas()
+    if (wasm_func_type_get_param_count(func_type) != 0)
+        ereport(ERROR, errmsg("get_json_schemas() must take no arguments"));
+    if (wasm_func_type_get_result_count(func_type) != 1)
+        ereport(ERROR,
+                errmsg("get_json_schemas() must return exactly 1 value"));
+    wasm_struct_type_t schemas_type = wasm_ref_type_get_referred_struct(
+        wasm_func_type_get_result_type(func_type, 0),
+        module,
+        false);
+    if (!schemas_type)
+        ereport(ERROR,
+                errmsg("get_json_schemas() must return a non-nullable struct"));
+    uint32 nschemas = wasm_struct_type_get_field_count(schemas_type);
+    if (nschemas > 65535)
+        ereport(ERROR, errmsg("get_json_schemas() returned too many schemas"));
+
+    // Each schema is a struct of the JSON keys and the target struct type
+    int32 targets[nschemas];
+    wasm_struct_type_t target_types[nschemas];
+    for (uint32 i = 0; i < nschemas; i++) {
+        wasm_ref_type_t ref_type =
+            wasm_struct_type_get_field_type(schemas_type, i, NULL);
+        wasm_struct_type_t schema_type =
+            wasm_ref_type_get_referred_struct(ref_type, module, false);
+        if (!schema_type || wasm_struct_type_get_field_count(schema_type) != 2)
+            ereport(ERROR,
+                    errmsg("JSON schema #%u must be a struct of 2 fields", i));
+
+        // first field: MoonBit array of the JSON keys in bytes
+        ref_type = wasm_struct_type_get_field_type(schema_type, 0, NULL);
+        if (!validate_moonbit_array(ref_type, module, &ref_type, NULL, false)
+            || (ref_type.value_type != VALUE_TYPE_EXTERNREF
+                && ref_type.heap_type != HEAP_TYPE_EXTERN))
+            ereport(ERROR,
+                    errmsg("keys of JSON schema #%u must be an array of bytes",
+                           i));
+
+        // second field: nullable target struct, only the type is used
+        ref_type = wasm_struct_type_get_field_type(schema_type, 1, NULL);
+        if (!(target_types[i] =
+                  wasm_ref_type_get_referred_struct(ref_type, module, true)))
+            ereport(ERROR,
+                    errmsg("target of JSON schema #%u must be a nullable "
+                           "struct",
+                           i));
+        targets[i] = ref_type.heap_type;
+    }
+
+    // Derive how each target field is decoded; nested objects must have a
+    // schema of their own in the same module.
+    for (uint32 i = 0; i < nschemas; i++) {
+        uint32 nfields = wasm_struct_type_get_field_count(target_types[i]);
+        for (uint32 f = 0; f < nfields; f++) {
+            int32 nested;
+            wasm_ref_type_t ref_type =
+                wasm_struct_type_get_field_type(target_types[i], f, NULL);
+            if (rst_json_field_kind(ref_type, targets, nschemas, &nested)
+                == JSON_FIELD_INVALID)
+                ereport(ERROR,
+                        errmsg("unsupported type %s of field %u in JSON "
+                               "schema #%u",
+                               wasm_ref_type_repr(heap_types, ref_type),
+                               f,
+                               i));
+        }
+    }
+}
+
 static wasm_to_pg_fn
 wasm_to_pg(wasm_exec_env_t exec_env,
            CommonHeapTypes *heap_types,
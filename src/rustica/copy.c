@@ -0,0 +1,341 @@
+/*
+ * Copyright (c) 2024-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              https://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#include "postgres.h"
+#include "access/table.h"
+#include "executor/executor.h"
+#include "executor/spi.h"
+#include "nodes/makefuncs.h"
+#include "parser/parse_relation.h"
+#include "port/pg_bswap.h"
+#include "storage/buffile.h"
+#include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/plancache.h"
+#include "utils/rel.h"
+#include "utils/rls.h"
+
+#include "wasm_runtime_common.h"
+
+#include "rustica/copy.h"
+#include "rustica/module.h"
+#include "rustica/query.h"
+
+static const char binary_signature[11] = "PGCOPY\n\377\r\n\0";
+
+// Rows of the COPY in progress are spooled in binary COPY format to a
+// temporary file, which CopyFrom() then reads at copy_end(). If any argument
+// type doesn't match its column, the text format is used instead.
+typedef struct CopyState {
+    MemoryContext mctx;
+    MemoryContext row_mctx;
+    QueryPlan *plan;
+    int32 idx;
+    RangeVar *relation;
+    List *columns;
+    int ncolumns;
+    int *params; // index of the query argument for each column
+    bool binary;
+    FmgrInfo *out_funcs; // send or output functions of the arguments
+    BufFile *file;
+    int32 nrows;
+} CopyState;
+
+static CopyState *copy = NULL;
+
+uint64
+rst_copy_from(RangeVar *relation,
+              List *attnamelist,
+              const char *format,
+              copy_data_source_cb data_source_cb) {
+    // Same checks as COPY FROM does
+    Relation rel = table_openrv(relation, RowExclusiveLock);
+    ParseState *pstate = make_parsestate(NULL);
+    ParseNamespaceItem *nsitem =
+        addRangeTableEntryForRelation(pstate,
+                                      rel,
+                                      RowExclusiveLock,
+                                      NULL,
+                                      false,
+                                      false);
+    nsitem->p_perminfo->requiredPerms = ACL_INSERT;
+    ExecCheckPermissions(pstate->p_rtable,
+                         list_make1(nsitem->p_perminfo),
+                         true);
+    if (check_enable_rls(RelationGetRelid(rel), InvalidOid, false)
+        == RLS_ENABLED)
+        ereport(ERROR,
+                errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                errmsg("COPY FROM not supported with row-level security"));
+
+    List *options = list_make1(
+        makeDefElem("format", (Node *)makeString(pstrdup(format)), -1));
+    CopyFromState cstate = BeginCopyFrom(pstate,
+                                         rel,
+                                         NULL,
+                                         NULL,
+                                         false,
+                                         data_source_cb,
+                                         attnamelist,
+                                         options);
+    uint64 processed = CopyFrom(cstate);
+    EndCopyFrom(cstate);
+    free_parsestate(pstate);
+    table_close(rel, NoLock);
+    return processed;
+}
+
+void
+rst_copy_reset(bool release) {
+    if (copy == NULL)
+        return;
+
+    // On errors, the transaction abort cleans up the file and memory
+    if (release) {
+        if (copy->file)
+            BufFileClose(copy->file);
+        MemoryContextDelete(copy->mctx);
+    }
+    copy = NULL;
+}
+
+static InsertStmt *
+get_insert_stmt(QueryPlan *plan, int idx) {
+    List *sources = SPI_plan_get_plan_sources(plan->plan);
+    if (list_length(sources) == 1) {
+        CachedPlanSource *source = linitial(sources);
+        Node *stmt = source->raw_parse_tree ? source->raw_parse_tree->stmt
+                                            : NULL;
+        if (stmt && IsA(stmt, InsertStmt)) {
+            InsertStmt *insert = (InsertStmt *)stmt;
+            SelectStmt *select = (SelectStmt *)insert->selectStmt;
+            if (insert->cols != NIL && insert->onConflictClause == NULL
+                && insert->returningList == NIL && insert->withClause == NULL
+                && select && IsA(select, SelectStmt)
+                && list_length(select->valuesLists) == 1
+                && list_length(linitial(select->valuesLists))
+                       == list_length(insert->cols))
+                return insert;
+        }
+    }
+    ereport(ERROR,
+            errmsg("copy_begin: query #%d is not a plain "
+                   "INSERT INTO t (...) VALUES ($1, ...)",
+                   idx));
+}
+
+static void
+write_int32(int32 value) {
+    uint32 buf = pg_hton32((uint32)value);
+    BufFileWrite(copy->file, &buf, sizeof(buf));
+}
+
+static void
+write_int16(int16 value) {
+    uint16 buf = pg_hton16((uint16)value);
+    BufFileWrite(copy->file, &buf, sizeof(buf));
+}
+
+// Escapes a field of a text COPY like COPY TO does
+static void
+write_text_field(const char *str) {
+    const char *start = str;
+    for (const char *p = str; *p; p++) {
+        char esc[2] = { '\\', 0 };
+        switch (*p) {
+            case '\\':
+                esc[1] = '\\';
+                break;
+            case '\n':
+                esc[1] = 'n';
+                break;
+            case '\r':
+                esc[1] = 'r';
+                break;
+            case '\t':
+                esc[1] = 't';
+                break;
+            default:
+                continue;
+        }
+        BufFileWrite(copy->file, start, p - start);
+        BufFileWrite(copy->file, esc, sizeof(esc));
+        start = p + 1;
+    }
+    BufFileWrite(copy->file, start, strlen(start));
+}
+
+static int32_t
+env_copy_begin(wasm_exec_env_t exec_env, int32_t idx) {
+    Context *ctx = (Context *)wasm_runtime_get_user_data(exec_env);
+    if (copy != NULL)
+        ereport(ERROR, errmsg("copy_begin: a COPY is already in progress"));
+    if (idx < 0 || idx >= ctx->module->nqueries)
+        ereport(ERROR, errmsg("no such query: #%d", idx));
+    QueryPlan *plan = ctx->module->queries + idx;
+    InsertStmt *insert = get_insert_stmt(plan, idx);
+    List *values = linitial(((SelectStmt *)insert->selectStmt)->valuesLists);
+
+    MemoryContext mctx = AllocSetContextCreate(TopTransactionContext,
+                                               "rustica copy",
+                                               ALLOCSET_DEFAULT_SIZES);
+    MemoryContext old_mctx = MemoryContextSwitchTo(mctx);
+    CopyState *state = palloc0(sizeof(CopyState));
+    state->mctx = mctx;
+    state->row_mctx = AllocSetContextCreate(mctx,
+                                            "rustica copy row",
+                                            ALLOCSET_DEFAULT_SIZES);
+    state->plan = plan;
+    state->idx = idx;
+    state->relation = copyObject(insert->relation);
+    state->ncolumns = list_length(insert->cols);
+    state->params = palloc(sizeof(int) * state->ncolumns);
+    state->binary = true;
+    state->out_funcs = palloc(sizeof(FmgrInfo) * state->ncolumns);
+
+    // Columns take the arguments in the order of the VALUES list. The binary
+    // format is only usable if the receive function of every column can read
+    // what the send function of its argument type writes.
+    Relation rel = table_openrv(state->relation, RowExclusiveLock);
+    ListCell *col, *val;
+    int i = 0;
+    forboth(col, insert->cols, val, values) {
+        ResTarget *target = lfirst_node(ResTarget, col);
+        Node *value = lfirst(val);
+        if (!IsA(value, ParamRef) || target->indirection != NIL
+            || ((ParamRef *)value)->number < 1
+            || ((ParamRef *)value)->number > plan->nargs)
+            ereport(ERROR,
+                    errmsg("copy_begin: query #%d may only insert plain "
+                           "parameters into columns",
+                           idx));
+        state->columns =
+            lappend(state->columns, makeString(pstrdup(target->name)));
+        state->params[i] = ((ParamRef *)value)->number - 1;
+        AttrNumber attnum = attnameAttNum(rel, target->name, false);
+        if (attnum <= 0)
+            ereport(ERROR,
+                    errcode(ERRCODE_UNDEFINED_COLUMN),
+                    errmsg("column \"%s\" of relation \"%s\" does not exist",
+                           target->name,
+                           RelationGetRelationName(rel)));
+        Oid atttypid =
+            TupleDescAttr(RelationGetDescr(rel), attnum - 1)->atttypid;
+        Oid argtype = plan->argtypes[state->params[i]];
+        if (argtype != atttypid && argtype != getBaseType(atttypid))
+            state->binary = false;
+        i++;
+    }
+    table_close(rel, NoLock);
+
+    for (i = 0; i < state->ncolumns; i++) {
+        Oid func;
+        bool is_varlena;
+        if (state->binary)
+            getTypeBinaryOutputInfo(plan->argtypes[state->params[i]],
+                                    &func,
+                                    &is_varlena);
+        else
+            getTypeOutputInfo(plan->argtypes[state->params[i]],
+                              &func,
+                              &is_varlena);
+        fmgr_info(func, &state->out_funcs[i]);
+    }
+
+    state->file = BufFileCreateTemp(false);
+    MemoryContextSwitchTo(old_mctx);
+    copy = state;
+
+    // Binary COPY header: signature, flags and header extension length
+    if (copy->binary) {
+        BufFileWrite(copy->file, binary_signature, sizeof(binary_signature));
+        write_int32(0);
+        write_int32(0);
+    }
+    return 0;
+}
+
+static int32_t
+env_copy_append_row(wasm_exec_env_t exec_env, wasm_obj_t args_ref) {
+    if (copy == NULL)
+        ereport(ERROR, errmsg("copy_append_row: no COPY in progress"));
+    Context *ctx = (Context *)wasm_runtime_get_user_data(exec_env);
+    if (!rst_is_query_args(ctx, copy->idx, args_ref))
+        ereport(ERROR, errmsg("copy_append_row: expected query arguments"));
+    wasm_struct_obj_t args = (wasm_struct_obj_t)args_ref;
+    QueryPlan *plan = copy->plan;
+
+    // Convert with the same functions execute_statement uses
+    MemoryContext old_mctx = MemoryContextSwitchTo(copy->row_mctx);
+    if (copy->binary)
+        write_int16((int16)copy->ncolumns);
+    for (int i = 0; i < copy->ncolumns; i++) {
+        int arg = copy->params[i];
+        wasm_value_t val;
+        wasm_struct_obj_get_field(args, arg, false, &val);
+        Datum value =
+            plan->wasm_to_pg_funcs[arg](exec_env, plan->argtypes[arg], val);
+        if (copy->binary) {
+            bytea *out = SendFunctionCall(&copy->out_funcs[i], value);
+            write_int32((int32)VARSIZE(out) - VARHDRSZ);
+            BufFileWrite(copy->file, VARDATA(out), VARSIZE(out) - VARHDRSZ);
+        }
+        else {
+            if (i > 0)
+                BufFileWrite(copy->file, "\t", 1);
+            write_text_field(OutputFunctionCall(&copy->out_funcs[i], value));
+        }
+    }
+    if (!copy->binary)
+        BufFileWrite(copy->file, "\n", 1);
+    MemoryContextSwitchTo(old_mctx);
+    MemoryContextReset(copy->row_mctx);
+    return ++copy->nrows;
+}
+
+static int
+copy_read_rows(void *outbuf, int minread, int maxread) {
+    return (int)BufFileReadMaybeEOF(copy->file, outbuf, maxread, true);
+}
+
+static int64_t
+env_copy_end(wasm_exec_env_t exec_env) {
+    if (copy == NULL)
+        ereport(ERROR, errmsg("copy_end: no COPY in progress"));
+    if (copy->binary)
+        write_int16(-1);
+    if (BufFileSeek(copy->file, 0, 0, SEEK_SET) != 0)
+        ereport(ERROR,
+                errcode_for_file_access(),
+                errmsg("could not rewind COPY file: %m"));
+    uint64 processed = rst_copy_from(copy->relation,
+                                     copy->columns,
+                                     copy->binary ? "binary" : "text",
+                                     copy_read_rows);
+    rst_copy_reset(true);
+    return (int64_t)processed;
+}
+
+static NativeSymbol copy_symbols[] = {
+    { "copy_begin", env_copy_begin, "(i)i" },
+    { "copy_append_row", env_copy_append_row, "(r)i" },
+    { "copy_end", env_copy_end, "()I" },
+};
+
+void
+rst_register_natives_copy() {
+    REGISTER_WASM_NATIVES("env", copy_symbols);
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright (c) 2024-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              https://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#ifndef RUSTICA_COPY_H
+#define RUSTICA_COPY_H
+
+#include "postgres.h"
+#include "commands/copy.h"
+
+uint64
+rst_copy_from(RangeVar *relation,
+              List *attnamelist,
+              const char *format,
+              copy_data_source_cb data_source_cb);
+
+void
+rst_copy_reset(bool release);
+
+void
+rst_register_natives_copy();
+
+#endif /* RUSTICA_COPY_H */
@@ -20,6 +20,8 @@
 #include "rustica/datatypes.h"
 #include "rustica/wamr.h"
 
+int64 rst_live_objs = 0;
+
 static void
 obj_finalizer(wasm_obj_t wasm_obj, void *ptr) {
     obj_t obj = (obj_t)wasm_anyref_obj_get_value((wasm_anyref_obj_t)wasm_obj);
@@ -67,6 +69,7 @@ obj_finalizer(wasm_obj_t wasm_obj, void *ptr) {
             break;
 
         case OBJ_HEAP_TUPLE:
+        case OBJ_HEADERS:
             break;
 
         default:
@@ -78,6 +81,7 @@ obj_finalizer(wasm_obj_t wasm_obj, void *ptr) {
     }
 
     pfree(obj);
+    rst_live_objs--;
 }
 
 wasm_externref_obj_t
@@ -87,6 +91,7 @@ rst_externref_of_obj(wasm_exec_env_t exec_env, obj_t obj) {
                               wasm_externref_obj_to_internal_obj(rv),
                               obj_finalizer,
                               exec_env);
+    rst_live_objs++;
     return rv;
 }
 
@@ -94,6 +99,7 @@ wasm_obj_t
 rst_anyref_of_obj(wasm_exec_env_t exec_env, obj_t obj) {
     wasm_obj_t rv = (wasm_obj_t)wasm_anyref_obj_new(exec_env, obj);
     wasm_obj_set_gc_finalizer(exec_env, rv, obj_finalizer, exec_env);
+    rst_live_objs++;
     return rv;
 }
 
@@ -43,11 +43,44 @@
 #define OBJ_PORTAL 3
 #define OBJ_TUPLE_TABLE 4
 #define OBJ_HEAP_TUPLE 5
+#define OBJ_HEADERS 6
 
 #define OBJ_REFERENCING (1 << 0)
 #define OBJ_OWNS_BODY (1 << 1)
 #define OBJ_OWNS_BODY_MEMBERS (1 << 2)
 
+// How a field of a JSON schema target struct is decoded
+typedef enum JsonFieldKind {
+    JSON_FIELD_INVALID = -1,
+    JSON_FIELD_I32,    // true/false or an integer
+    JSON_FIELD_I64,    // integer
+    JSON_FIELD_F32,    // number
+    JSON_FIELD_F64,    // number
+    JSON_FIELD_TEXT,   // string as an externref of text
+    JSON_FIELD_OBJECT, // object decoded by another schema of the module
+} JsonFieldKind;
+
+typedef enum JsonColumnKind {
+    JSON_COLUMN_BOOL,
+    JSON_COLUMN_INT2,
+    JSON_COLUMN_INT4,
+    JSON_COLUMN_INT8,
+    JSON_COLUMN_FLOAT4,
+    JSON_COLUMN_FLOAT8,
+    JSON_COLUMN_NUMERIC,
+    JSON_COLUMN_TEXT,
+    JSON_COLUMN_JSON,
+    JSON_COLUMN_JSONB,
+    JSON_COLUMN_OTHER,
+} JsonColumnKind;
+
+// Column of a result set encoded natively as a JSON object member
+typedef struct JsonColumn {
+    JsonColumnKind kind;
+    FmgrInfo output; // only for JSON_COLUMN_NUMERIC and JSON_COLUMN_OTHER
+    StringInfoData json_key;
+} JsonColumn;
+
 typedef uint16_t ObjType;
 
 typedef struct Obj {
@@ -59,6 +92,7 @@ typedef struct Obj {
     union {
         Oid oid;           // only for OBJ_DATUM
         int32_t query_idx; // OBJ_PORTAL, OBJ_TUPLE_TABLE
+        uint32 generation; // OBJ_HEADERS
     };
 
     // pointer-sized body
@@ -77,6 +111,9 @@ typedef struct Obj {
     wasm_local_obj_ref_t ref[]; // only when OBJ_REFERENCING is set
 } Obj, *obj_t;
 
+// Number of objects with a pending finalizer, i.e. still owning host memory
+extern int64 rst_live_objs;
+
 wasm_externref_obj_t
 rst_externref_of_obj(wasm_exec_env_t exec_env, obj_t obj);
 
@@ -119,6 +156,9 @@ rst_register_natives_date();
 void
 rst_register_natives_jsonb();
 
+void
+rst_register_natives_json_schema();
+
 void
 rst_register_natives_json();
 
@@ -140,4 +180,23 @@ rst_register_natives_uuid();
 void
 rst_init_context_for_jsonb(wasm_exec_env_t exec_env);
 
+JsonFieldKind
+rst_json_field_kind(wasm_ref_type_t type,
+                    const int32 *targets,
+                    uint32 ntargets,
+                    int32 *nested);
+
+void
+rst_init_context_for_json_schema(wasm_exec_env_t exec_env);
+
+void
+rst_init_json_column(JsonColumn *column, Form_pg_attribute attr);
+
+void
+rst_encode_json_row(StringInfo sb,
+                    JsonColumn *columns,
+                    TupleDesc tupdesc,
+                    Datum *values,
+                    bool *nulls);
+
 #endif /* RUSTICA_DATATYPES_H */
@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2024-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              https://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#include "postgres.h"
+#include "access/htup_details.h"
+#include "port/pg_bswap.h"
+#include "utils/lsyscache.h"
+
+#include "rustica/datatypes.h"
+#include "rustica/export.h"
+
+static const char binary_signature[11] = "PGCOPY\n\377\r\n\0";
+
+int
+rst_export_format(const char *name) {
+    if (strcmp(name, "json") == 0)
+        return EXPORT_JSON;
+    if (strcmp(name, "ndjson") == 0)
+        return EXPORT_NDJSON;
+    if (strcmp(name, "csv") == 0)
+        return EXPORT_CSV;
+    if (strcmp(name, "binary") == 0)
+        return EXPORT_BINARY;
+    ereport(ERROR, errmsg("unknown export format: %s", name));
+}
+
+static void
+append_int32(StringInfo buf, int32 value) {
+    uint32 n = pg_hton32((uint32)value);
+    appendBinaryStringInfo(buf, (char *)&n, sizeof(n));
+}
+
+static void
+append_int16(StringInfo buf, int16 value) {
+    uint16 n = pg_hton16((uint16)value);
+    appendBinaryStringInfo(buf, (char *)&n, sizeof(n));
+}
+
+static void
+append_csv_value(StringInfo buf, const char *value) {
+    // Quote empty strings too, so that they are told apart from NULL
+    if (*value != '\0' && strpbrk(value, ",\"\r\n") == NULL) {
+        appendStringInfoString(buf, value);
+        return;
+    }
+    appendStringInfoCharMacro(buf, '"');
+    for (const char *p = value; *p; p++) {
+        if (*p == '"')
+            appendStringInfoCharMacro(buf, '"');
+        appendStringInfoCharMacro(buf, *p);
+    }
+    appendStringInfoCharMacro(buf, '"');
+}
+
+void
+rst_export_begin(ExportState *state,
+                 int format,
+                 TupleDesc tupdesc,
+                 StringInfo buf) {
+    int natts = tupdesc->natts;
+    Oid func;
+    bool is_varlena;
+
+    state->format = format;
+    state->first = true;
+    state->values = palloc(sizeof(Datum) * natts);
+    state->nulls = palloc(sizeof(bool) * natts);
+    state->out_funcs = NULL;
+    state->json_columns = NULL;
+
+    switch (format) {
+        case EXPORT_JSON:
+        case EXPORT_NDJSON:
+            // Same encoding as tuple_table_json_encode, resolved once
+            state->tupdesc = tupdesc;
+            state->json_columns = palloc(sizeof(JsonColumn) * natts);
+            for (int i = 0; i < natts; i++)
+                rst_init_json_column(&state->json_columns[i],
+                                     TupleDescAttr(tupdesc, i));
+            if (format == EXPORT_JSON)
+                appendStringInfoCharMacro(buf, '[');
+            break;
+
+        case EXPORT_CSV:
+            state->tupdesc = tupdesc;
+            state->out_funcs = palloc(sizeof(FmgrInfo) * natts);
+            for (int i = 0; i < natts; i++) {
+                Form_pg_attribute attr = TupleDescAttr(tupdesc, i);
+                getTypeOutputInfo(attr->atttypid, &func, &is_varlena);
+                fmgr_info(func, &state->out_funcs[i]);
+                if (i > 0)
+                    appendStringInfoCharMacro(buf, ',');
+                append_csv_value(buf, NameStr(attr->attname));
+            }
+            appendStringInfoString(buf, "\r\n");
+            break;
+
+        case EXPORT_BINARY:
+            state->tupdesc = tupdesc;
+            state->out_funcs = palloc(sizeof(FmgrInfo) * natts);
+            for (int i = 0; i < natts; i++) {
+                getTypeBinaryOutputInfo(TupleDescAttr(tupdesc, i)->atttypid,
+                                        &func,
+                                        &is_varlena);
+                fmgr_info(func, &state->out_funcs[i]);
+            }
+            // Signature, flags and header extension length
+            appendBinaryStringInfo(buf,
+                                   binary_signature,
+                                   sizeof(binary_signature));
+            append_int32(buf, 0);
+            append_int32(buf, 0);
+            break;
+
+        default:
+            ereport(ERROR, errmsg("unknown export format: %d", format));
+    }
+}
+
+void
+rst_export_row(ExportState *state, HeapTuple tuple, StringInfo buf) {
+    TupleDesc tupdesc = state->tupdesc;
+
+    heap_deform_tuple(tuple, tupdesc, state->values, state->nulls);
+    if (state->format == EXPORT_JSON || state->format == EXPORT_NDJSON) {
+        if (state->format == EXPORT_JSON && !state->first)
+            appendStringInfoCharMacro(buf, ',');
+        rst_encode_json_row(buf,
+                            state->json_columns,
+                            tupdesc,
+                            state->values,
+                            state->nulls);
+        if (state->format == EXPORT_NDJSON)
+            appendStringInfoCharMacro(buf, '\n');
+        state->first = false;
+        return;
+    }
+    if (state->format == EXPORT_CSV) {
+        for (int i = 0; i < tupdesc->natts; i++) {
+            if (i > 0)
+                appendStringInfoCharMacro(buf, ',');
+            if (!state->nulls[i])
+                append_csv_value(buf,
+                                 OutputFunctionCall(&state->out_funcs[i],
+                                                    state->values[i]));
+        }
+        appendStringInfoString(buf, "\r\n");
+    }
+    else {
+        append_int16(buf, (int16)tupdesc->natts);
+        for (int i = 0; i < tupdesc->natts; i++) {
+            if (state->nulls[i]) {
+                append_int32(buf, -1);
+                continue;
+            }
+            bytea *out =
+                SendFunctionCall(&state->out_funcs[i], state->values[i]);
+            append_int32(buf, (int32)VARSIZE(out) - VARHDRSZ);
+            appendBinaryStringInfo(buf, VARDATA(out), VARSIZE(out) - VARHDRSZ);
+        }
+    }
+    state->first = false;
+}
+
+void
+rst_export_end(ExportState *state, StringInfo buf) {
+    if (state->format == EXPORT_JSON)
+        appendStringInfoCharMacro(buf, ']');
+    else if (state->format == EXPORT_BINARY)
+        append_int16(buf, -1);
+}
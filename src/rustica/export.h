@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2024-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              https://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#ifndef RUSTICA_EXPORT_H
+#define RUSTICA_EXPORT_H
+
+#include "postgres.h"
+#include "access/htup.h"
+#include "access/tupdesc.h"
+#include "lib/stringinfo.h"
+
+#define EXPORT_JSON 0   // one JSON array of row objects
+#define EXPORT_NDJSON 1 // one JSON object per line
+#define EXPORT_CSV 2    // with a header line of column names
+#define EXPORT_BINARY 3 // COPY BINARY
+
+typedef struct JsonColumn JsonColumn;
+
+// Serializes rows natively, so that a result set can be written out
+// without lowering every row into the guest.
+typedef struct ExportState {
+    int format;
+    TupleDesc tupdesc;
+    FmgrInfo *out_funcs;     // output or send functions, per attribute
+    JsonColumn *json_columns; // JSON encoders, per attribute
+    Datum *values;
+    bool *nulls;
+    bool first;
+} ExportState;
+
+int
+rst_export_format(const char *name);
+
+void
+rst_export_begin(ExportState *state,
+                 int format,
+                 TupleDesc tupdesc,
+                 StringInfo buf);
+
+void
+rst_export_row(ExportState *state, HeapTuple tuple, StringInfo buf);
+
+void
+rst_export_end(ExportState *state, StringInfo buf);
+
+#endif /* RUSTICA_EXPORT_H */
@@ -15,14 +15,49 @@
  */
 
 #include "postgres.h"
+#include "postmaster/postmaster.h"
 #include "utils/guc.h"
 
 #include "rustica/gucs.h"
+#include "rustica/utils.h"
 
 char *rst_listen_addresses = NULL;
 int rst_port = 8080;
 int rst_worker_idle_timeout = 60;
 char *rst_database = NULL;
+int rst_keepalive_timeout = 0;
+int rst_keepalive_linger = 50;
+bool rst_reuseport = false;
+int rst_reuseport_workers = 4;
+int rst_min_workers = 0;
+int rst_max_workers = 0;
+int rst_io_method = IO_METHOD_EPOLL;
+int rst_dispatch_policy = DISPATCH_LIFO;
+int rst_dispatch_batch_size = 1;
+int rst_recv_timeout = 30000;
+int rst_send_timeout = 30000;
+int rst_max_queue_depth = 1024;
+int rst_queue_timeout = 0;
+int rst_retry_after = 1;
+int rst_max_stat_queries = 5000;
+int rst_trace_buffer_size = 1024;
+int rst_log_min_duration = -1;
+double rst_log_sample_rate = 1.0;
+int rst_max_routes = 256;
+
+static const struct config_enum_entry io_method_options[] = {
+    { "epoll", IO_METHOD_EPOLL, false },
+#ifdef RUSTICA_IO_URING
+    { "io_uring", IO_METHOD_IO_URING, false },
+#endif
+    { NULL, 0, false },
+};
+
+static const struct config_enum_entry dispatch_policy_options[] = {
+    { "lifo", DISPATCH_LIFO, false },
+    { "fifo", DISPATCH_FIFO, false },
+    { NULL, 0, false },
+};
 
 void
 rst_init_gucs() {
@@ -51,7 +86,9 @@ rst_init_gucs() {
                             NULL);
     DefineCustomIntVariable("rustica.worker_idle_timeout",
                             "Sets the worker idle timeout in seconds.",
-                            "Default is 60; 0 for no timeout.",
+                            "Workers above rustica.min_workers are stopped "
+                            "when idle for longer. Default is 60; 0 for no "
+                            "timeout.",
                             &rst_worker_idle_timeout,
                             60,
                             0,
@@ -71,4 +108,272 @@ rst_init_gucs() {
                                NULL,
                                NULL,
                                NULL);
+    DefineCustomIntVariable("rustica.keepalive_timeout",
+                            "Sets the idle timeout of keep-alive HTTP "
+                            "connections in seconds.",
+                            "With rustica.reuseport, idle connections are "
+                            "only kept for rustica.keepalive_linger. Default "
+                            "is 0, which disables keep-alive.",
+                            &rst_keepalive_timeout,
+                            0,
+                            0,
+                            3600,
+                            PGC_USERSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+    DefineCustomIntVariable("rustica.keepalive_linger",
+                            "Sets how long a worker waits for the next request "
+                            "on a keep-alive connection in milliseconds.",
+                            "Idle connections are handed back to the master "
+                            "afterwards, or closed with rustica.reuseport. "
+                            "Default is 50.",
+                            &rst_keepalive_linger,
+                            50,
+                            0,
+                            60000,
+                            PGC_USERSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+    DefineCustomBoolVariable("rustica.reuseport",
+                             "Lets workers accept connections directly on "
+                             "their own SO_REUSEPORT sockets.",
+                             "Default is off: the master accepts connections "
+                             "and passes them to idle workers.",
+                             &rst_reuseport,
+                             false,
+                             PGC_USERSET,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+    DefineCustomIntVariable("rustica.reuseport_workers",
+                            "Sets the number of workers accepting on "
+                            "SO_REUSEPORT sockets.",
+                            "Only used when rustica.reuseport is on. "
+                            "Default is 4.",
+                            &rst_reuseport_workers,
+                            4,
+                            1,
+                            MAX_BACKENDS,
+                            PGC_USERSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+    DefineCustomIntVariable("rustica.min_workers",
+                            "Sets the number of workers kept running even "
+                            "when idle.",
+                            "They are started with the master and load the "
+                            "application before taking jobs. Default is 0.",
+                            &rst_min_workers,
+                            0,
+                            0,
+                            MAX_BACKENDS,
+                            PGC_USERSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+    DefineCustomIntVariable("rustica.max_workers",
+                            "Sets the maximum number of workers.",
+                            "Default is 0, limited only by "
+                            "max_worker_processes.",
+                            &rst_max_workers,
+                            0,
+                            0,
+                            MAX_BACKENDS,
+                            PGC_USERSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+    DefineCustomEnumVariable("rustica.io_method",
+                             "Selects the method for socket I/O.",
+                             "io_uring is only available when built with "
+                             "IO_URING=1, it falls back to epoll if the "
+                             "kernel doesn't support it. Default is epoll.",
+                             &rst_io_method,
+                             IO_METHOD_EPOLL,
+                             io_method_options,
+                             PGC_USERSET,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+    DefineCustomEnumVariable("rustica.dispatch_policy",
+                             "Selects which idle worker takes a new job.",
+                             "lifo picks the most recently idle worker, which "
+                             "has the warmest caches and lets surplus workers "
+                             "reach rustica.worker_idle_timeout; fifo picks "
+                             "the longest idle one, spreading jobs over all "
+                             "workers. Either prefers workers that have the "
+                             "routed module loaded. Default is lifo.",
+                             &rst_dispatch_policy,
+                             DISPATCH_LIFO,
+                             dispatch_policy_options,
+                             PGC_USERSET,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+    DefineCustomIntVariable("rustica.dispatch_batch_size",
+                            "Sets how many queued connections a worker takes "
+                            "at once.",
+                            "They are passed in one message and served in "
+                            "turn, which saves the master a round trip per "
+                            "connection when jobs queue up, at the cost of "
+                            "waiting behind each other. Always 1 while "
+                            "keep-alive is enabled. Default is 1.",
+                            &rst_dispatch_batch_size,
+                            1,
+                            1,
+                            FD_BATCH_MAX,
+                            PGC_USERSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+    DefineCustomIntVariable("rustica.recv_timeout",
+                            "Sets how long receiving an HTTP request may "
+                            "take in milliseconds.",
+                            "Counted from the start of the request. "
+                            "Default is 30000; 0 for no timeout.",
+                            &rst_recv_timeout,
+                            30000,
+                            0,
+                            INT_MAX,
+                            PGC_USERSET,
+                            GUC_UNIT_MS,
+                            NULL,
+                            NULL,
+                            NULL);
+    DefineCustomIntVariable("rustica.send_timeout",
+                            "Sets how long sending an HTTP response may "
+                            "take in milliseconds.",
+                            "Counted from the first send of the request. "
+                            "Default is 30000; 0 for no timeout.",
+                            &rst_send_timeout,
+                            30000,
+                            0,
+                            INT_MAX,
+                            PGC_USERSET,
+                            GUC_UNIT_MS,
+                            NULL,
+                            NULL,
+                            NULL);
+    DefineCustomIntVariable("rustica.max_queue_depth",
+                            "Sets the maximum number of connections waiting "
+                            "in the master for an idle worker.",
+                            "Connections beyond are answered with 503 "
+                            "Service Unavailable by the master. Default is "
+                            "1024.",
+                            &rst_max_queue_depth,
+                            1024,
+                            1,
+                            1024 * 1024,
+                            PGC_USERSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+    DefineCustomIntVariable("rustica.queue_timeout",
+                            "Sets how long a connection may wait in the "
+                            "master for an idle worker in milliseconds.",
+                            "Connections waiting longer are answered with 503 "
+                            "Service Unavailable instead of being dispatched. "
+                            "Default is 0 for no timeout.",
+                            &rst_queue_timeout,
+                            0,
+                            0,
+                            INT_MAX,
+                            PGC_USERSET,
+                            GUC_UNIT_MS,
+                            NULL,
+                            NULL,
+                            NULL);
+    DefineCustomIntVariable("rustica.retry_after",
+                            "Sets the Retry-After header of 503 responses "
+                            "in seconds.",
+                            "Default is 1; 0 leaves the header out.",
+                            &rst_retry_after,
+                            1,
+                            0,
+                            86400,
+                            PGC_USERSET,
+                            GUC_UNIT_S,
+                            NULL,
+                            NULL,
+                            NULL);
+    DefineCustomIntVariable("rustica.max_stat_queries",
+                            "Sets the maximum number of queries tracked in "
+                            "rustica.stat_queries.",
+                            "Queries of modules loaded beyond that are not "
+                            "tracked. Default is 5000.",
+                            &rst_max_stat_queries,
+                            5000,
+                            100,
+                            INT_MAX / 2,
+                            PGC_POSTMASTER,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+    DefineCustomIntVariable("rustica.trace_buffer_size",
+                            "Sets the number of recent request traces kept "
+                            "for rustica.stat_requests().",
+                            "Default is 1024; 0 disables tracing.",
+                            &rst_trace_buffer_size,
+                            1024,
+                            0,
+                            1024 * 1024,
+                            PGC_POSTMASTER,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+    DefineCustomIntVariable("rustica.log_min_duration",
+                            "Sets the minimum duration of requests to log "
+                            "with their phase trace, in milliseconds.",
+                            "Counted from accepting the connection. Default "
+                            "is -1, not logging any.",
+                            &rst_log_min_duration,
+                            -1,
+                            -1,
+                            INT_MAX / 1000,
+                            PGC_USERSET,
+                            GUC_UNIT_MS,
+                            NULL,
+                            NULL,
+                            NULL);
+    DefineCustomRealVariable("rustica.log_sample_rate",
+                             "Sets the fraction of slow requests to log.",
+                             "Applies to requests over "
+                             "rustica.log_min_duration. Default is 1.",
+                             &rst_log_sample_rate,
+                             1.0,
+                             0.0,
+                             1.0,
+                             PGC_USERSET,
+                             0,
+                             NULL,
+                             NULL,
+                             NULL);
+    DefineCustomIntVariable("rustica.max_routes",
+                            "Sets the maximum number of routes in "
+                            "rustica.routes.",
+                            "Routes are matched in a trie in shared memory, "
+                            "sized for this many routes. Default is 256.",
+                            &rst_max_routes,
+                            256,
+                            0,
+                            INT_MAX / 1024,
+                            PGC_POSTMASTER,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
 }
@@ -17,10 +17,35 @@
 #ifndef RUSTICA_GUCS_H
 #define RUSTICA_GUCS_H
 
+#define IO_METHOD_EPOLL 0
+#define IO_METHOD_IO_URING 1
+
+#define DISPATCH_LIFO 0
+#define DISPATCH_FIFO 1
+
 extern char *rst_listen_addresses;
 extern int rst_port;
 extern int rst_worker_idle_timeout;
 extern char *rst_database;
+extern int rst_keepalive_timeout;
+extern int rst_keepalive_linger;
+extern bool rst_reuseport;
+extern int rst_reuseport_workers;
+extern int rst_min_workers;
+extern int rst_max_workers;
+extern int rst_io_method;
+extern int rst_dispatch_policy;
+extern int rst_dispatch_batch_size;
+extern int rst_recv_timeout;
+extern int rst_send_timeout;
+extern int rst_max_queue_depth;
+extern int rst_queue_timeout;
+extern int rst_retry_after;
+extern int rst_max_stat_queries;
+extern int rst_trace_buffer_size;
+extern int rst_log_min_duration;
+extern double rst_log_sample_rate;
+extern int rst_max_routes;
 
 void
 rst_init_gucs();
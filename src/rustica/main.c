@@ -20,15 +20,27 @@
 
 #include "rustica/compiler.h"
 #include "rustica/gucs.h"
+#include "rustica/module.h"
+#include "rustica/routes.h"
+#include "rustica/stats.h"
 #include "rustica/wamr.h"
 
 PG_MODULE_MAGIC;
 
 PG_FUNCTION_INFO_V1(compile_wasm);
+PG_FUNCTION_INFO_V1(evict_code_cache);
+PG_FUNCTION_INFO_V1(stat_queries);
+PG_FUNCTION_INFO_V1(stat_queries_reset);
+PG_FUNCTION_INFO_V1(stat_workers);
+PG_FUNCTION_INFO_V1(stat_http);
+PG_FUNCTION_INFO_V1(stat_http_latency);
+PG_FUNCTION_INFO_V1(stat_requests);
 
 void
 _PG_init() {
     rst_init_gucs();
+    rst_init_stats();
+    rst_init_routes();
 
     MemoryContext tx_mctx = MemoryContextSwitchTo(TopMemoryContext);
     rst_init_wamr();
@@ -51,6 +63,41 @@ compile_wasm(PG_FUNCTION_ARGS) {
     return rst_compile(fcinfo);
 }
 
+Datum
+evict_code_cache(PG_FUNCTION_ARGS) {
+    return rst_evict_code_cache(fcinfo);
+}
+
+Datum
+stat_queries(PG_FUNCTION_ARGS) {
+    return rst_stat_queries(fcinfo);
+}
+
+Datum
+stat_queries_reset(PG_FUNCTION_ARGS) {
+    return rst_stat_queries_reset(fcinfo);
+}
+
+Datum
+stat_workers(PG_FUNCTION_ARGS) {
+    return rst_stat_workers(fcinfo);
+}
+
+Datum
+stat_http(PG_FUNCTION_ARGS) {
+    return rst_stat_http(fcinfo);
+}
+
+Datum
+stat_http_latency(PG_FUNCTION_ARGS) {
+    return rst_stat_http_latency(fcinfo);
+}
+
+Datum
+stat_requests(PG_FUNCTION_ARGS) {
+    return rst_stat_requests(fcinfo);
+}
+
 void
 _PG_fini() {
     rst_fini_wamr();
@@ -14,7 +14,9 @@
  * See the Mulan PSL v2 for more details.
  */
 
+#include <fcntl.h>
 #include <sys/socket.h>
+#include <unistd.h>
 
 #include "postgres.h"
 #include "utils/varlena.h"
@@ -23,9 +25,13 @@
 #include "common/ip.h"
 #include "postmaster/bgworker.h"
 #include "postmaster/postmaster.h"
+#include "utils/timestamp.h"
 
 #include "rustica/event_set.h"
 #include "rustica/gucs.h"
+#include "rustica/routes.h"
+#include "rustica/stats.h"
+#include "rustica/uring.h"
 #include "rustica/utils.h"
 
 typedef struct Socket Socket;
@@ -34,22 +40,31 @@ typedef struct Socket Socket;
 #define TYPE_IPC 1
 #define TYPE_FRONTEND 2
 #define TYPE_BACKEND 3
-#define MAXLISTEN 64
-#define JOB_QLEN 1024
+#define TYPE_PARKED 4
+#define TYPE_URING 5
+#define MAXPARKED 1024
+#define ACCEPT_BATCH 256
 static WaitEventSetEx *rm_wait_set = NULL;
 static Socket *sockets;
 static int total_sockets = 0;
 static bool shutdown_requested = false;
 static bool worker_died = false;
-static int *idle_workers;
-static int idle_qhead = 0, idle_qtail = 0, idle_qsize = 0;
+static Socket *idle_head = NULL, *idle_tail = NULL; // most recent at tail
+static int num_idle = 0;
 static int num_workers;
 static BackgroundWorkerHandle **worker_handles;
 static FDMessage fd_msg;
-static pgsocket job_queue[JOB_QLEN];
+static pgsocket *job_queue; // of rustica.max_queue_depth jobs
+static int64 *job_accepted_at;
+static int32 *job_flags;
+static int job_qlen;
 static int job_qhead = 0, job_qtail = 0, job_qsize = 0;
-static bool frontend_paused = false;
+static pgsocket reserved_fd = -1; // given up to shed connections on EMFILE
+static bool accept_paused = false;
 static int worker_id_seq = 0;
+static int num_parked = 0;
+static TimestampTz last_sweep = 0;
+static bool uring_accept = false;
 
 typedef struct Socket {
     char type;
@@ -57,9 +72,23 @@ typedef struct Socket {
     int pos;
 
     uint8_t read_offset;
+    char msg_body[BACKEND_MSG_SIZE - 8];
     uint32_t worker_id;
+    uint64 loaded_modules; // bitmap of routed modules, see routes.h
+    int32 capacity;        // jobs the worker takes in one message
+    char msg_type;
+    pgsocket passed_fd;
+    bool idle;
+    TimestampTz idle_since;
+    Socket *idle_prev; // the idle list is ordered by idle_since
+    Socket *idle_next;
+
+    TimestampTz parked_at; // only for TYPE_PARKED
 } Socket;
 
+static bool
+start_worker();
+
 static int
 listen_frontend(pgsocket *listen_sockets) {
     int success, status, nsockets;
@@ -142,6 +171,30 @@ listen_backend() {
     return ipc_sock;
 }
 
+static inline int
+worker_limit() {
+    int limit = max_worker_processes - 2;
+    if (rst_max_workers > 0)
+        limit = Min(limit, rst_max_workers);
+    return limit;
+}
+
+static void
+maintain_workers() {
+    int target = rst_reuseport ? rst_reuseport_workers : rst_min_workers;
+
+    target = Min(target, worker_limit());
+
+    while (num_workers < target)
+        if (!start_worker()) {
+            ereport(WARNING,
+                    (errmsg("could not start rustica worker: %d of %d running",
+                            num_workers,
+                            target)));
+            break;
+        }
+}
+
 static void
 on_sigterm(SIGNAL_ARGS) {
     shutdown_requested = true;
@@ -165,29 +218,34 @@ startup() {
     BackgroundWorkerUnblockSignals();
 
     memset(&fd_msg, 0, sizeof(FDMessage));
-    fd_msg.io.iov_base = &fd_msg.byte;
-    fd_msg.io.iov_len = 1;
+    fd_msg.io.iov_base = fd_msg.payload;
     fd_msg.msg.msg_iov = &fd_msg.io;
     fd_msg.msg.msg_iovlen = 1;
     fd_msg.msg.msg_control = fd_msg.buf;
     fd_msg.msg.msg_controllen = sizeof(fd_msg.buf);
     fd_msg.cmsg = CMSG_FIRSTHDR(&fd_msg.msg);
-    fd_msg.cmsg->cmsg_level = SOL_SOCKET;
-    fd_msg.cmsg->cmsg_type = SCM_RIGHTS;
-    fd_msg.cmsg->cmsg_len = CMSG_LEN(sizeof(int));
 
-    num_listen_sockets = listen_frontend(listen_sockets);
+    // In SO_REUSEPORT mode workers listen on their own
+    if (rst_reuseport)
+        num_listen_sockets = 0;
+    else
+        num_listen_sockets = listen_frontend(listen_sockets);
     ipc_sock = listen_backend();
-    total_sockets = 1 + num_listen_sockets + max_worker_processes;
+    total_sockets = 2 + num_listen_sockets + max_worker_processes + MAXPARKED;
+    if (rst_io_method == IO_METHOD_IO_URING && num_listen_sockets > 0)
+        uring_accept = rst_uring_init(URING_ENTRIES);
 
     sockets = (Socket *)MemoryContextAllocZero(CurrentMemoryContext,
                                                sizeof(Socket) * total_sockets);
     rm_wait_set = CreateWaitEventSetEx(CurrentMemoryContext, total_sockets);
-    idle_workers = (int *)MemoryContextAllocZero(CurrentMemoryContext,
-                                                 sizeof(int) * total_sockets);
     worker_handles = (BackgroundWorkerHandle **)MemoryContextAllocZero(
         CurrentMemoryContext,
         sizeof(BackgroundWorkerHandle *) * max_worker_processes);
+    job_qlen = rst_max_queue_depth;
+    job_queue = palloc(sizeof(pgsocket) * job_qlen);
+    job_accepted_at = palloc(sizeof(int64) * job_qlen);
+    job_flags = palloc(sizeof(int32) * job_qlen);
+    reserved_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
 
     socket = &sockets[NextWaitEventPos(rm_wait_set)];
     socket->type = TYPE_UNSET;
@@ -212,16 +270,38 @@ startup() {
     for (int i = 0; i < num_listen_sockets; i++) {
         if (listen_sockets[i] == PGINVALID_SOCKET)
             ereport(FATAL, (errmsg("no socket created for listening")));
+        if (!pg_set_noblock(listen_sockets[i]))
+            ereport(FATAL,
+                    (errmsg("could not set listen socket to nonblocking mode: "
+                            "%m")));
         socket = &sockets[NextWaitEventPos(rm_wait_set)];
         socket->type = TYPE_FRONTEND;
         socket->fd = listen_sockets[i];
         socket->pos = AddWaitEventToSetEx(rm_wait_set,
-                                          WL_SOCKET_ACCEPT,
+                                          uring_accept ? WL_SOCKET_CLOSED
+                                                       : WL_SOCKET_ACCEPT,
+                                          socket->fd,
+                                          NULL,
+                                          socket);
+        Assert(socket->pos != -1);
+    }
+
+    // With io_uring, connections are accepted by multishot requests and
+    // show up as completions on the ring, which is polled like a socket.
+    if (uring_accept) {
+        socket = &sockets[NextWaitEventPos(rm_wait_set)];
+        socket->type = TYPE_URING;
+        socket->fd = rst_uring_fd();
+        socket->pos = AddWaitEventToSetEx(rm_wait_set,
+                                          WL_SOCKET_READABLE,
                                           socket->fd,
                                           NULL,
                                           socket);
         Assert(socket->pos != -1);
+        rst_uring_listen(listen_sockets, num_listen_sockets);
     }
+    // Start the minimum pool right away, workers warm up before saying hello
+    maintain_workers();
 }
 
 static inline void
@@ -247,6 +327,7 @@ on_backend_connect(Socket *socket, uint32 events) {
     socket = &sockets[NextWaitEventPos(rm_wait_set)];
     socket->type = TYPE_BACKEND;
     socket->fd = sock;
+    socket->passed_fd = PGINVALID_SOCKET;
     socket->pos = AddWaitEventToSetEx(rm_wait_set,
                                       WL_SOCKET_READABLE | WL_SOCKET_CLOSED,
                                       sock,
@@ -261,43 +342,227 @@ on_backend_connect(Socket *socket, uint32 events) {
     }
 }
 
+static void
+push_idle(Socket *socket) {
+    socket->idle = true;
+    socket->idle_since = GetCurrentTimestamp();
+    socket->idle_prev = idle_tail;
+    socket->idle_next = NULL;
+    if (idle_tail)
+        idle_tail->idle_next = socket;
+    else
+        idle_head = socket;
+    idle_tail = socket;
+    num_idle++;
+}
+
+static void
+remove_idle(Socket *socket) {
+    if (!socket->idle)
+        return;
+    if (socket->idle_prev)
+        socket->idle_prev->idle_next = socket->idle_next;
+    else
+        idle_head = socket->idle_next;
+    if (socket->idle_next)
+        socket->idle_next->idle_prev = socket->idle_prev;
+    else
+        idle_tail = socket->idle_prev;
+    socket->idle_prev = NULL;
+    socket->idle_next = NULL;
+    socket->idle = false;
+    num_idle--;
+}
+
 static inline void
 close_socket(Socket *socket) {
+    if (socket->type == TYPE_BACKEND && socket->passed_fd != PGINVALID_SOCKET)
+        StreamClose(socket->passed_fd);
+    if (socket->type == TYPE_BACKEND)
+        remove_idle(socket);
+    if (socket->type == TYPE_PARKED)
+        num_parked--;
     DeleteWaitEventEx(rm_wait_set, socket->pos);
     StreamClose(socket->fd);
     memset(socket, 0, sizeof(Socket));
 }
 
-static inline void
-on_frontend(Socket *socket, uint32 events) {
-    pgsocket sock;
-    SockAddr addr;
-    Socket *backend;
+static bool
+start_worker() {
+    BackgroundWorker worker;
+    BackgroundWorkerHandle **handle;
 
-    if (!(events & WL_SOCKET_ACCEPT))
-        return;
+    snprintf(worker.bgw_name, BGW_MAXLEN, "rustica-%d", worker_id_seq);
+    snprintf(worker.bgw_type, BGW_MAXLEN, "rustica worker");
+    worker.bgw_flags =
+        BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+    worker.bgw_start_time = BgWorkerStart_ConsistentState;
+    worker.bgw_restart_time = BGW_NEVER_RESTART;
+    snprintf(worker.bgw_library_name, BGW_MAXLEN, "rustica-engine");
+    snprintf(worker.bgw_function_name, BGW_MAXLEN, "rustica_worker");
+    worker.bgw_notify_pid = MyProcPid;
+    worker.bgw_main_arg = Int32GetDatum(worker_id_seq++);
 
-    addr.salen = sizeof(addr.addr);
-    sock = accept(socket->fd, (struct sockaddr *)&addr.addr, &addr.salen);
-    if (sock == PGINVALID_SOCKET) {
-        ereport(LOG,
-                (errcode_for_socket_access(),
-                 errmsg("could not accept new connection: %m")));
-        pg_usleep(100000L); // wait 0.1 sec
+    handle = NULL;
+    for (int i = 0; i < max_worker_processes; i++) {
+        if (worker_handles[i] == NULL) {
+            handle = &worker_handles[i];
+            break;
+        }
+    }
+    Assert(handle != NULL);
+    if (!RegisterDynamicBackgroundWorker(&worker, handle))
+        return false;
+    num_workers++;
+    return true;
+}
+
+static void
+set_frontend_accepting(bool accepting) {
+    if (uring_accept) {
+        if (accepting)
+            rst_uring_resume_accept();
+        else
+            rst_uring_pause_accept();
         return;
     }
-    ereport(DEBUG1,
-            (errmsg("accepted frontend connection fd=%d from: fd=%d",
-                    sock,
-                    socket->fd)));
+    for (int i = 0; i < total_sockets; i++) {
+        if (sockets[i].type == TYPE_FRONTEND) {
+            ModifyWaitEventEx(rm_wait_set,
+                              sockets[i].pos,
+                              accepting ? WL_SOCKET_ACCEPT : WL_SOCKET_CLOSED,
+                              NULL);
+        }
+    }
+}
+
+static uint64
+request_module_bit(pgsocket sock) {
+    static char head_buf[ROUTE_HEAD_MAXLEN];
+    RouteHead head;
+    ssize_t len;
+
+    // Peek at the request head without waiting, which is usually there for
+    // kept-alive connections, and may not be yet for new ones.
+    len = recv(sock, head_buf, sizeof(head_buf), MSG_PEEK | MSG_DONTWAIT);
+    if (len <= 0
+        || rst_route_parse_head(head_buf, len, &head) != ROUTE_HEAD_COMPLETE)
+        return 0;
+    return UINT64CONST(1) << rst_route_match(&head, NULL);
+}
+
+static void
+expire_queued_jobs(int64 now) {
+    // Jobs are queued in order, so the expired ones are at the head
+    while (job_qsize > 0 && rst_queue_timeout > 0
+           && now - job_accepted_at[job_qhead] > rst_queue_timeout * 1000L) {
+        ereport(DEBUG1,
+                (errmsg("job fd=%d waited too long, shedding it",
+                        job_queue[job_qhead])));
+        rst_shed_connection(job_queue[job_qhead]);
+        rst_stat_master_expired();
+        job_qsize--;
+        job_qhead = (job_qhead + 1) % job_qlen;
+    }
+}
+
+static Socket *
+find_idle(Socket *from, bool backward, uint64 module_bit) {
+    Socket *s = from;
+
+    // The first worker in order having the module loaded, if any
+    if (module_bit == 0)
+        return from;
+    while (s && !(s->loaded_modules & module_bit))
+        s = backward ? s->idle_prev : s->idle_next;
+    return s ? s : from;
+}
+
+static Socket *
+pick_lifo(uint64 module_bit) {
+    return find_idle(idle_tail, true, module_bit);
+}
+
+static Socket *
+pick_fifo(uint64 module_bit) {
+    return find_idle(idle_head, false, module_bit);
+}
+
+// Policies to pick an idle worker for a job, by rustica.dispatch_policy
+typedef Socket *(*DispatchPolicy)(uint64 module_bit);
+static const DispatchPolicy dispatch_policies[] = {
+    [DISPATCH_LIFO] = pick_lifo,
+    [DISPATCH_FIFO] = pick_fifo,
+};
+
+static void
+dispatch_job(pgsocket sock) {
+    Socket *backend;
+    int64 now = rst_monotonic_us();
+    int32 flags = 0;
+    uint64 module_bit = 0;
+
+    if (num_idle > 1 && rst_routes_enabled())
+        module_bit = request_module_bit(sock);
+    while (num_idle > 0) {
+        backend = dispatch_policies[rst_dispatch_policy](module_bit);
+        remove_idle(backend);
+        rst_set_fd_batch(&fd_msg, 1);
+        *((int *)CMSG_DATA(fd_msg.cmsg)) = sock;
+        fd_msg.payload[0].accepted_at = now;
+        fd_msg.payload[0].dispatched_at = now;
+        fd_msg.payload[0].flags = 0;
+        if (sendmsg(backend->fd, &fd_msg.msg, 0) < 0) {
+            ereport(DEBUG1,
+                    (errmsg("socket (fd=%d) is broken: %m", backend->fd)));
+            close_socket(backend);
+        }
+        else {
+            StreamClose(sock);
+            rst_stat_master_dispatched(0);
+            ereport(DEBUG1,
+                    (errmsg("dispatched job fd=%d to rustica-%d",
+                            sock,
+                            backend->worker_id)));
+            ModifyWaitEventEx(rm_wait_set,
+                              backend->pos,
+                              WL_SOCKET_READABLE | WL_SOCKET_CLOSED,
+                              NULL);
+            return;
+        }
+    }
+    if (num_workers < worker_limit() && start_worker())
+        flags |= FD_SPAWNED_WORKER;
+    // Make room from jobs that would be shed anyway
+    if (job_qsize == job_qlen)
+        expire_queued_jobs(now);
+    if (job_qsize < job_qlen) {
+        job_qsize++;
+        job_queue[job_qtail] = sock;
+        job_accepted_at[job_qtail] = now;
+        job_flags[job_qtail] = flags;
+        job_qtail = (job_qtail + 1) % job_qlen;
+        rst_stat_master_queued(job_qsize);
+    }
+    else {
+        // Keep accepting to answer right away, rather than letting clients
+        // time out in the listen backlog
+        ereport(DEBUG1, (errmsg("job queue is full, shedding fd=%d", sock)));
+        rst_shed_connection(sock);
+        rst_stat_master_rejected();
+    }
+}
+
+static void
+on_accepted(pgsocket sock, SockAddr *addr) {
     if (Log_connections) {
         int ret;
         char remote_host[NI_MAXHOST];
         char remote_port[NI_MAXSERV];
         remote_host[0] = '\0';
         remote_port[0] = '\0';
-        ret = pg_getnameinfo_all(&addr.addr,
-                                 addr.salen,
+        ret = pg_getnameinfo_all(&addr->addr,
+                                 addr->salen,
                                  remote_host,
                                  sizeof(remote_host),
                                  remote_port,
@@ -313,107 +578,299 @@ on_frontend(Socket *socket, uint32 events) {
                         remote_host,
                         remote_port)));
     }
-    while (idle_qsize > 0) {
-        backend = &sockets[idle_workers[idle_qhead]];
-        idle_qhead = (idle_qhead + 1) % total_sockets;
-        idle_qsize -= 1;
-        if (backend->type == TYPE_BACKEND) {
-            Assert(backend->type == TYPE_BACKEND);
-            *((int *)CMSG_DATA(fd_msg.cmsg)) = sock;
-            if (sendmsg(backend->fd, &fd_msg.msg, 0) < 0) {
-                ereport(DEBUG1,
-                        (errmsg("socket (fd=%d) is broken: %m", backend->fd)));
-                close_socket(backend);
-            }
-            else {
-                StreamClose(sock);
-                ereport(DEBUG1,
-                        (errmsg("dispatched job fd=%d to rustica-%d",
-                                sock,
-                                backend->worker_id)));
-                ModifyWaitEventEx(rm_wait_set,
-                                  backend->pos,
-                                  WL_SOCKET_READABLE | WL_SOCKET_CLOSED,
-                                  NULL);
-                return;
-            }
-        }
+    dispatch_job(sock);
+}
+
+static void
+on_accept_error(pgsocket listen_sock, int err) {
+    pgsocket sock;
+
+    if (err != EMFILE && err != ENFILE) {
+        errno = err;
+        ereport(LOG,
+                (errcode_for_socket_access(),
+                 errmsg("could not accept new connection: %m")));
+        return;
     }
-    if (idle_qsize == 0 && num_workers < max_worker_processes - 2) {
-        BackgroundWorker worker;
-        BackgroundWorkerHandle **handle;
-
-        snprintf(worker.bgw_name, BGW_MAXLEN, "rustica-%d", worker_id_seq);
-        snprintf(worker.bgw_type, BGW_MAXLEN, "rustica worker");
-        worker.bgw_flags =
-            BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
-        worker.bgw_start_time = BgWorkerStart_ConsistentState;
-        worker.bgw_restart_time = BGW_NEVER_RESTART;
-        snprintf(worker.bgw_library_name, BGW_MAXLEN, "rustica-engine");
-        snprintf(worker.bgw_function_name, BGW_MAXLEN, "rustica_worker");
-        worker.bgw_notify_pid = MyProcPid;
-        worker.bgw_main_arg = Int32GetDatum(worker_id_seq++);
-
-        handle = NULL;
-        for (int i = 0; i < max_worker_processes; i++) {
-            if (worker_handles[i] == NULL) {
-                handle = &worker_handles[i];
-                break;
-            }
+
+    // Out of fds: give up the reserved one to take the connection off the
+    // backlog and answer it with 503, instead of leaving it to wake us up
+    // again and again.
+    if (reserved_fd >= 0) {
+        close(reserved_fd);
+        sock = accept4(listen_sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock != PGINVALID_SOCKET) {
+            rst_shed_connection(sock);
+            rst_stat_master_rejected();
         }
-        Assert(handle != NULL);
-        if (RegisterDynamicBackgroundWorker(&worker, handle)) {
-            num_workers++;
+        reserved_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+    if (reserved_fd < 0) {
+        // Stop accepting until the next timer tick, without a reserve left
+        ereport(LOG,
+                (errmsg("could not accept new connection: too many open "
+                        "files, pausing")));
+        accept_paused = true;
+        set_frontend_accepting(false);
+    }
+}
+
+static inline void
+on_frontend(Socket *socket, uint32 events) {
+    pgsocket sock;
+    SockAddr addr;
+
+    if (!(events & WL_SOCKET_ACCEPT))
+        return;
+
+    // Drain the backlog, bounded so that workers saying hello are not starved
+    for (int i = 0; i < ACCEPT_BATCH && !accept_paused; i++) {
+        addr.salen = sizeof(addr.addr);
+        sock = accept4(socket->fd,
+                       (struct sockaddr *)&addr.addr,
+                       &addr.salen,
+                       SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (sock == PGINVALID_SOCKET) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                on_accept_error(socket->fd, errno);
+            return;
         }
+        ereport(DEBUG1,
+                (errmsg("accepted frontend connection fd=%d from: fd=%d",
+                        sock,
+                        socket->fd)));
+        on_accepted(sock, &addr);
     }
-    if (job_qsize < JOB_QLEN) {
-        job_qsize++;
-        job_queue[job_qtail] = sock;
-        job_qtail = (job_qtail + 1) % JOB_QLEN;
-        if (job_qsize == JOB_QLEN) {
+}
+
+static void
+on_uring_accepted(pgsocket sock) {
+    SockAddr addr;
+
+    ereport(DEBUG1, (errmsg("accepted frontend connection fd=%d", sock)));
+
+    // Multishot accept doesn't report peer addresses
+    addr.salen = sizeof(addr.addr);
+    if (Log_connections
+        && getpeername(sock, (struct sockaddr *)&addr.addr, &addr.salen) < 0)
+        addr.salen = 0;
+    on_accepted(sock, &addr);
+}
+
+static inline void
+on_uring(Socket *socket, uint32 events) {
+    if (!(events & WL_SOCKET_READABLE))
+        return;
+    if (!rst_uring_reap_accepted(on_uring_accepted, on_accept_error)) {
+        ereport(LOG,
+                (errmsg("io_uring multishot accept is not supported, "
+                        "falling back to epoll")));
+        uring_accept = false;
+        set_frontend_accepting(!accept_paused);
+    }
+}
+
+static void
+park_connection(pgsocket sock) {
+    Socket *socket;
+    int pos = NextWaitEventPos(rm_wait_set);
+
+    if (num_parked >= MAXPARKED || pos == -1) {
+        ereport(DEBUG1,
+                (errmsg("too many idle connections, closing fd=%d", sock)));
+        StreamClose(sock);
+        return;
+    }
+    socket = &sockets[pos];
+    socket->type = TYPE_PARKED;
+    socket->fd = sock;
+    socket->parked_at = GetCurrentTimestamp();
+    socket->pos = AddWaitEventToSetEx(rm_wait_set,
+                                      WL_SOCKET_READABLE | WL_SOCKET_CLOSED,
+                                      sock,
+                                      NULL,
+                                      socket);
+    Assert(socket->pos != -1);
+    num_parked++;
+    ereport(DEBUG1, (errmsg("parked idle connection fd=%d", sock)));
+}
+
+static inline void
+on_parked(Socket *socket, uint32 events) {
+    pgsocket sock = socket->fd;
+
+    if (events & WL_SOCKET_CLOSED) {
+        ereport(DEBUG1, (errmsg("idle connection closed: fd=%d", sock)));
+        close_socket(socket);
+    }
+    else if (events & WL_SOCKET_READABLE) {
+        // The next request has arrived, dispatch it like a new connection
+        DeleteWaitEventEx(rm_wait_set, socket->pos);
+        memset(socket, 0, sizeof(Socket));
+        num_parked--;
+        dispatch_job(sock);
+    }
+}
+
+static void
+sweep_parked(TimestampTz now) {
+    for (int i = 0; i < total_sockets && num_parked > 0; i++) {
+        if (sockets[i].type == TYPE_PARKED
+            && TimestampDifferenceExceeds(sockets[i].parked_at,
+                                          now,
+                                          rst_keepalive_timeout * 1000)) {
             ereport(DEBUG1,
-                    (errmsg("job queue is full, pause accepting frontend "
-                            "connections")));
-            frontend_paused = true;
-            for (int i = 0; i < total_sockets; i++) {
-                if (sockets[i].type == TYPE_FRONTEND) {
-                    ModifyWaitEventEx(rm_wait_set,
-                                      sockets[i].pos,
-                                      WL_SOCKET_CLOSED,
-                                      NULL);
-                }
-            }
+                    (errmsg("keep-alive timeout, closing fd=%d",
+                            sockets[i].fd)));
+            close_socket(&sockets[i]);
         }
     }
-    else {
-        ereport(DEBUG1, (errmsg("job queue is full, closing fd=%d", sock)));
-        StreamClose(sock);
+}
+
+static void
+sweep_idle_workers(TimestampTz now) {
+    int surplus = -rst_min_workers;
+    Socket *socket = idle_head;
+
+    for (int i = 0; i < total_sockets; i++)
+        if (sockets[i].type == TYPE_BACKEND)
+            surplus++;
+
+    // Longest idle first, up to the first one that has not timed out
+    while (socket && surplus > 0
+           && TimestampDifferenceExceeds(socket->idle_since,
+                                         now,
+                                         rst_worker_idle_timeout * 1000)) {
+        Socket *next = socket->idle_next;
+
+        // The worker exits once it sees its socket closed
+        ereport(DEBUG1,
+                (errmsg("rustica-%d: idle timeout", socket->worker_id)));
+        close_socket(socket);
+        surplus--;
+        socket = next;
     }
 }
 
+static void
+on_timer() {
+    TimestampTz now = GetCurrentTimestamp();
+
+    if (!TimestampDifferenceExceeds(last_sweep, now, 1000))
+        return;
+    last_sweep = now;
+    if (num_parked > 0)
+        sweep_parked(now);
+    if (rst_worker_idle_timeout > 0 && num_idle > 0)
+        sweep_idle_workers(now);
+    if (job_qsize > 0)
+        expire_queued_jobs(rst_monotonic_us());
+    if (accept_paused) {
+        if (reserved_fd < 0)
+            reserved_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (reserved_fd >= 0) {
+            accept_paused = false;
+            set_frontend_accepting(true);
+        }
+    }
+}
+
+static ssize_t
+recv_with_fd(pgsocket sock, char *buf, size_t len, pgsocket *passed_fd) {
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec io = { .iov_base = buf, .iov_len = len };
+    struct msghdr msg = { .msg_iov = &io,
+                          .msg_iovlen = 1,
+                          .msg_control = control,
+                          .msg_controllen = sizeof(control) };
+    struct cmsghdr *cmsg;
+    ssize_t rv;
+
+    rv = recvmsg(sock, &msg, 0);
+    if (rv > 0) {
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (cmsg && cmsg->cmsg_level == SOL_SOCKET
+            && cmsg->cmsg_type == SCM_RIGHTS)
+            *passed_fd = *((int *)CMSG_DATA(cmsg));
+    }
+    return rv;
+}
+
+static void
+dispatch_queued_jobs(Socket *backend) {
+    int njobs = Min(Min(job_qsize, backend->capacity), FD_BATCH_MAX);
+    int64 now = rst_monotonic_us();
+    int *fds;
+
+    // Workers serve the jobs of a message in turn, so more than one is only
+    // passed while jobs are queued anyway, saving a round trip for each.
+    njobs = Max(njobs, 1);
+    rst_set_fd_batch(&fd_msg, njobs);
+    fds = (int *)CMSG_DATA(fd_msg.cmsg);
+    for (int i = 0; i < njobs; i++) {
+        int k = (job_qhead + i) % job_qlen;
+        fds[i] = job_queue[k];
+        fd_msg.payload[i].accepted_at = job_accepted_at[k];
+        fd_msg.payload[i].dispatched_at = now;
+        fd_msg.payload[i].flags = job_flags[k];
+    }
+    if (sendmsg(backend->fd, &fd_msg.msg, 0) < 0) {
+        ereport(DEBUG1, (errmsg("socket (fd=%d) is broken: %m", backend->fd)));
+        close_socket(backend);
+        return;
+    }
+    for (int i = 0; i < njobs; i++) {
+        rst_stat_master_dispatched(now - fd_msg.payload[i].accepted_at);
+        StreamClose(fds[i]);
+        ereport(DEBUG1,
+                (errmsg("dispatched job fd=%d to rustica-%d",
+                        fds[i],
+                        backend->worker_id)));
+    }
+    job_qsize -= njobs;
+    job_qhead = (job_qhead + njobs) % job_qlen;
+}
+
 static inline void
 on_backend(Socket *socket, uint32 events) {
-    pgsocket job;
-
     if (events & WL_SOCKET_CLOSED) {
         ereport(DEBUG1, (errmsg("socket is closed: fd=%d", socket->fd)));
         close_socket(socket);
     }
     else if (events & WL_SOCKET_READABLE) {
-        char buf[12];
+        char buf[BACKEND_MSG_SIZE];
         int i;
         ssize_t received;
+        pgsocket passed_fd = PGINVALID_SOCKET;
 
-        if (socket->read_offset >= 12) {
+        if (socket->read_offset >= BACKEND_MSG_SIZE) {
             ModifyWaitEventEx(rm_wait_set, socket->pos, WL_SOCKET_CLOSED, NULL);
             return;
         }
-        received = recv(socket->fd, &buf, 12 - socket->read_offset, 0);
+        received = recv_with_fd(socket->fd,
+                                buf,
+                                BACKEND_MSG_SIZE - socket->read_offset,
+                                &passed_fd);
+        if (passed_fd != PGINVALID_SOCKET) {
+            if (socket->passed_fd != PGINVALID_SOCKET)
+                StreamClose(socket->passed_fd);
+            socket->passed_fd = passed_fd;
+        }
         if (received < 0) {
             ereport(DEBUG1, (errmsg("failed in recv fd=%d: %m", socket->fd)));
             close_socket(socket);
+            return;
         }
         for (i = 0; i < Min(8 - socket->read_offset, received); i++) {
+            // The last byte of the prefix tells hello from hand-back
+            if (socket->read_offset + i == 7
+                && (buf[i] == BACKEND_HELLO[7]
+                    || buf[i] == BACKEND_HANDBACK[7])) {
+                socket->msg_type = buf[i];
+                continue;
+            }
             if (BACKEND_HELLO[socket->read_offset + i] != buf[i]) {
                 ereport(LOG,
                         (errmsg("Bad hello from backend: fd=%d", socket->fd)));
@@ -422,54 +879,34 @@ on_backend(Socket *socket, uint32 events) {
             }
         }
         if (received - i > 0) {
-            memcpy(((char *)&socket->worker_id)
-                       + Max(0, socket->read_offset - 8),
+            memcpy(socket->msg_body + Max(0, socket->read_offset - 8),
                    buf + i,
                    received - i);
-            if (socket->read_offset + received == 12) {
+            if (socket->read_offset + received == BACKEND_MSG_SIZE) {
                 socket->read_offset = 0;
+                memcpy(&socket->worker_id, socket->msg_body, 4);
+                memcpy(&socket->loaded_modules, socket->msg_body + 4, 8);
+                memcpy(&socket->capacity, socket->msg_body + 12, 4);
 
-                if (job_qsize > 0) {
-                    job = job_queue[job_qhead];
-                    *((int *)CMSG_DATA(fd_msg.cmsg)) = job_queue[job_qhead];
-                    if (sendmsg(socket->fd, &fd_msg.msg, 0) < 0) {
-                        ereport(DEBUG1,
-                                (errmsg("socket (fd=%d) is broken: %m",
-                                        socket->fd)));
-                        close_socket(socket);
-                    }
-                    else {
-                        job_qsize--;
-                        job_qhead = (job_qhead + 1) % JOB_QLEN;
-                        ereport(DEBUG1,
-                                (errmsg("dispatched job fd=%d to rustica-%d",
-                                        job,
-                                        socket->worker_id)));
-                        if (frontend_paused) {
-                            ereport(DEBUG1,
-                                    (errmsg("resume accepting frontend "
-                                            "connections")));
-                            frontend_paused = false;
-                            for (i = 0; i < total_sockets; i++) {
-                                if (sockets[i].type == TYPE_FRONTEND) {
-                                    ModifyWaitEventEx(rm_wait_set,
-                                                      sockets[i].pos,
-                                                      WL_SOCKET_ACCEPT,
-                                                      NULL);
-                                }
-                            }
-                        }
+                // An idle keep-alive connection handed back by the worker,
+                // which will say hello on its own once it's done with it.
+                if (socket->msg_type == BACKEND_HANDBACK[7]) {
+                    if (socket->passed_fd != PGINVALID_SOCKET) {
+                        park_connection(socket->passed_fd);
+                        socket->passed_fd = PGINVALID_SOCKET;
                     }
+                    return;
                 }
+
+                expire_queued_jobs(rst_monotonic_us());
+                if (job_qsize > 0)
+                    dispatch_queued_jobs(socket);
                 else {
                     ModifyWaitEventEx(rm_wait_set,
                                       socket->pos,
                                       WL_SOCKET_CLOSED,
                                       NULL);
-                    Assert(idle_qsize < total_sockets);
-                    idle_qsize++;
-                    idle_workers[idle_qtail] = socket->pos;
-                    idle_qtail = (idle_qtail + 1) % total_sockets;
+                    push_idle(socket);
                     ereport(DEBUG1,
                             (errmsg("rustica-%d is idle", socket->worker_id)));
                 }
@@ -507,17 +944,31 @@ on_worker_died() {
     else {
         Assert(workers == num_workers);
     }
+
+    // Replace exited workers to keep the pool at its minimum
+    maintain_workers();
 }
 
 static void
 main_loop() {
     WaitEvent events[MAXLISTEN];
     int nevents;
+    long timeout;
     Socket *socket;
 
     for (;;) {
-        nevents =
-            WaitEventSetWaitEx(rm_wait_set, -1, events, lengthof(events), 0);
+        // Wake up regularly to expire parked keep-alive connections, surplus
+        // idle workers and queued jobs
+        if (num_parked > 0 || (rst_worker_idle_timeout > 0 && num_idle > 0)
+            || (rst_queue_timeout > 0 && job_qsize > 0) || accept_paused)
+            timeout = 1000;
+        else
+            timeout = -1;
+        nevents = WaitEventSetWaitEx(rm_wait_set,
+                                     timeout,
+                                     events,
+                                     lengthof(events),
+                                     0);
         for (int i = 0; i < nevents; i++) {
             socket = (Socket *)events[i].user_data;
             if (events[i].events & WL_LATCH_SET) {
@@ -536,7 +987,13 @@ main_loop() {
                 on_frontend(socket, events[i].events);
             if (socket->type == TYPE_BACKEND)
                 on_backend(socket, events[i].events);
+            if (socket->type == TYPE_PARKED)
+                on_parked(socket, events[i].events);
+            if (socket->type == TYPE_URING)
+                on_uring(socket, events[i].events);
         }
+        on_timer();
+        rst_stat_master_gauges(num_workers, num_idle, job_qsize);
     }
 }
 
@@ -544,16 +1001,23 @@ static void
 teardown() {
     ereport(LOG, (errmsg("rustica master shutting down")));
     pfree(worker_handles);
-    pfree(idle_workers);
+    pfree(job_queue);
+    pfree(job_accepted_at);
+    pfree(job_flags);
+    if (reserved_fd >= 0)
+        close(reserved_fd);
     FreeWaitEventSetEx(rm_wait_set);
     rm_wait_set = NULL;
 
     for (int i = 0; i < total_sockets; i++) {
+        if (sockets[i].type == TYPE_URING)
+            sockets[i].type = TYPE_UNSET;
         if (sockets[i].type != TYPE_UNSET) {
             sockets[i].type = TYPE_UNSET;
             StreamClose(sockets[i].fd);
         }
     }
+    rst_uring_fini();
 
     pfree(sockets);
 }
@@ -14,19 +14,77 @@
  * See the Mulan PSL v2 for more details.
  */
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
 #include "postgres.h"
+#include "common/cryptohash.h"
 #include "executor/spi.h"
+#include "miscadmin.h"
+#include "storage/fd.h"
 #include "tcop/tcopprot.h"
 #include "utils/builtins.h"
+#include "utils/hsearch.h"
 #include "utils/memutils.h"
+#include "utils/plancache.h"
+
+#include "mem_alloc.h"
+#include "gc_object.h"
 
+#include "rustica/datatypes.h"
 #include "rustica/module.h"
+#include "rustica/stats.h"
 #include "rustica/utils.h"
 
+// Maximum GC cycles to wait for job objects to be finalized on release
+#define MAX_RELEASE_GC_CYCLES 8
+
+// Directory under PGDATA holding AOT images named by sha256(bin_code)
+#define CODE_CACHE_DIR "pg_rustica"
+#define CODE_HASH_LEN 32
+
+typedef struct MemorySnapshot {
+    uint32 page_count;
+    uint64 data_size;
+    uint8 *data;
+    uint8 *heap_struct;
+} MemorySnapshot;
+
+// Contents of a GC object that was reachable when the snapshot was taken
+typedef struct ObjectSnapshot {
+    wasm_obj_t obj;
+    uint8 *field_data;
+    uint64 size;
+    uint8 *data;
+} ObjectSnapshot;
+
+typedef struct TableSnapshot {
+    uint32 cur_size;
+    table_elem_type_t *elems;
+} TableSnapshot;
+
+struct InstanceSnapshot {
+    Context context;
+    uint8 *global_data;
+    uint32 global_data_size;
+    int64 live_objs;
+    int nobjects;
+    int max_objects;
+    ObjectSnapshot *objects;
+    wasm_local_obj_ref_t *pins;
+    uint32 table_count;
+    TableSnapshot *tables;
+    uint32 memory_count;
+    MemorySnapshot memories[];
+};
+
 static SPIPlanPtr load_module_plan = NULL;
 static SPIPlanPtr load_module_queries_plan = NULL;
 static const char *load_module_sql =
-    "SELECT bin_code, heap_types FROM rustica.modules WHERE name = $1";
+    "SELECT bin_code, heap_types, bin_hash, octet_length(bin_code) "
+    "FROM rustica.modules WHERE name = $1";
 static const char *load_module_queries_sql =
     "SELECT * FROM rustica.queries WHERE module = $1 ORDER BY index";
 
@@ -39,6 +97,18 @@ load_heap_types(ArrayType *array, CommonHeapTypes *heap_types);
 static AOTModule *
 load_aot_module(const char *name, uint8 *bin_code, uint32_t bin_code_len);
 
+static void
+destroy_pooled_instance(PreparedModule *pmod);
+
+static void
+code_cache_path(char *path, bytea *hash);
+
+static uint8 *
+map_cached_code(const char *path, uint32 size, bytea *hash);
+
+static void
+store_cached_code(const char *path, uint8 *bin_code, uint32 size);
+
 void
 rst_module_worker_startup() {
     debug_query_string = load_module_sql;
@@ -104,12 +174,32 @@ rst_prepare_module(const char *name, uint8 **buffer, uint32 *size) {
                         errcode(ERRCODE_NO_DATA_FOUND),
                         errmsg("module \"%s\" doesn't exist", name));
 
-            // Take out the raw data from the tuptable
+            // Take out the raw data from the tuptable; bin_code is only
+            // detoasted if the code cache doesn't have it yet.
             bool isnull;
             Datum datum =
                 SPI_getbinval(tuptable->vals[0], tuptable->tupdesc, 1, &isnull);
             Assert(!isnull);
-            bytea *bin_code = DatumGetByteaPP(datum);
+            Datum hash =
+                SPI_getbinval(tuptable->vals[0], tuptable->tupdesc, 3, &isnull);
+            Assert(!isnull);
+            Datum bin_len =
+                SPI_getbinval(tuptable->vals[0], tuptable->tupdesc, 4, &isnull);
+            Assert(!isnull);
+            uint32 bin_size = DatumGetInt32(bin_len);
+            char path[MAXPGPATH];
+            code_cache_path(path, DatumGetByteaPP(hash));
+            uint8 *image =
+                map_cached_code(path, bin_size, DatumGetByteaPP(hash));
+            if (image) {
+                pmod->loading_image = image;
+                pmod->loading_image_size = bin_size;
+            }
+            else {
+                bytea *bin_code = DatumGetByteaPP(datum);
+                image = (uint8 *)VARDATA_ANY(bin_code);
+                store_cached_code(path, image, bin_size);
+            }
             datum =
                 SPI_getbinval(tuptable->vals[0], tuptable->tupdesc, 2, &isnull);
             Assert(!isnull);
@@ -118,18 +208,17 @@ rst_prepare_module(const char *name, uint8 **buffer, uint32 *size) {
 
             // Load heap_types and the actual WASM module
             load_heap_types(heap_types, &pmod->heap_types);
+            pmod->loading_tuptable = tuptable;
+            tuptable = NULL;
             if (buffer) {
                 Assert(size != NULL);
-                *buffer = (uint8 *)VARDATA_ANY(bin_code);
-                *size = VARSIZE_ANY_EXHDR(bin_code);
-                pmod->loading_tuptable = tuptable;
+                *buffer = image;
+                *size = bin_size;
             }
             else {
-                pmod->module = load_aot_module((const char *)pmod,
-                                               (uint8 *)VARDATA_ANY(bin_code),
-                                               VARSIZE_ANY_EXHDR(bin_code));
-                SPI_freetuptable(tuptable);
-                tuptable = NULL;
+                pmod->module =
+                    load_aot_module((const char *)pmod, image, bin_size);
+                rst_module_release_bin_code(pmod);
             }
         }
         PG_CATCH(2);
@@ -163,17 +252,57 @@ void
 rst_free_module(PreparedModule *pmod) {
     if (!pmod)
         return;
+    destroy_pooled_instance(pmod);
     for (int i = 0; i < pmod->nqueries; i++)
         rst_free_query_plan(&pmod->queries[i]);
     if (pmod->module) {
         wasm_runtime_unregister_module((wasm_module_t)pmod->module);
         aot_unload(pmod->module);
     }
-    if (pmod->loading_tuptable)
-        SPI_freetuptable(pmod->loading_tuptable);
+    rst_module_release_bin_code(pmod);
     pfree(pmod);
 }
 
+void
+rst_module_release_bin_code(PreparedModule *pmod) {
+    // WAMR copies what it needs with wasm_binary_freeable, so the input image
+    // can go as soon as the module is loaded.
+    if (pmod->loading_tuptable) {
+        SPI_freetuptable(pmod->loading_tuptable);
+        pmod->loading_tuptable = NULL;
+    }
+    if (pmod->loading_image) {
+        munmap(pmod->loading_image, pmod->loading_image_size);
+        pmod->loading_image = NULL;
+    }
+}
+
+Datum
+rst_evict_code_cache(PG_FUNCTION_ARGS) {
+    char path[MAXPGPATH];
+    code_cache_path(path, PG_GETARG_BYTEA_PP(0));
+    if (unlink(path) < 0 && errno != ENOENT)
+        ereport(WARNING,
+                errcode_for_file_access(),
+                errmsg("could not remove code cache file \"%s\": %m", path));
+    PG_RETURN_VOID();
+}
+
+void
+rst_module_warm_up(PreparedModule *pmod) {
+    // Build the generic plan of every query now, so that the first jobs
+    // don't pay for planning
+    for (int i = 0; i < pmod->nqueries; i++) {
+        CachedPlan *cplan;
+
+        if (!pmod->queries[i].plan)
+            continue;
+        cplan = SPI_plan_get_cached_plan(pmod->queries[i].plan);
+        if (cplan)
+            ReleaseCachedPlan(cplan, CurrentResourceOwner);
+    }
+}
+
 wasm_exec_env_t
 rst_module_instantiate(PreparedModule *pmod,
                        uint32 stack_size,
@@ -207,6 +336,108 @@ rst_module_instantiate(PreparedModule *pmod,
     return exec_env;
 }
 
+static void
+code_cache_path(char *path, bytea *hash) {
+    char hex[CODE_HASH_LEN * 2 + 1];
+    if (VARSIZE_ANY_EXHDR(hash) != CODE_HASH_LEN)
+        ereport(ERROR,
+                errmsg("bad bin_hash length: %zu",
+                       (size_t)VARSIZE_ANY_EXHDR(hash)));
+    hex_encode(VARDATA_ANY(hash), CODE_HASH_LEN, hex);
+    hex[CODE_HASH_LEN * 2] = '\0';
+    snprintf(path, MAXPGPATH, "%s/%s.aot", CODE_CACHE_DIR, hex);
+}
+
+static bool
+check_code_hash(uint8 *image, uint32 size, bytea *hash) {
+    uint8 digest[CODE_HASH_LEN];
+    pg_cryptohash_ctx *ctx = pg_cryptohash_create(PG_SHA256);
+    bool ok = pg_cryptohash_init(ctx) == 0
+              && pg_cryptohash_update(ctx, image, size) == 0
+              && pg_cryptohash_final(ctx, digest, sizeof(digest)) == 0;
+    pg_cryptohash_free(ctx);
+    if (!ok)
+        ereport(ERROR, errmsg("could not compute SHA-256 hash of code"));
+    return memcmp(digest, VARDATA_ANY(hash), CODE_HASH_LEN) == 0;
+}
+
+static uint8 *
+map_cached_code(const char *path, uint32 size, bytea *hash) {
+    int fd = OpenTransientFile(path, O_RDONLY | PG_BINARY);
+    if (fd < 0) {
+        if (errno != ENOENT)
+            ereport(LOG,
+                    errcode_for_file_access(),
+                    errmsg("could not open code cache file \"%s\": %m", path));
+        return NULL;
+    }
+
+    // Files are only renamed into place once fully written, but anything with
+    // write access to the directory could still have replaced one, so the
+    // content is checked against the hash before it is loaded as code.
+    struct stat st;
+    uint8 *image = NULL;
+    if (fstat(fd, &st) < 0)
+        ereport(LOG,
+                errcode_for_file_access(),
+                errmsg("could not stat code cache file \"%s\": %m", path));
+    else if (st.st_size != size)
+        ereport(LOG,
+                errmsg("ignoring code cache file \"%s\" of bad size %zu",
+                       path,
+                       (size_t)st.st_size));
+    else {
+        // Private writable mapping: the pages are shared through the page
+        // cache until the loader writes to one, which never hits the file.
+        void *addr =
+            mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (addr == MAP_FAILED)
+            ereport(LOG,
+                    errmsg("could not map code cache file \"%s\": %m", path));
+        else if (!check_code_hash(addr, size, hash)) {
+            ereport(LOG,
+                    errmsg("ignoring code cache file \"%s\" of bad hash",
+                           path));
+            munmap(addr, size);
+        }
+        else
+            image = addr;
+    }
+    CloseTransientFile(fd);
+    return image;
+}
+
+static void
+store_cached_code(const char *path, uint8 *bin_code, uint32 size) {
+    // Failing to populate the cache is not fatal, the next load retries
+    if (MakePGDirectory(CODE_CACHE_DIR) < 0 && errno != EEXIST) {
+        ereport(LOG,
+                errcode_for_file_access(),
+                errmsg("could not create directory \"%s\": %m",
+                       CODE_CACHE_DIR));
+        return;
+    }
+    char tmp_path[MAXPGPATH];
+    snprintf(tmp_path, MAXPGPATH, "%s.%d.tmp", path, MyProcPid);
+    int fd =
+        OpenTransientFile(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY);
+    if (fd < 0) {
+        ereport(LOG,
+                errcode_for_file_access(),
+                errmsg("could not create file \"%s\": %m", tmp_path));
+        return;
+    }
+    bool written = write(fd, bin_code, size) == (ssize_t)size;
+    if (!written)
+        ereport(LOG,
+                errcode_for_file_access(),
+                errmsg("could not write file \"%s\": %m", tmp_path));
+    if (CloseTransientFile(fd) != 0)
+        written = false;
+    if (!written || durable_rename(tmp_path, path, LOG) != 0)
+        unlink(tmp_path);
+}
+
 static PreparedModule *
 create_module_with_queries(Datum name) {
     // Load pre-compiled queries
@@ -245,6 +476,7 @@ create_module_with_queries(Datum name) {
                 rst_init_query_plan(&pmod->queries[i],
                                     tuptable->vals[i],
                                     tuptable->tupdesc);
+                pmod->queries[i].stats = rst_stat_query_entry(pmod->name, i);
             }
         }
         PG_CATCH(2);
@@ -351,3 +583,352 @@ load_aot_module(const char *name, uint8 *bin_code, uint32_t bin_code_len) {
 
     return aot_module;
 }
+
+static void
+record_object(InstanceSnapshot *snapshot, HTAB *visited, wasm_obj_t obj) {
+    bool found;
+
+    if (!obj || !wasm_obj_is_created_from_heap((WASMObjectRef)obj))
+        return;
+    hash_search(visited, &obj, HASH_ENTER, &found);
+    if (found)
+        return;
+    if (snapshot->nobjects == snapshot->max_objects) {
+        snapshot->max_objects *= 2;
+        snapshot->objects = (ObjectSnapshot *)repalloc(
+            snapshot->objects,
+            sizeof(ObjectSnapshot) * snapshot->max_objects);
+    }
+    snapshot->objects[snapshot->nobjects++] = (ObjectSnapshot){ .obj = obj };
+}
+
+static void
+record_ref_global(InstanceSnapshot *snapshot,
+                  HTAB *visited,
+                  uint8 val_type,
+                  uint32 data_offset) {
+    if (wasm_is_type_reftype(val_type))
+        record_object(snapshot,
+                      visited,
+                      *(wasm_obj_t *)(snapshot->global_data + data_offset));
+}
+
+static void
+snapshot_object(InstanceSnapshot *snapshot,
+                HTAB *visited,
+                ObjectSnapshot *os) {
+    WASMObjectRef obj = (WASMObjectRef)os->obj;
+    bool is_compact_mode;
+    uint32 ref_num, ref_start_offset;
+    uint16 *ref_list;
+
+    // Only struct fields and array elements can be written by a job
+    if (wasm_obj_is_struct_obj(obj)) {
+        WASMStructType *type =
+            (WASMStructType *)wasm_obj_get_defined_type(obj);
+        os->field_data = ((WASMStructObjectRef)obj)->field_data;
+        os->size = type->total_size - offsetof(WASMStructObject, field_data);
+    }
+    else if (wasm_obj_is_array_obj(obj)) {
+        WASMArrayObjectRef array = (WASMArrayObjectRef)obj;
+        os->field_data = wasm_array_obj_first_elem_addr(array);
+        os->size = (uint64)wasm_array_obj_length(array)
+                   << wasm_array_obj_elem_size_log(array);
+    }
+    if (os->size > 0) {
+        os->data = (uint8 *)palloc(os->size);
+        memcpy(os->data, os->field_data, os->size);
+    }
+
+    if (!wasm_object_get_ref_list(obj,
+                                  &is_compact_mode,
+                                  &ref_num,
+                                  &ref_list,
+                                  &ref_start_offset))
+        ereport(ERROR, errmsg("failed to traverse GC object"));
+    for (uint32 i = 0; i < ref_num; i++) {
+        uint32 offset = is_compact_mode
+                            ? ref_start_offset + i * sizeof(wasm_obj_t)
+                            : ref_list[i];
+        record_object(snapshot,
+                      visited,
+                      *(wasm_obj_t *)((uint8 *)obj + offset));
+    }
+}
+
+static InstanceSnapshot *
+take_snapshot(PreparedModule *pmod,
+              wasm_exec_env_t exec_env,
+              Context *context) {
+    AOTModuleInstance *inst =
+        (AOTModuleInstance *)wasm_exec_env_get_module_inst(exec_env);
+    AOTModule *module = pmod->module;
+    uint32 heap_struct_size = mem_allocator_get_heap_struct_size();
+
+    InstanceSnapshot *snapshot = (InstanceSnapshot *)palloc0(
+        sizeof(InstanceSnapshot) + sizeof(MemorySnapshot) * inst->memory_count);
+    snapshot->context = *context;
+    snapshot->global_data_size = inst->global_data_size;
+    snapshot->global_data = (uint8 *)palloc(inst->global_data_size);
+    memcpy(snapshot->global_data, inst->global_data, inst->global_data_size);
+    snapshot->live_objs = rst_live_objs;
+
+    snapshot->table_count = inst->table_count;
+    snapshot->tables =
+        (TableSnapshot *)palloc0(sizeof(TableSnapshot) * inst->table_count);
+    for (uint32 i = 0; i < inst->table_count; i++) {
+        WASMTableInstance *table = inst->tables[i];
+        TableSnapshot *ts = &snapshot->tables[i];
+        ts->cur_size = table->cur_size;
+        ts->elems = (table_elem_type_t *)palloc(sizeof(table_elem_type_t)
+                                                * table->cur_size);
+        memcpy(ts->elems,
+               table->elems,
+               sizeof(table_elem_type_t) * table->cur_size);
+    }
+
+    // Jobs may write into any object that already exists, so the contents
+    // of everything reachable from the globals, the tables and the queries
+    // struct are saved to be rolled back on release.
+    HASHCTL ctl = { .keysize = sizeof(wasm_obj_t),
+                    .entrysize = sizeof(wasm_obj_t),
+                    .hcxt = CurrentMemoryContext };
+    HTAB *visited = hash_create("rustica snapshot objects",
+                                256,
+                                &ctl,
+                                HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    snapshot->max_objects = 64;
+    snapshot->objects = (ObjectSnapshot *)palloc(sizeof(ObjectSnapshot)
+                                                 * snapshot->max_objects);
+    for (uint32 i = 0; i < module->import_global_count; i++)
+        record_ref_global(snapshot,
+                          visited,
+                          module->import_globals[i].type.val_type,
+                          module->import_globals[i].data_offset);
+    for (uint32 i = 0; i < module->global_count; i++)
+        record_ref_global(snapshot,
+                          visited,
+                          module->globals[i].type.val_type,
+                          module->globals[i].data_offset);
+    for (uint32 i = 0; i < snapshot->table_count; i++)
+        for (uint32 j = 0; j < snapshot->tables[i].cur_size; j++)
+            record_object(snapshot,
+                          visited,
+                          (wasm_obj_t)snapshot->tables[i].elems[j]);
+    record_object(snapshot, visited, (wasm_obj_t)context->queries);
+    for (int i = 0; i < snapshot->nobjects; i++)
+        snapshot_object(snapshot, visited, &snapshot->objects[i]);
+    hash_destroy(visited);
+
+    // References to these objects may be overwritten during a job, so they
+    // are pinned to survive the GC until their referrers are restored.
+    snapshot->pins = (wasm_local_obj_ref_t *)palloc0(
+        sizeof(wasm_local_obj_ref_t) * (snapshot->nobjects + 1));
+    for (int i = 0; i < snapshot->nobjects; i++) {
+        wasm_runtime_push_local_obj_ref(exec_env, &snapshot->pins[i]);
+        snapshot->pins[i].val = snapshot->objects[i].obj;
+    }
+
+    snapshot->memory_count = inst->memory_count;
+    for (uint32 i = 0; i < inst->memory_count; i++) {
+        WASMMemoryInstance *memory = inst->memories[i];
+        MemorySnapshot *ms = &snapshot->memories[i];
+        ms->page_count = memory->cur_page_count;
+        ms->data_size = memory->memory_data_size;
+        if (ms->data_size > 0) {
+            ms->data = (uint8 *)palloc(ms->data_size);
+            memcpy(ms->data, memory->memory_data, ms->data_size);
+        }
+        if (memory->heap_handle) {
+            ms->heap_struct = (uint8 *)palloc(heap_struct_size);
+            memcpy(ms->heap_struct, memory->heap_handle, heap_struct_size);
+        }
+    }
+    return snapshot;
+}
+
+static void
+free_snapshot(InstanceSnapshot *snapshot) {
+    for (uint32 i = 0; i < snapshot->memory_count; i++) {
+        if (snapshot->memories[i].data)
+            pfree(snapshot->memories[i].data);
+        if (snapshot->memories[i].heap_struct)
+            pfree(snapshot->memories[i].heap_struct);
+    }
+    for (int i = 0; i < snapshot->nobjects; i++)
+        if (snapshot->objects[i].data)
+            pfree(snapshot->objects[i].data);
+    for (uint32 i = 0; i < snapshot->table_count; i++)
+        pfree(snapshot->tables[i].elems);
+    rst_free_instance_context(&snapshot->context);
+    pfree(snapshot->objects);
+    pfree(snapshot->tables);
+    pfree(snapshot->pins);
+    pfree(snapshot->global_data);
+    pfree(snapshot);
+}
+
+static bool
+collect_job_objects(InstanceSnapshot *snapshot, wasm_exec_env_t exec_env) {
+    AOTModuleInstance *inst =
+        (AOTModuleInstance *)wasm_exec_env_get_module_inst(exec_env);
+
+    // Grown tables cannot be shrunk back in place
+    for (uint32 i = 0; i < snapshot->table_count; i++)
+        if (inst->tables[i]->cur_size != snapshot->tables[i].cur_size)
+            return false;
+
+    // Reset globals, tables and pre-existing objects so that everything
+    // allocated during the job becomes garbage, then collect until all
+    // job-owned host objects are finalized while the transaction memory they
+    // live in is still valid. Objects referencing other objects release them
+    // in their own finalizers, so this may take more than one cycle.
+    memcpy(inst->global_data,
+           snapshot->global_data,
+           snapshot->global_data_size);
+    for (uint32 i = 0; i < snapshot->table_count; i++)
+        memcpy(inst->tables[i]->elems,
+               snapshot->tables[i].elems,
+               sizeof(table_elem_type_t) * snapshot->tables[i].cur_size);
+    for (int i = 0; i < snapshot->nobjects; i++) {
+        ObjectSnapshot *os = &snapshot->objects[i];
+        if (os->data)
+            memcpy(os->field_data, os->data, os->size);
+    }
+    for (int i = 0; i < MAX_RELEASE_GC_CYCLES; i++) {
+        if (rst_live_objs <= snapshot->live_objs)
+            break;
+        wasm_runtime_gc_collect((wasm_module_inst_t)inst);
+    }
+    if (rst_live_objs != snapshot->live_objs)
+        return false;
+
+    // Anything left above the pins was leaked by the job
+    wasm_local_obj_ref_t *top = snapshot->nobjects > 0
+                                    ? &snapshot->pins[snapshot->nobjects - 1]
+                                    : NULL;
+    return wasm_runtime_get_cur_local_obj_ref(exec_env) == top;
+}
+
+static bool
+restore_memories(InstanceSnapshot *snapshot, wasm_exec_env_t exec_env) {
+    AOTModuleInstance *inst =
+        (AOTModuleInstance *)wasm_exec_env_get_module_inst(exec_env);
+    uint32 heap_struct_size = mem_allocator_get_heap_struct_size();
+
+    // Grown memories cannot be shrunk back in place
+    for (uint32 i = 0; i < snapshot->memory_count; i++)
+        if (inst->memories[i]->cur_page_count
+            != snapshot->memories[i].page_count)
+            return false;
+
+    for (uint32 i = 0; i < snapshot->memory_count; i++) {
+        WASMMemoryInstance *memory = inst->memories[i];
+        MemorySnapshot *ms = &snapshot->memories[i];
+        if (ms->data)
+            memcpy(memory->memory_data, ms->data, ms->data_size);
+        if (ms->heap_struct)
+            memcpy(memory->heap_handle, ms->heap_struct, heap_struct_size);
+    }
+    return true;
+}
+
+static void
+destroy_instance(wasm_exec_env_t exec_env) {
+    wasm_module_inst_t instance = wasm_exec_env_get_module_inst(exec_env);
+    wasm_runtime_deinstantiate(instance);
+    wasm_runtime_destroy_exec_env(exec_env);
+}
+
+static void
+destroy_pooled_instance(PreparedModule *pmod) {
+    if (pmod->pooled_exec_env) {
+        destroy_instance(pmod->pooled_exec_env);
+        pmod->pooled_exec_env = NULL;
+    }
+    if (pmod->snapshot) {
+        free_snapshot(pmod->snapshot);
+        pmod->snapshot = NULL;
+    }
+}
+
+wasm_exec_env_t
+rst_module_acquire_instance(PreparedModule *pmod,
+                            uint32 stack_size,
+                            uint32 heap_size,
+                            Context *context,
+                            ContextInitializer init_context) {
+    wasm_exec_env_t exec_env = pmod->pooled_exec_env;
+    if (exec_env) {
+        pmod->pooled_exec_env = NULL;
+        *context = pmod->snapshot->context;
+        wasm_runtime_set_user_data(exec_env, context);
+        return exec_env;
+    }
+
+    // The instance, its snapshot and the context template all outlive the
+    // current transaction.
+    MemoryContext tx_mctx = MemoryContextSwitchTo(TopMemoryContext);
+    PG_TRY();
+    {
+        exec_env = rst_module_instantiate(pmod, stack_size, heap_size);
+        PG_TRY(2);
+        {
+            if (pmod->snapshot) {
+                free_snapshot(pmod->snapshot);
+                pmod->snapshot = NULL;
+            }
+
+            // Run the one-off initialization before taking the snapshot
+            *context = (Context){ .module = pmod, .bytes_view = -1 };
+            wasm_runtime_set_user_data(exec_env, context);
+            rst_init_instance_context(exec_env);
+            rst_init_context_for_jsonb(exec_env);
+            rst_init_context_for_json_schema(exec_env);
+            init_context(context, wasm_exec_env_get_module_inst(exec_env));
+            pmod->snapshot = take_snapshot(pmod, exec_env, context);
+        }
+        PG_CATCH(2);
+        {
+            rst_free_instance_context(context);
+            destroy_instance(exec_env);
+            PG_RE_THROW();
+        }
+        PG_END_TRY(2);
+    }
+    PG_FINALLY();
+    {
+        MemoryContextSwitchTo(tx_mctx);
+    }
+    PG_END_TRY();
+
+    return exec_env;
+}
+
+void
+rst_module_release_instance(PreparedModule *pmod,
+                            wasm_exec_env_t exec_env,
+                            bool reusable) {
+    Assert(pmod->pooled_exec_env == NULL);
+    wasm_module_inst_t instance = wasm_exec_env_get_module_inst(exec_env);
+    wasm_runtime_clear_exception(instance);
+
+    // After an error the execution environment may be left inconsistent,
+    // so it is never traversed by the GC again.
+    InstanceSnapshot *snapshot = pmod->snapshot;
+    if (reusable && snapshot && collect_job_objects(snapshot, exec_env)
+        && restore_memories(snapshot, exec_env)) {
+        wasm_runtime_set_user_data(exec_env, NULL);
+        pmod->pooled_exec_env = exec_env;
+        return;
+    }
+
+    ereport(DEBUG1, errmsg("discard instance of module \"%s\"", pmod->name));
+    destroy_instance(exec_env);
+    if (snapshot) {
+        // Unfinalized job objects are released with the transaction instead
+        rst_live_objs = snapshot->live_objs;
+        free_snapshot(snapshot);
+        pmod->snapshot = NULL;
+    }
+}
@@ -19,6 +19,7 @@
 
 #include "postgres.h"
 #include "executor/spi.h"
+#include "fmgr.h"
 
 #include "aot_runtime.h"
 
@@ -27,11 +28,26 @@
 
 #define RST_MODULE_NAME_MAXLEN 127
 
+typedef struct InstanceSnapshot InstanceSnapshot;
+
+// Resolves instance-specific parts of the context template, like callbacks
+typedef void (*ContextInitializer)(Context *ctx, wasm_module_inst_t instance);
+
 typedef struct PreparedModule {
     char name[RST_MODULE_NAME_MAXLEN + 1];
     AOTModule *module;
     SPITupleTable *loading_tuptable;
+    // Mapping of the on-disk code cache file if the image was loaded from it
+    uint8 *loading_image;
+    uint32 loading_image_size;
     CommonHeapTypes heap_types;
+
+    // Pooled instance of this module with its post-init snapshot and context
+    // template, reused across jobs of the same worker; dropped together with
+    // the module.
+    wasm_exec_env_t pooled_exec_env;
+    InstanceSnapshot *snapshot;
+
     int nqueries;
     QueryPlan queries[];
 } PreparedModule;
@@ -51,9 +67,30 @@ rst_lookup_module(const char *name);
 void
 rst_free_module(PreparedModule *pmod);
 
+void
+rst_module_release_bin_code(PreparedModule *pmod);
+
+Datum
+rst_evict_code_cache(PG_FUNCTION_ARGS);
+
 wasm_exec_env_t
 rst_module_instantiate(PreparedModule *pmod,
                        uint32 stack_size,
                        uint32 heap_size);
 
+wasm_exec_env_t
+rst_module_acquire_instance(PreparedModule *pmod,
+                            uint32 stack_size,
+                            uint32 heap_size,
+                            Context *context,
+                            ContextInitializer init_context);
+
+void
+rst_module_release_instance(PreparedModule *pmod,
+                            wasm_exec_env_t exec_env,
+                            bool reusable);
+
+void
+rst_module_warm_up(PreparedModule *pmod);
+
 #endif /* RUSTICA_MODULE_H */
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2024-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              https://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#include "postgres.h"
+
+#include "rustica/output.h"
+#include "rustica/wamr.h"
+
+void
+rst_output_init(OutputBuffer *out) {
+    memset(out, 0, sizeof(OutputBuffer));
+    initStringInfo(&out->staging);
+}
+
+void
+rst_output_append(OutputBuffer *out,
+                  wasm_exec_env_t exec_env,
+                  wasm_obj_t ref,
+                  const char *data,
+                  int32 len) {
+    OutputChunk *chunk;
+
+    if (len <= 0)
+        return;
+    Assert(!rst_output_full(out));
+    out->exec_env = exec_env;
+    out->pending += len;
+
+    // Small pieces are cheaper to copy than to pin and give their own iovec
+    if (len <= OUTPUT_INLINE_SIZE || ref == NULL) {
+        if (out->tail > out->head) {
+            chunk = &out->chunks[out->tail - 1];
+            if (chunk->data == NULL
+                && chunk->offset + chunk->len == out->staging.len) {
+                appendBinaryStringInfoNT(&out->staging, data, len);
+                chunk->len += len;
+                return;
+            }
+        }
+        chunk = &out->chunks[out->tail++];
+        chunk->data = NULL;
+        chunk->offset = out->staging.len;
+        chunk->len = len;
+        chunk->pinned = false;
+        appendBinaryStringInfoNT(&out->staging, data, len);
+        return;
+    }
+
+    chunk = &out->chunks[out->tail++];
+    chunk->data = data;
+    chunk->offset = 0;
+    chunk->len = len;
+    chunk->pinned = true;
+    wasm_runtime_push_local_obj_ref(exec_env, &chunk->ref);
+    chunk->ref.val = ref;
+}
+
+bool
+rst_output_full(OutputBuffer *out) {
+    return out->tail == OUTPUT_MAX_CHUNKS || out->pending >= OUTPUT_FLUSH_SIZE;
+}
+
+int
+rst_output_iov(OutputBuffer *out, struct iovec *iov) {
+    int n = 0;
+    for (int i = out->head; i < out->tail; i++, n++) {
+        OutputChunk *chunk = &out->chunks[i];
+        iov[n].iov_base = chunk->data ? (char *)chunk->data
+                                      : out->staging.data + chunk->offset;
+        iov[n].iov_len = chunk->len;
+    }
+    return n;
+}
+
+static void
+unpin(OutputBuffer *out, OutputChunk *chunk) {
+    if (chunk->pinned) {
+        wasm_runtime_remove_local_obj_ref(out->exec_env, &chunk->ref);
+        chunk->pinned = false;
+    }
+}
+
+void
+rst_output_consume(OutputBuffer *out, size_t written) {
+    out->pending -= written;
+    while (written > 0 && out->head < out->tail) {
+        OutputChunk *chunk = &out->chunks[out->head];
+        if (written < (size_t)chunk->len) {
+            // Partially written, continue from there next time
+            if (chunk->data)
+                chunk->data += written;
+            else
+                chunk->offset += (int32)written;
+            chunk->len -= (int32)written;
+            return;
+        }
+        written -= chunk->len;
+        unpin(out, chunk);
+        out->head++;
+    }
+    if (out->head == out->tail)
+        rst_output_reset(out);
+}
+
+void
+rst_output_reset(OutputBuffer *out) {
+    // Release in reverse, so that the pinned refs pop off the stack in order
+    for (int i = out->tail - 1; i >= out->head; i--)
+        unpin(out, &out->chunks[i]);
+    out->head = 0;
+    out->tail = 0;
+    out->pending = 0;
+    resetStringInfo(&out->staging);
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (c) 2024-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              https://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#ifndef RUSTICA_OUTPUT_H
+#define RUSTICA_OUTPUT_H
+
+#include <sys/uio.h>
+
+#include "postgres.h"
+#include "lib/stringinfo.h"
+
+#include "wasm_runtime_common.h"
+
+#define OUTPUT_MAX_CHUNKS 64
+#define OUTPUT_INLINE_SIZE 256
+#define OUTPUT_FLUSH_SIZE (64 * 1024)
+
+// A piece of pending output, either copied into the staging buffer or
+// referencing the memory of a guest object that is pinned until flushed.
+typedef struct OutputChunk {
+    const char *data; // NULL when staged
+    int32 offset;     // only for staged chunks
+    int32 len;
+    bool pinned;
+    wasm_local_obj_ref_t ref;
+} OutputChunk;
+
+typedef struct OutputBuffer {
+    wasm_exec_env_t exec_env;
+    OutputChunk chunks[OUTPUT_MAX_CHUNKS];
+    int head;
+    int tail;
+    size_t pending;
+    StringInfoData staging;
+} OutputBuffer;
+
+void
+rst_output_init(OutputBuffer *out);
+
+void
+rst_output_append(OutputBuffer *out,
+                  wasm_exec_env_t exec_env,
+                  wasm_obj_t ref,
+                  const char *data,
+                  int32 len);
+
+bool
+rst_output_full(OutputBuffer *out);
+
+int
+rst_output_iov(OutputBuffer *out, struct iovec *iov);
+
+void
+rst_output_consume(OutputBuffer *out, size_t written);
+
+void
+rst_output_reset(OutputBuffer *out);
+
+#endif /* RUSTICA_OUTPUT_H */
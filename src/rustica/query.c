@@ -15,6 +15,7 @@
  */
 
 #include "postgres.h"
+#include "access/htup_details.h"
 #include "executor/spi.h"
 #include "utils/builtins.h"
 #include "utils/lsyscache.h"
@@ -26,6 +27,7 @@
 #include "rustica/datatypes.h"
 #include "rustica/module.h"
 #include "rustica/query.h"
+#include "rustica/stats.h"
 
 static RST_WASM_TO_PG_RET
 wasm_i32_to_pg_bool(RST_WASM_TO_PG_ARGS) {
@@ -479,9 +481,12 @@ rst_init_instance_context(wasm_exec_env_t exec_env) {
 }
 
 void
-rst_free_instance_context(wasm_exec_env_t exec_env) {
-    Context *ctx = (Context *)wasm_runtime_get_user_data(exec_env);
-    pfree(ctx->anyref_array->defined_type);
+rst_free_instance_context(Context *ctx) {
+    if (ctx->anyref_array) {
+        pfree(ctx->anyref_array->defined_type);
+        ctx->anyref_array = NULL;
+    }
+    rst_free_context_for_json_schema(ctx);
 }
 
 static int32_t
@@ -507,11 +512,98 @@ env_execute_statement(wasm_exec_env_t exec_env, int32_t idx) {
         wasm_struct_obj_get_field(args, i, false, &val);
         values[i] = plan->wasm_to_pg_funcs[i](exec_env, plan->argtypes[i], val);
     }
+    StatTimer timer;
+    rst_stat_query_begin(plan, &timer);
     SPI_execute_plan(plan->plan, values, NULL, false, 0);
+    rst_stat_query_end(plan, &timer, SPI_processed, true);
 
     return 1;
 }
 
+static int64_t
+env_execute_statement_batch(wasm_exec_env_t exec_env,
+                            int32_t idx,
+                            wasm_obj_t args_ref) {
+    ereport(DEBUG1, (errmsg("execute sql batch: #%d", idx)));
+
+    // Take out the QueryPlan
+    Context *ctx = (Context *)wasm_runtime_get_user_data(exec_env);
+    if (idx < 0 || idx >= ctx->module->nqueries)
+        ereport(ERROR, errmsg("no such query: #%d", idx));
+    QueryPlan *plan = ctx->module->queries + idx;
+    if (!args_ref || !wasm_obj_is_array_obj(args_ref))
+        ereport(ERROR, errmsg("expected an array of query arguments"));
+    wasm_array_obj_t args_array = (wasm_array_obj_t)args_ref;
+    uint32 len = wasm_array_obj_length(args_array);
+
+    // Run the kept plan once per argument struct, so the cached plan and the
+    // executor setup are shared. Converted arguments and results of each
+    // round are dropped right away to keep memory flat for large batches.
+    MemoryContext batch_mctx =
+        AllocSetContextCreate(CurrentMemoryContext,
+                              "execute_statement_batch",
+                              ALLOCSET_DEFAULT_SIZES);
+    MemoryContext old_mctx = MemoryContextSwitchTo(batch_mctx);
+    int64_t total = 0;
+    Datum values[plan->nargs];
+    PG_TRY();
+    {
+        for (uint32 row = 0; row < len; row++) {
+            wasm_value_t val;
+            wasm_array_obj_get_elem(args_array, row, false, &val);
+            if (!rst_is_query_args(ctx, idx, val.gc_obj))
+                ereport(ERROR,
+                        errmsg("bad query arguments at index %u", row));
+            wasm_struct_obj_t args = (wasm_struct_obj_t)val.gc_obj;
+            for (uint32 i = 0; i < plan->nargs; i++) {
+                wasm_struct_obj_get_field(args, i, false, &val);
+                values[i] = plan->wasm_to_pg_funcs[i](exec_env,
+                                                      plan->argtypes[i],
+                                                      val);
+            }
+            StatTimer timer;
+            rst_stat_query_begin(plan, &timer);
+            int ret = SPI_execute_plan(plan->plan, values, NULL, false, 0);
+            if (ret < 0)
+                ereport(ERROR,
+                        errmsg("failed to execute query #%d: %s",
+                               idx,
+                               SPI_result_code_string(ret)));
+            rst_stat_query_end(plan, &timer, SPI_processed, true);
+            total += (int64_t)SPI_processed;
+            SPI_freetuptable(SPI_tuptable);
+            MemoryContextReset(batch_mctx);
+        }
+    }
+    PG_FINALLY();
+    {
+        MemoryContextSwitchTo(old_mctx);
+        MemoryContextDelete(batch_mctx);
+    }
+    PG_END_TRY();
+
+    return total;
+}
+
+bool
+rst_is_query_args(Context *ctx, int32 idx, wasm_obj_t obj) {
+    wasm_value_t val;
+    bool is_mutable;
+
+    if (!obj || !wasm_obj_is_struct_obj(obj))
+        return false;
+
+    // Field 3 of the query struct holds the arguments of the query
+    wasm_struct_obj_get_field(ctx->queries, idx, false, &val);
+    wasm_struct_type_t query_type =
+        (wasm_struct_type_t)wasm_obj_get_defined_type(val.gc_obj);
+    wasm_ref_type_t args_type =
+        wasm_struct_type_get_field_type(query_type, 3, &is_mutable);
+    return wasm_obj_get_defined_type_idx((wasm_module_t)ctx->module->module,
+                                         obj)
+           == args_type.heap_type;
+}
+
 static wasm_externref_obj_t
 env_cursor_open(wasm_exec_env_t exec_env, int32_t idx) {
     ereport(DEBUG1, (errmsg("cursor_open: #%d", idx)));
@@ -537,7 +629,10 @@ env_cursor_open(wasm_exec_env_t exec_env, int32_t idx) {
         wasm_struct_obj_get_field(args, i, false, &val);
         values[i] = plan->wasm_to_pg_funcs[i](exec_env, plan->argtypes[i], val);
     }
+    StatTimer timer;
+    rst_stat_query_begin(plan, &timer);
     Portal portal = SPI_cursor_open(NULL, plan->plan, values, NULL, false);
+    rst_stat_query_end(plan, &timer, 0, true);
     obj_t rv = rst_obj_new(exec_env, OBJ_PORTAL, NULL, 0);
     rv->flags |= OBJ_OWNS_BODY;
     rv->body.portal = portal;
@@ -552,7 +647,12 @@ env_cursor_fetch(wasm_exec_env_t exec_env, wasm_obj_t cursor_ref, long count) {
     if (!PortalIsValid(portal))
         ereport(ERROR, errmsg("portal already closed"));
 
+    Context *ctx = (Context *)wasm_runtime_get_user_data(exec_env);
+    QueryPlan *plan = ctx->module->queries + obj->query_idx;
+    StatTimer timer;
+    rst_stat_query_begin(plan, &timer);
     SPI_cursor_fetch(portal, true, count);
+    rst_stat_query_end(plan, &timer, SPI_processed, false);
     obj_t rv = rst_obj_new(exec_env, OBJ_TUPLE_TABLE, NULL, 0);
     rv->query_idx = obj->query_idx;
     if (SPI_processed == 0) {
@@ -611,6 +711,27 @@ env_tuple_table_get(wasm_exec_env_t exec_env,
     return rst_externref_of_obj(exec_env, rv);
 }
 
+static void
+lower_tuple(wasm_exec_env_t exec_env,
+            QueryPlan *plan,
+            TupleDesc tupdesc,
+            HeapTuple tuple,
+            wasm_obj_t parent,
+            wasm_struct_obj_t ret) {
+    Datum values[tupdesc->natts];
+    bool nulls[tupdesc->natts];
+    heap_deform_tuple(tuple, tupdesc, values, nulls);
+    for (uint32 i = 0; i < plan->nattrs; i++) {
+        wasm_value_t col_value =
+            plan->pg_to_wasm_funcs[i](values[i],
+                                      parent,
+                                      plan->rettypes[i],
+                                      exec_env,
+                                      plan->ret_field_types[i]);
+        wasm_struct_obj_set_field(ret, i, &col_value);
+    }
+}
+
 static int32_t
 env_tuple_lower(wasm_exec_env_t exec_env, wasm_obj_t tuple_ref) {
     obj_t obj = wasm_externref_obj_get_obj(tuple_ref, OBJ_HEAP_TUPLE);
@@ -638,25 +759,92 @@ env_tuple_lower(wasm_exec_env_t exec_env, wasm_obj_t tuple_ref) {
     wasm_struct_obj_set_field(box, 0, &row_value);
 
     // Fill the result value fields
-    bool isnull;
-    TupleDesc tupdesc = tuptable_obj->body.tuptable->tupdesc;
-    HeapTuple tuple = obj->body.tuple;
-    for (uint32 i = 0; i < plan->nattrs; i++) {
-        Datum binval = SPI_getbinval(tuple, tupdesc, (int)i + 1, &isnull);
-        wasm_value_t col_value =
-            plan->pg_to_wasm_funcs[i](binval,
-                                      tuple_ref,
-                                      plan->rettypes[i],
-                                      exec_env,
-                                      plan->ret_field_types[i]);
-        wasm_struct_obj_set_field(ret, i, &col_value);
-    }
+    lower_tuple(exec_env,
+                plan,
+                tuptable_obj->body.tuptable->tupdesc,
+                obj->body.tuple,
+                tuple_ref,
+                ret);
 
     return 1;
 }
 
+static int32_t
+env_tuple_table_lower_range(wasm_exec_env_t exec_env,
+                            wasm_obj_t tuptable_ref,
+                            wasm_obj_t array_ref,
+                            int32_t start,
+                            int32_t count) {
+    obj_t obj = wasm_externref_obj_get_obj(tuptable_ref, OBJ_TUPLE_TABLE);
+    SPITupleTable *tuptable = obj->body.tuptable;
+    int32_t numvals = tuptable ? (int32_t)tuptable->numvals : 0;
+    if (start < 0 || count < 0 || start > numvals)
+        ereport(ERROR, errmsg("index out of range"));
+    count = Min(count, numvals - start);
+    if (count == 0)
+        return 0;
+
+    Context *ctx = (Context *)wasm_runtime_get_user_data(exec_env);
+    QueryPlan *plan = ctx->module->queries + obj->query_idx;
+    if (plan->nattrs == 0)
+        ereport(ERROR, errmsg("no attributes in the tuple"));
+
+    // The guest provides an array of the query's row struct type
+    if (!array_ref || !wasm_obj_is_array_obj(array_ref))
+        ereport(ERROR, errmsg("expected an array of rows"));
+    wasm_array_obj_t array = (wasm_array_obj_t)array_ref;
+    wasm_array_type_t array_type =
+        (wasm_array_type_t)wasm_obj_get_defined_type(array_ref);
+    wasm_ref_type_t elem_type =
+        wasm_array_type_get_elem_type(array_type, NULL);
+    if ((elem_type.value_type != VALUE_TYPE_HT_NULLABLE_REF
+         && elem_type.value_type != VALUE_TYPE_HT_NON_NULLABLE_REF)
+        || elem_type.heap_type != plan->ret_type.heap_type)
+        ereport(ERROR, errmsg("array element type mismatch"));
+    if ((uint32)count > wasm_array_obj_length(array))
+        ereport(ERROR,
+                errmsg("array too short: %u rows needed, length %u",
+                       (uint32)count,
+                       wasm_array_obj_length(array)));
+
+    // Every row struct is stored into the rooted array before its fields are
+    // lowered, so that allocations of later columns can't collect it. Datum
+    // columns are parented by the tuple table that owns the tuples.
+    wasm_local_obj_ref_t array_local;
+    wasm_runtime_push_local_obj_ref(exec_env, &array_local);
+    array_local.val = array_ref;
+    for (int32_t i = 0; i < count; i++) {
+        wasm_struct_obj_t row =
+            wasm_struct_obj_new_with_typeidx(exec_env,
+                                             plan->ret_type.heap_type);
+        wasm_value_t row_value = { .gc_obj = (wasm_obj_t)row };
+        wasm_array_obj_set_elem(array, (uint32)i, &row_value);
+        lower_tuple(exec_env,
+                    plan,
+                    tuptable->tupdesc,
+                    tuptable->vals[start + i],
+                    tuptable_ref,
+                    row);
+    }
+    wasm_runtime_pop_local_obj_ref(exec_env);
+
+    return count;
+}
+
+static int32_t
+env_tuple_table_lower_all(wasm_exec_env_t exec_env,
+                          wasm_obj_t tuptable_ref,
+                          wasm_obj_t array_ref) {
+    return env_tuple_table_lower_range(exec_env,
+                                       tuptable_ref,
+                                       array_ref,
+                                       0,
+                                       INT32_MAX);
+}
+
 static NativeSymbol query_symbols[] = {
     { "execute_statement", env_execute_statement, "(i)i" },
+    { "execute_statement_batch", env_execute_statement_batch, "(ir)I" },
     { "cursor_open", env_cursor_open, "(i)r" },
     { "cursor_fetch", env_cursor_fetch, "(ri)r" },
     { "cursor_fetch_all", env_cursor_fetch_all, "(r)r" },
@@ -664,6 +852,8 @@ static NativeSymbol query_symbols[] = {
     { "tuple_table_len", env_tuple_table_len, "(r)i" },
     { "tuple_table_get", env_tuple_table_get, "(ri)r" },
     { "tuple_lower", env_tuple_lower, "(r)i" },
+    { "tuple_table_lower_all", env_tuple_table_lower_all, "(rr)i" },
+    { "tuple_table_lower_range", env_tuple_table_lower_range, "(rrii)i" },
 };
 
 void
@@ -18,6 +18,7 @@
 #define RUSTICA_QUERY_H
 
 #include "postgres.h"
+#include "datatype/timestamp.h"
 #include "executor/spi.h"
 #include "storage/latch.h"
 
@@ -34,10 +35,15 @@
 #define RST_PG_TO_WASM_RET wasm_value_t
 
 typedef struct PreparedModule PreparedModule;
+typedef struct QueryStats QueryStats;
+typedef struct JsonSchema JsonSchema;
 
 typedef struct Context {
     WaitEventSet *wait_set;
     pgsocket fd;
+    TimestampTz recv_deadline;
+    TimestampTz send_deadline;
+    wasm_function_inst_t start;
 
     llhttp_t http_parser;
     llhttp_settings_t http_settings;
@@ -58,6 +64,7 @@ typedef struct Context {
     wasm_function_inst_t on_body;
     wasm_function_inst_t on_message_complete;
     wasm_function_inst_t on_error;
+    bool message_complete;
 
     PreparedModule *module;
     wasm_struct_obj_t queries;
@@ -71,6 +78,8 @@ typedef struct Context {
     wasm_function_inst_t json_parse_object_end;
     wasm_function_inst_t json_parse_array_start;
     wasm_function_inst_t json_parse_array_end;
+    JsonSchema *json_schemas;
+    uint32 njson_schemas;
 } Context;
 
 typedef RST_WASM_TO_PG_RET (*WASM2PGFunc)(RST_WASM_TO_PG_ARGS);
@@ -86,6 +95,7 @@ typedef struct QueryPlan {
     wasm_ref_type_t *ret_field_types;
     WASM2PGFunc *wasm_to_pg_funcs;
     PG2WASMFunc *pg_to_wasm_funcs;
+    QueryStats *stats; // in shared memory, NULL if not tracked
 } QueryPlan;
 
 void
@@ -94,11 +104,17 @@ rst_init_query_plan(QueryPlan *plan, HeapTuple query_tup, TupleDesc tupdesc);
 void
 rst_free_query_plan(QueryPlan *plan);
 
+bool
+rst_is_query_args(Context *ctx, int32 idx, wasm_obj_t obj);
+
 void
 rst_init_instance_context(wasm_exec_env_t exec_env);
 
 void
-rst_free_instance_context(wasm_exec_env_t exec_env);
+rst_free_instance_context(Context *ctx);
+
+void
+rst_free_context_for_json_schema(Context *ctx);
 
 void
 rst_register_natives_query();
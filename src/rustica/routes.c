@@ -0,0 +1,390 @@
+/*
+ * Copyright (c) 2024-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              https://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#include "postgres.h"
+#include "executor/spi.h"
+#include "miscadmin.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+
+#include "llhttp.h"
+
+#include "rustica/gucs.h"
+#include "rustica/module.h"
+#include "rustica/routes.h"
+
+#define ROUTES_TRANCHE "rustica routes"
+
+// Trie nodes budgeted per route, shared prefixes take less
+#define ROUTE_NODES_PER_ROUTE 64
+
+// A character of the routing key, which is the lower-cased host without port
+// followed by the path. Paths start with a slash that never occurs in hosts,
+// so a route can only match once its whole host has.
+typedef struct RouteNode {
+    int32 first_child;
+    int32 next_sibling;
+    int16 module; // index of the module routed to, or -1
+    char ch;
+} RouteNode;
+
+typedef struct RouteTrie {
+    RouteNode *nodes;
+    int nnodes;
+    int capacity;
+} RouteTrie;
+
+// Published by the workers from rustica.routes, read by workers and the master
+typedef struct RoutesShared {
+    LWLock *lock;
+    int nmodules;
+    char modules[ROUTES_MAX_MODULES][RST_MODULE_NAME_MAXLEN + 1];
+    int max_nodes;
+    int nnodes; // 1 while there are no routes, the root only
+    RouteNode nodes[FLEXIBLE_ARRAY_MEMBER];
+} RoutesShared;
+
+static const char *load_routes_sql =
+    "SELECT lower(host), path_prefix, module FROM rustica.routes";
+
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static RoutesShared *routes_shared = NULL;
+
+static int
+max_route_nodes() {
+    return 1 + rst_max_routes * ROUTE_NODES_PER_ROUTE;
+}
+
+static Size
+routes_shmem_size() {
+    return add_size(offsetof(RoutesShared, nodes),
+                    mul_size(max_route_nodes(), sizeof(RouteNode)));
+}
+
+static void
+init_root(RouteNode *root) {
+    root->first_child = -1;
+    root->next_sibling = -1;
+    root->module = -1;
+    root->ch = '\0';
+}
+
+static void
+routes_shmem_request() {
+    if (prev_shmem_request_hook)
+        prev_shmem_request_hook();
+    RequestAddinShmemSpace(routes_shmem_size());
+    RequestNamedLWLockTranche(ROUTES_TRANCHE, 1);
+}
+
+static void
+routes_shmem_startup() {
+    bool found;
+
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+    routes_shared =
+        ShmemInitStruct("rustica routes", routes_shmem_size(), &found);
+    if (!found) {
+        routes_shared->lock = &(GetNamedLWLockTranche(ROUTES_TRANCHE))->lock;
+        routes_shared->nmodules = 1;
+        strlcpy(routes_shared->modules[0],
+                "main",
+                sizeof(routes_shared->modules[0]));
+        routes_shared->max_nodes = max_route_nodes();
+        routes_shared->nnodes = 1;
+        init_root(&routes_shared->nodes[0]);
+    }
+    LWLockRelease(AddinShmemInitLock);
+}
+
+void
+rst_init_routes() {
+    // Routes are shared with the master, which needs shared_preload_libraries
+    if (!process_shared_preload_libraries_in_progress)
+        return;
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = routes_shmem_request;
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = routes_shmem_startup;
+}
+
+bool
+rst_routes_enabled() {
+    return routes_shared != NULL && routes_shared->nnodes > 1;
+}
+
+static void
+trie_insert(RouteTrie *trie, const char *key, int16 module) {
+    int node = 0;
+
+    for (const char *p = key; *p; p++) {
+        int child = trie->nodes[node].first_child;
+        while (child >= 0 && trie->nodes[child].ch != *p)
+            child = trie->nodes[child].next_sibling;
+        if (child < 0) {
+            if (trie->nnodes == trie->capacity) {
+                trie->capacity *= 2;
+                trie->nodes = repalloc(trie->nodes,
+                                       sizeof(RouteNode) * trie->capacity);
+            }
+            child = trie->nnodes++;
+            trie->nodes[child].first_child = -1;
+            trie->nodes[child].next_sibling = trie->nodes[node].first_child;
+            trie->nodes[child].module = -1;
+            trie->nodes[child].ch = *p;
+            trie->nodes[node].first_child = child;
+        }
+        node = child;
+    }
+    trie->nodes[node].module = module;
+}
+
+static int
+trie_match(const RouteNode *nodes,
+           const char *host,
+           int host_len,
+           const char *path,
+           int path_len) {
+    int node = 0;
+    int found = -1;
+
+    // The longest prefix wins
+    for (int i = 0; i < host_len + path_len; i++) {
+        char ch = i < host_len ? host[i] : path[i - host_len];
+        int child = nodes[node].first_child;
+        while (child >= 0 && nodes[child].ch != ch)
+            child = nodes[child].next_sibling;
+        if (child < 0)
+            break;
+        node = child;
+        if (nodes[node].module >= 0)
+            found = nodes[node].module;
+    }
+    return found;
+}
+
+void
+rst_load_routes() {
+    RouteTrie trie;
+    char(*modules)[RST_MODULE_NAME_MAXLEN + 1];
+    int nmodules = 1;
+    int nroutes = 0;
+
+    if (routes_shared == NULL)
+        return;
+    if (SPI_execute(load_routes_sql, true, 0) != SPI_OK_SELECT)
+        ereport(ERROR, errmsg("could not load routes"));
+
+    modules = palloc(sizeof(*modules) * ROUTES_MAX_MODULES);
+    strlcpy(modules[0], "main", sizeof(modules[0]));
+    trie.capacity = 64;
+    trie.nnodes = 1;
+    trie.nodes = palloc(sizeof(RouteNode) * trie.capacity);
+    init_root(&trie.nodes[0]);
+
+    for (uint64 row = 0; row < SPI_processed; row++) {
+        HeapTuple tuple = SPI_tuptable->vals[row];
+        TupleDesc tupdesc = SPI_tuptable->tupdesc;
+        char *host = SPI_getvalue(tuple, tupdesc, 1);
+        char *path = SPI_getvalue(tuple, tupdesc, 2);
+        char *module = SPI_getvalue(tuple, tupdesc, 3);
+        int index;
+
+        for (index = 0; index < nmodules; index++)
+            if (strcmp(modules[index], module) == 0)
+                break;
+        if (index == nmodules) {
+            if (nmodules == ROUTES_MAX_MODULES
+                || strlen(module) > RST_MODULE_NAME_MAXLEN) {
+                ereport(WARNING,
+                        errmsg("cannot route \"%s%s\" to module \"%s\"",
+                               host,
+                               path,
+                               module),
+                        errdetail("At most %d modules can be routed to.",
+                                  ROUTES_MAX_MODULES));
+                continue;
+            }
+            strlcpy(modules[nmodules++], module, sizeof(modules[0]));
+        }
+        trie_insert(&trie, psprintf("%s%s", host, path), (int16)index);
+        nroutes++;
+    }
+
+    LWLockAcquire(routes_shared->lock, LW_EXCLUSIVE);
+    if (trie.nnodes > routes_shared->max_nodes) {
+        LWLockRelease(routes_shared->lock);
+        ereport(WARNING,
+                errmsg("too many routes in rustica.routes, keeping the "
+                       "previous ones"),
+                errhint("Increase rustica.max_routes."));
+        return;
+    }
+    routes_shared->nmodules = nmodules;
+    memcpy(routes_shared->modules, modules, sizeof(*modules) * nmodules);
+    memcpy(routes_shared->nodes, trie.nodes, sizeof(RouteNode) * trie.nnodes);
+    routes_shared->nnodes = trie.nnodes;
+    LWLockRelease(routes_shared->lock);
+
+    pfree(trie.nodes);
+    pfree(modules);
+    ereport(DEBUG1,
+            errmsg("loaded %d routes to %d modules", nroutes, nmodules));
+}
+
+static int
+on_head_url(llhttp_t *p, const char *at, size_t length) {
+    RouteHead *head = p->data;
+
+    for (size_t i = 0; i < length && !head->path_done; i++) {
+        if (at[i] == '?' || at[i] == '#'
+            || head->path_len == ROUTE_PATH_MAXLEN)
+            head->path_done = true;
+        else
+            head->path[head->path_len++] = at[i];
+    }
+    return HPE_OK;
+}
+
+static int
+on_head_header_field(llhttp_t *p, const char *at, size_t length) {
+    RouteHead *head = p->data;
+
+    for (size_t i = 0; i < length; i++) {
+        if (head->field_len < (int)sizeof(head->field))
+            head->field[head->field_len] = at[i];
+        head->field_len++;
+    }
+    return HPE_OK;
+}
+
+static int
+on_head_header_field_complete(llhttp_t *p) {
+    RouteHead *head = p->data;
+
+    head->in_host = head->host_len == 0 && head->field_len == 4
+                    && pg_strncasecmp(head->field, "host", 4) == 0;
+    head->field_len = 0;
+    return HPE_OK;
+}
+
+static int
+on_head_header_value(llhttp_t *p, const char *at, size_t length) {
+    RouteHead *head = p->data;
+
+    if (!head->in_host)
+        return HPE_OK;
+    for (size_t i = 0; i < length && head->host_len < ROUTE_HOST_MAXLEN; i++)
+        head->host[head->host_len++] = at[i];
+    return HPE_OK;
+}
+
+static int
+on_head_headers_complete(llhttp_t *p) {
+    RouteHead *head = p->data;
+
+    // Stop before the body, the head is all that's needed
+    head->complete = true;
+    return HPE_PAUSED;
+}
+
+static const llhttp_settings_t head_settings = {
+    .on_url = on_head_url,
+    .on_header_field = on_head_header_field,
+    .on_header_field_complete = on_head_header_field_complete,
+    .on_header_value = on_head_header_value,
+    .on_headers_complete = on_head_headers_complete,
+};
+
+int
+rst_route_parse_head(const char *data, size_t len, RouteHead *head) {
+    llhttp_t parser;
+    llhttp_errno_t rv;
+
+    memset(head, 0, sizeof(RouteHead));
+    llhttp_init(&parser, HTTP_REQUEST, &head_settings);
+    parser.data = head;
+    rv = llhttp_execute(&parser, data, len);
+    if (head->complete)
+        return ROUTE_HEAD_COMPLETE;
+    if (rv != HPE_OK)
+        return ROUTE_HEAD_INVALID;
+    return ROUTE_HEAD_INCOMPLETE;
+}
+
+int
+rst_route_match(RouteHead *head, char *module) {
+    int index = -1;
+    int host_len = head->host_len;
+
+    // Strip the port, minding IPv6 literals
+    for (int i = host_len - 1; i >= 0 && head->host[i] != ']'; i--) {
+        if (head->host[i] == ':') {
+            host_len = i;
+            break;
+        }
+    }
+    for (int i = 0; i < host_len; i++)
+        head->host[i] = pg_tolower((unsigned char)head->host[i]);
+
+    if (!rst_routes_enabled()) {
+        if (module)
+            strlcpy(module, "main", RST_MODULE_NAME_MAXLEN + 1);
+        return 0;
+    }
+
+    // Routes of the exact host take precedence over those of any host
+    LWLockAcquire(routes_shared->lock, LW_SHARED);
+    if (host_len > 0)
+        index = trie_match(routes_shared->nodes,
+                           head->host,
+                           host_len,
+                           head->path,
+                           head->path_len);
+    if (index < 0)
+        index = trie_match(routes_shared->nodes,
+                           "*",
+                           1,
+                           head->path,
+                           head->path_len);
+    if (index < 0)
+        index = 0;
+    if (module)
+        strlcpy(module,
+                routes_shared->modules[index],
+                RST_MODULE_NAME_MAXLEN + 1);
+    LWLockRelease(routes_shared->lock);
+    return index;
+}
+
+uint64
+rst_routes_loaded_modules() {
+    uint64 loaded = 0;
+
+    if (!rst_routes_enabled())
+        return 0;
+    LWLockAcquire(routes_shared->lock, LW_SHARED);
+    for (int i = 0; i < routes_shared->nmodules; i++)
+        if (rst_lookup_module(routes_shared->modules[i]))
+            loaded |= UINT64CONST(1) << i;
+    LWLockRelease(routes_shared->lock);
+    return loaded;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2024-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              https://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#ifndef RUSTICA_ROUTES_H
+#define RUSTICA_ROUTES_H
+
+#include "postgres.h"
+
+// One bit per routed module in the messages of workers to the master, the
+// module at index 0 is always "main", which takes unrouted requests.
+#define ROUTES_MAX_MODULES 64
+
+// Longest request head read ahead to route a request
+#define ROUTE_HEAD_MAXLEN 8192
+#define ROUTE_HOST_MAXLEN 255
+#define ROUTE_PATH_MAXLEN 1024
+
+#define ROUTE_HEAD_INCOMPLETE 0
+#define ROUTE_HEAD_COMPLETE 1
+#define ROUTE_HEAD_INVALID 2
+
+// Host and path of a request, as far as they matter for routing
+typedef struct RouteHead {
+    char host[ROUTE_HOST_MAXLEN + 1];
+    int host_len;
+    char path[ROUTE_PATH_MAXLEN + 1];
+    int path_len;
+
+    // Parser state
+    bool path_done;   // past the query string or fragment
+    int field_len;    // length of the current header name
+    char field[4];    // first bytes of the current header name
+    bool in_host;     // reading the value of the Host header
+    bool complete;
+} RouteHead;
+
+void
+rst_init_routes();
+
+bool
+rst_routes_enabled();
+
+void
+rst_load_routes();
+
+int
+rst_route_parse_head(const char *data, size_t len, RouteHead *head);
+
+int
+rst_route_match(RouteHead *head, char *module);
+
+uint64
+rst_routes_loaded_modules();
+
+#endif /* RUSTICA_ROUTES_H */
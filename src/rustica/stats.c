@@ -0,0 +1,740 @@
+/*
+ * Copyright (c) 2024-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              https://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#include <math.h>
+
+#include "postgres.h"
+#include "access/htup_details.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "port/pg_bitutils.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "storage/spin.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/plancache.h"
+#include "utils/timestamp.h"
+
+#include "rustica/gucs.h"
+#include "rustica/module.h"
+#include "rustica/stats.h"
+
+#define STATS_TRANCHE "rustica stats"
+#define STAT_QUERIES_COLS 11
+#define STAT_WORKERS_COLS 12
+#define STAT_HTTP_COLS 12
+#define STAT_HTTP_LATENCY_COLS 4
+#define STAT_REQUESTS_COLS 12
+
+// Log-linear latency histogram in microseconds: each power of two is split
+// into HIST_SUB_BUCKETS linear buckets, so a bucket is never wider than a
+// quarter of its lower bound, from 1us up to over an hour.
+#define HIST_SUB_BITS 2
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS 128
+
+typedef struct QueryStatsKey {
+    char module[RST_MODULE_NAME_MAXLEN + 1];
+    int32 index;
+} QueryStatsKey;
+
+// Counters of one query of a module, shared by all workers. Entries are
+// never removed, so workers keep pointers to them in their QueryPlans.
+typedef struct QueryStats {
+    QueryStatsKey key;
+    slock_t mutex;
+    int64 calls;
+    int64 rows;
+    double total_time; // in milliseconds
+    double min_time;
+    double max_time;
+    double mean_time;
+    double sum_var_time; // for the stddev, see Welford's method
+    int64 generic_plans;
+    int64 custom_plans;
+} QueryStats;
+
+typedef struct Histogram {
+    pg_atomic_uint64 buckets[HIST_BUCKETS];
+    pg_atomic_uint64 sum; // in microseconds
+} Histogram;
+
+// Counters of a worker, only written by the worker itself. The slot is
+// taken at startup and freed on exit.
+typedef struct WorkerStats {
+    int pid; // 0 if the slot is free
+    int worker_id;
+    TimestampTz started_at;
+    pg_atomic_uint32 busy;
+    pg_atomic_uint64 requests;
+    pg_atomic_uint64 errors;
+    pg_atomic_uint64 bytes_in;
+    pg_atomic_uint64 bytes_out;
+    pg_atomic_uint64 time_us[HIST_COMMIT + 1]; // indexed by HIST_*
+} WorkerStats;
+
+// Totals of all workers, past and present, and the master's state
+typedef struct HttpStats {
+    pg_atomic_uint32 workers;
+    pg_atomic_uint32 idle_workers;
+    pg_atomic_uint32 queue_depth;
+    pg_atomic_uint32 max_queue_depth;
+    pg_atomic_uint64 queued;
+    pg_atomic_uint64 dispatched;
+    pg_atomic_uint64 rejected; // the queue was full
+    pg_atomic_uint64 expired;  // waited past rustica.queue_timeout
+    pg_atomic_uint64 requests;
+    pg_atomic_uint64 errors;
+    pg_atomic_uint64 bytes_in;
+    pg_atomic_uint64 bytes_out;
+    Histogram histograms[NUM_HISTOGRAMS];
+} HttpStats;
+
+typedef struct StatsShared {
+    LWLock *lock; // protects the hash table and worker slot allocation
+    HttpStats http;
+    int num_workers;
+    WorkerStats workers[FLEXIBLE_ARRAY_MEMBER];
+} StatsShared;
+
+// Ring buffer of the latest request traces. Each slot is a seqlock, odd while
+// being written, so that readers can skip torn entries without blocking.
+typedef struct TraceSlot {
+    pg_atomic_uint32 seq;
+    RequestTrace trace;
+} TraceSlot;
+
+typedef struct TraceRing {
+    pg_atomic_uint64 next;
+    int size;
+    TraceSlot slots[FLEXIBLE_ARRAY_MEMBER];
+} TraceRing;
+
+static const char *histogram_names[NUM_HISTOGRAMS] = {
+    "request", "instantiate", "handler", "commit", "dispatch",
+};
+
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static StatsShared *stats_shared = NULL;
+static HTAB *query_stats = NULL;
+static WorkerStats *my_stats = NULL;
+static TraceRing *trace_ring = NULL;
+
+static Size
+stats_shared_size() {
+    return add_size(offsetof(StatsShared, workers),
+                    mul_size(max_worker_processes, sizeof(WorkerStats)));
+}
+
+static Size
+trace_ring_size() {
+    return add_size(offsetof(TraceRing, slots),
+                    mul_size(rst_trace_buffer_size, sizeof(TraceSlot)));
+}
+
+static Size
+stats_shmem_size() {
+    Size size = add_size(MAXALIGN(stats_shared_size()),
+                         hash_estimate_size(rst_max_stat_queries,
+                                            sizeof(QueryStats)));
+    if (rst_trace_buffer_size > 0)
+        size = add_size(size, MAXALIGN(trace_ring_size()));
+    return size;
+}
+
+static void
+init_histogram(Histogram *h) {
+    for (int i = 0; i < HIST_BUCKETS; i++)
+        pg_atomic_init_u64(&h->buckets[i], 0);
+    pg_atomic_init_u64(&h->sum, 0);
+}
+
+static void
+init_worker_stats(WorkerStats *w) {
+    pg_atomic_init_u32(&w->busy, 0);
+    pg_atomic_init_u64(&w->requests, 0);
+    pg_atomic_init_u64(&w->errors, 0);
+    pg_atomic_init_u64(&w->bytes_in, 0);
+    pg_atomic_init_u64(&w->bytes_out, 0);
+    for (int i = 0; i <= HIST_COMMIT; i++)
+        pg_atomic_init_u64(&w->time_us[i], 0);
+}
+
+static void
+init_shared(StatsShared *shared) {
+    HttpStats *http = &shared->http;
+
+    shared->lock = &(GetNamedLWLockTranche(STATS_TRANCHE))->lock;
+    pg_atomic_init_u32(&http->workers, 0);
+    pg_atomic_init_u32(&http->idle_workers, 0);
+    pg_atomic_init_u32(&http->queue_depth, 0);
+    pg_atomic_init_u32(&http->max_queue_depth, 0);
+    pg_atomic_init_u64(&http->queued, 0);
+    pg_atomic_init_u64(&http->dispatched, 0);
+    pg_atomic_init_u64(&http->rejected, 0);
+    pg_atomic_init_u64(&http->expired, 0);
+    pg_atomic_init_u64(&http->requests, 0);
+    pg_atomic_init_u64(&http->errors, 0);
+    pg_atomic_init_u64(&http->bytes_in, 0);
+    pg_atomic_init_u64(&http->bytes_out, 0);
+    for (int i = 0; i < NUM_HISTOGRAMS; i++)
+        init_histogram(&http->histograms[i]);
+    shared->num_workers = max_worker_processes;
+    for (int i = 0; i < shared->num_workers; i++) {
+        shared->workers[i].pid = 0;
+        init_worker_stats(&shared->workers[i]);
+    }
+}
+
+static void
+stats_shmem_request() {
+    if (prev_shmem_request_hook)
+        prev_shmem_request_hook();
+    RequestAddinShmemSpace(stats_shmem_size());
+    RequestNamedLWLockTranche(STATS_TRANCHE, 1);
+}
+
+static void
+stats_shmem_startup() {
+    HASHCTL info;
+    bool found;
+
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+    stats_shared =
+        ShmemInitStruct("rustica stats", stats_shared_size(), &found);
+    if (!found)
+        init_shared(stats_shared);
+    info.keysize = sizeof(QueryStatsKey);
+    info.entrysize = sizeof(QueryStats);
+    query_stats = ShmemInitHash("rustica query stats",
+                                rst_max_stat_queries,
+                                rst_max_stat_queries,
+                                &info,
+                                HASH_ELEM | HASH_BLOBS);
+    if (rst_trace_buffer_size > 0) {
+        trace_ring = ShmemInitStruct("rustica request traces",
+                                     trace_ring_size(),
+                                     &found);
+        if (!found) {
+            pg_atomic_init_u64(&trace_ring->next, 0);
+            trace_ring->size = rst_trace_buffer_size;
+            for (int i = 0; i < trace_ring->size; i++) {
+                pg_atomic_init_u32(&trace_ring->slots[i].seq, 0);
+                memset(&trace_ring->slots[i].trace, 0, sizeof(RequestTrace));
+            }
+        }
+    }
+    LWLockRelease(AddinShmemInitLock);
+}
+
+void
+rst_init_stats() {
+    // Statistics are only kept when loaded in shared_preload_libraries
+    if (!process_shared_preload_libraries_in_progress)
+        return;
+    prev_shmem_request_hook = shmem_request_hook;
+    shmem_request_hook = stats_shmem_request;
+    prev_shmem_startup_hook = shmem_startup_hook;
+    shmem_startup_hook = stats_shmem_startup;
+}
+
+QueryStats *
+rst_stat_query_entry(const char *module, int32 index) {
+    QueryStatsKey key;
+    QueryStats *entry;
+    bool found;
+
+    if (!query_stats)
+        return NULL;
+    memset(&key, 0, sizeof(key));
+    strlcpy(key.module, module, sizeof(key.module));
+    key.index = index;
+
+    LWLockAcquire(stats_shared->lock, LW_SHARED);
+    entry = hash_search(query_stats, &key, HASH_FIND, NULL);
+    LWLockRelease(stats_shared->lock);
+    if (entry)
+        return entry;
+
+    // Queries beyond rustica.max_stat_queries are not tracked
+    LWLockAcquire(stats_shared->lock, LW_EXCLUSIVE);
+    entry = hash_search(query_stats, &key, HASH_ENTER_NULL, &found);
+    if (entry && !found) {
+        memset((char *)entry + sizeof(QueryStatsKey),
+               0,
+               sizeof(QueryStats) - sizeof(QueryStatsKey));
+        SpinLockInit(&entry->mutex);
+    }
+    LWLockRelease(stats_shared->lock);
+    return entry;
+}
+
+static CachedPlanSource *
+plan_source(QueryPlan *plan) {
+    return (CachedPlanSource *)linitial(SPI_plan_get_plan_sources(plan->plan));
+}
+
+void
+rst_stat_query_begin(QueryPlan *plan, StatTimer *timer) {
+    if (!plan->stats)
+        return;
+    CachedPlanSource *source = plan_source(plan);
+    timer->generic_plans = source->num_generic_plans;
+    timer->custom_plans = source->num_custom_plans;
+    INSTR_TIME_SET_CURRENT(timer->start);
+}
+
+void
+rst_stat_query_end(QueryPlan *plan, StatTimer *timer, uint64 rows, bool call) {
+    QueryStats *e = plan->stats;
+    instr_time duration;
+
+    if (!e)
+        return;
+    INSTR_TIME_SET_CURRENT(duration);
+    INSTR_TIME_SUBTRACT(duration, timer->start);
+    double ms = INSTR_TIME_GET_MILLISEC(duration);
+    CachedPlanSource *source = plan_source(plan);
+
+    SpinLockAcquire(&e->mutex);
+    e->rows += (int64)rows;
+    e->total_time += ms;
+    e->generic_plans += source->num_generic_plans - timer->generic_plans;
+    e->custom_plans += source->num_custom_plans - timer->custom_plans;
+
+    // Cursor fetches add to the time of the call that opened the cursor
+    if (call) {
+        e->calls++;
+        if (e->calls == 1) {
+            e->min_time = ms;
+            e->max_time = ms;
+            e->mean_time = ms;
+        }
+        else {
+            double old_mean = e->mean_time;
+            e->mean_time += (ms - old_mean) / e->calls;
+            e->sum_var_time += (ms - old_mean) * (ms - e->mean_time);
+            if (e->min_time > ms)
+                e->min_time = ms;
+            if (e->max_time < ms)
+                e->max_time = ms;
+        }
+    }
+    SpinLockRelease(&e->mutex);
+}
+
+Datum
+rst_stat_queries(PG_FUNCTION_ARGS) {
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+    HASH_SEQ_STATUS hash_seq;
+    QueryStats *entry;
+
+    if (!query_stats)
+        ereport(ERROR,
+                errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                errmsg("rustica-engine must be loaded via "
+                       "shared_preload_libraries"));
+    InitMaterializedSRF(fcinfo, 0);
+
+    LWLockAcquire(stats_shared->lock, LW_SHARED);
+    hash_seq_init(&hash_seq, query_stats);
+    while ((entry = hash_seq_search(&hash_seq)) != NULL) {
+        Datum values[STAT_QUERIES_COLS];
+        bool nulls[STAT_QUERIES_COLS] = { 0 };
+        QueryStats tmp;
+
+        SpinLockAcquire(&entry->mutex);
+        tmp = *entry;
+        SpinLockRelease(&entry->mutex);
+        if (tmp.calls == 0)
+            continue;
+
+        values[0] = CStringGetTextDatum(tmp.key.module);
+        values[1] = Int32GetDatum(tmp.key.index);
+        values[2] = Int64GetDatum(tmp.calls);
+        values[3] = Int64GetDatum(tmp.rows);
+        values[4] = Float8GetDatum(tmp.total_time);
+        values[5] = Float8GetDatum(tmp.min_time);
+        values[6] = Float8GetDatum(tmp.max_time);
+        values[7] = Float8GetDatum(tmp.mean_time);
+        values[8] = Float8GetDatum(
+            tmp.calls > 1 ? sqrt(tmp.sum_var_time / tmp.calls) : 0.0);
+        values[9] = Int64GetDatum(tmp.generic_plans);
+        values[10] = Int64GetDatum(tmp.custom_plans);
+        tuplestore_putvalues(rsinfo->setResult,
+                             rsinfo->setDesc,
+                             values,
+                             nulls);
+    }
+    LWLockRelease(stats_shared->lock);
+    return (Datum)0;
+}
+
+Datum
+rst_stat_queries_reset(PG_FUNCTION_ARGS) {
+    HASH_SEQ_STATUS hash_seq;
+    QueryStats *entry;
+
+    if (!query_stats)
+        PG_RETURN_VOID();
+
+    // Entries stay in place, as workers point to them
+    LWLockAcquire(stats_shared->lock, LW_SHARED);
+    hash_seq_init(&hash_seq, query_stats);
+    while ((entry = hash_seq_search(&hash_seq)) != NULL) {
+        SpinLockAcquire(&entry->mutex);
+        memset((char *)entry + offsetof(QueryStats, calls),
+               0,
+               sizeof(QueryStats) - offsetof(QueryStats, calls));
+        SpinLockRelease(&entry->mutex);
+    }
+    LWLockRelease(stats_shared->lock);
+    PG_RETURN_VOID();
+}
+
+static inline int
+hist_bucket(uint64 us) {
+    if (us < HIST_SUB_BUCKETS)
+        return (int)us;
+    int msb = pg_leftmost_one_pos64(us);
+    int sub = (int)(us >> (msb - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1);
+    return Min((msb - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + sub,
+               HIST_BUCKETS - 1);
+}
+
+static inline uint64
+hist_lower_bound(int bucket) {
+    if (bucket < HIST_SUB_BUCKETS)
+        return bucket;
+    int msb = bucket / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+    return (uint64)(HIST_SUB_BUCKETS + bucket % HIST_SUB_BUCKETS)
+           << (msb - HIST_SUB_BITS);
+}
+
+static inline uint64
+hist_width(int bucket) {
+    if (bucket < HIST_SUB_BUCKETS)
+        return 1;
+    return UINT64CONST(1) << (bucket / HIST_SUB_BUCKETS - 1);
+}
+
+static void
+hist_record(int histogram, uint64 us) {
+    Histogram *h = &stats_shared->http.histograms[histogram];
+    pg_atomic_fetch_add_u64(&h->buckets[hist_bucket(us)], 1);
+    pg_atomic_fetch_add_u64(&h->sum, us);
+}
+
+// Counters with a single writer need no locked instructions
+static inline void
+own_counter_add(pg_atomic_uint64 *counter, uint64 n) {
+    pg_atomic_write_u64(counter, pg_atomic_read_u64(counter) + n);
+}
+
+static void
+worker_detach(int code, Datum arg) {
+    LWLockAcquire(stats_shared->lock, LW_EXCLUSIVE);
+    my_stats->pid = 0;
+    LWLockRelease(stats_shared->lock);
+    my_stats = NULL;
+}
+
+void
+rst_stat_worker_attach(int worker_id) {
+    if (!stats_shared)
+        return;
+    LWLockAcquire(stats_shared->lock, LW_EXCLUSIVE);
+    for (int i = 0; i < stats_shared->num_workers; i++) {
+        WorkerStats *w = &stats_shared->workers[i];
+        if (w->pid == 0) {
+            init_worker_stats(w);
+            w->pid = MyProcPid;
+            w->worker_id = worker_id;
+            w->started_at = GetCurrentTimestamp();
+            my_stats = w;
+            break;
+        }
+    }
+    LWLockRelease(stats_shared->lock);
+    if (my_stats)
+        before_shmem_exit(worker_detach, 0);
+}
+
+void
+rst_stat_worker_busy(bool busy) {
+    if (my_stats)
+        pg_atomic_write_u32(&my_stats->busy, busy ? 1 : 0);
+}
+
+void
+rst_stat_worker_io(uint64 bytes_in, uint64 bytes_out) {
+    if (!my_stats)
+        return;
+    if (bytes_in) {
+        own_counter_add(&my_stats->bytes_in, bytes_in);
+        pg_atomic_fetch_add_u64(&stats_shared->http.bytes_in, bytes_in);
+    }
+    if (bytes_out) {
+        own_counter_add(&my_stats->bytes_out, bytes_out);
+        pg_atomic_fetch_add_u64(&stats_shared->http.bytes_out, bytes_out);
+    }
+}
+
+void
+rst_stat_request_phase(int histogram, uint64 us) {
+    if (!my_stats)
+        return;
+    Assert(histogram <= HIST_COMMIT);
+    own_counter_add(&my_stats->time_us[histogram], us);
+    hist_record(histogram, us);
+}
+
+void
+rst_stat_request_done(uint64 us, bool error) {
+    if (!my_stats)
+        return;
+    rst_stat_request_phase(HIST_REQUEST, us);
+    own_counter_add(&my_stats->requests, 1);
+    pg_atomic_fetch_add_u64(&stats_shared->http.requests, 1);
+    if (error) {
+        own_counter_add(&my_stats->errors, 1);
+        pg_atomic_fetch_add_u64(&stats_shared->http.errors, 1);
+    }
+}
+
+void
+rst_stat_request_trace(const RequestTrace *trace) {
+    if (!trace_ring)
+        return;
+    uint64 n = pg_atomic_fetch_add_u64(&trace_ring->next, 1);
+    TraceSlot *slot = &trace_ring->slots[n % trace_ring->size];
+    pg_atomic_fetch_add_u32(&slot->seq, 1);
+    pg_write_barrier();
+    slot->trace = *trace;
+    pg_write_barrier();
+    pg_atomic_fetch_add_u32(&slot->seq, 1);
+}
+
+void
+rst_stat_master_gauges(int workers, int idle_workers, int queue_depth) {
+    if (!stats_shared)
+        return;
+    pg_atomic_write_u32(&stats_shared->http.workers, workers);
+    pg_atomic_write_u32(&stats_shared->http.idle_workers, idle_workers);
+    pg_atomic_write_u32(&stats_shared->http.queue_depth, queue_depth);
+}
+
+void
+rst_stat_master_queued(int queue_depth) {
+    if (!stats_shared)
+        return;
+    pg_atomic_fetch_add_u64(&stats_shared->http.queued, 1);
+    pg_atomic_write_u32(&stats_shared->http.queue_depth, queue_depth);
+    if (pg_atomic_read_u32(&stats_shared->http.max_queue_depth) < queue_depth)
+        pg_atomic_write_u32(&stats_shared->http.max_queue_depth, queue_depth);
+}
+
+void
+rst_stat_master_dispatched(uint64 wait_us) {
+    if (!stats_shared)
+        return;
+    pg_atomic_fetch_add_u64(&stats_shared->http.dispatched, 1);
+    hist_record(HIST_DISPATCH, wait_us);
+}
+
+void
+rst_stat_master_rejected() {
+    if (stats_shared)
+        pg_atomic_fetch_add_u64(&stats_shared->http.rejected, 1);
+}
+
+void
+rst_stat_master_expired() {
+    if (stats_shared)
+        pg_atomic_fetch_add_u64(&stats_shared->http.expired, 1);
+}
+
+static void
+ensure_shared() {
+    if (!stats_shared)
+        ereport(ERROR,
+                errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                errmsg("rustica-engine must be loaded via "
+                       "shared_preload_libraries"));
+}
+
+static inline double
+us_to_ms(uint64 us) {
+    return (double)us / 1000.0;
+}
+
+Datum
+rst_stat_workers(PG_FUNCTION_ARGS) {
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+
+    ensure_shared();
+    InitMaterializedSRF(fcinfo, 0);
+
+    LWLockAcquire(stats_shared->lock, LW_SHARED);
+    for (int i = 0; i < stats_shared->num_workers; i++) {
+        WorkerStats *w = &stats_shared->workers[i];
+        Datum values[STAT_WORKERS_COLS];
+        bool nulls[STAT_WORKERS_COLS] = { 0 };
+
+        if (w->pid == 0)
+            continue;
+        values[0] = Int32GetDatum(w->worker_id);
+        values[1] = Int32GetDatum(w->pid);
+        values[2] = CStringGetTextDatum(
+            pg_atomic_read_u32(&w->busy) ? "busy" : "idle");
+        values[3] = TimestampTzGetDatum(w->started_at);
+        values[4] = Int64GetDatum(pg_atomic_read_u64(&w->requests));
+        values[5] = Int64GetDatum(pg_atomic_read_u64(&w->errors));
+        values[6] = Int64GetDatum(pg_atomic_read_u64(&w->bytes_in));
+        values[7] = Int64GetDatum(pg_atomic_read_u64(&w->bytes_out));
+        for (int h = 0; h <= HIST_COMMIT; h++)
+            values[8 + h] =
+                Float8GetDatum(us_to_ms(pg_atomic_read_u64(&w->time_us[h])));
+        tuplestore_putvalues(rsinfo->setResult,
+                             rsinfo->setDesc,
+                             values,
+                             nulls);
+    }
+    LWLockRelease(stats_shared->lock);
+    return (Datum)0;
+}
+
+Datum
+rst_stat_http(PG_FUNCTION_ARGS) {
+    HttpStats *http;
+    TupleDesc tupdesc;
+    Datum values[STAT_HTTP_COLS];
+    bool nulls[STAT_HTTP_COLS] = { 0 };
+
+    ensure_shared();
+    if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+        ereport(ERROR, errmsg("return type must be a row type"));
+
+    http = &stats_shared->http;
+    values[0] = Int32GetDatum(pg_atomic_read_u32(&http->workers));
+    values[1] = Int32GetDatum(pg_atomic_read_u32(&http->idle_workers));
+    values[2] = Int32GetDatum(pg_atomic_read_u32(&http->queue_depth));
+    values[3] = Int32GetDatum(pg_atomic_read_u32(&http->max_queue_depth));
+    values[4] = Int64GetDatum(pg_atomic_read_u64(&http->queued));
+    values[5] = Int64GetDatum(pg_atomic_read_u64(&http->dispatched));
+    values[6] = Int64GetDatum(pg_atomic_read_u64(&http->rejected));
+    values[7] = Int64GetDatum(pg_atomic_read_u64(&http->expired));
+    values[8] = Int64GetDatum(pg_atomic_read_u64(&http->requests));
+    values[9] = Int64GetDatum(pg_atomic_read_u64(&http->errors));
+    values[10] = Int64GetDatum(pg_atomic_read_u64(&http->bytes_in));
+    values[11] = Int64GetDatum(pg_atomic_read_u64(&http->bytes_out));
+    PG_RETURN_DATUM(
+        HeapTupleGetDatum(heap_form_tuple(BlessTupleDesc(tupdesc),
+                                          values,
+                                          nulls)));
+}
+
+Datum
+rst_stat_http_latency(PG_FUNCTION_ARGS) {
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+
+    ensure_shared();
+    InitMaterializedSRF(fcinfo, 0);
+
+    // Only the non-empty buckets, bounds in milliseconds
+    for (int h = 0; h < NUM_HISTOGRAMS; h++) {
+        Histogram *hist = &stats_shared->http.histograms[h];
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            Datum values[STAT_HTTP_LATENCY_COLS];
+            bool nulls[STAT_HTTP_LATENCY_COLS] = { 0 };
+            uint64 count = pg_atomic_read_u64(&hist->buckets[b]);
+
+            if (count == 0)
+                continue;
+            values[0] = CStringGetTextDatum(histogram_names[h]);
+            values[1] = Float8GetDatum(us_to_ms(hist_lower_bound(b)));
+            values[2] = Float8GetDatum(
+                us_to_ms(hist_lower_bound(b) + hist_width(b)));
+            values[3] = Int64GetDatum(count);
+            tuplestore_putvalues(rsinfo->setResult,
+                                 rsinfo->setDesc,
+                                 values,
+                                 nulls);
+        }
+    }
+    return (Datum)0;
+}
+
+static bool
+read_trace(TraceSlot *slot, RequestTrace *trace) {
+    for (int retry = 0; retry < 3; retry++) {
+        uint32 seq = pg_atomic_read_u32(&slot->seq);
+        if (seq & 1)
+            continue;
+        pg_read_barrier();
+        *trace = slot->trace;
+        pg_read_barrier();
+        if (pg_atomic_read_u32(&slot->seq) == seq)
+            return trace->finished_at != 0;
+    }
+    return false;
+}
+
+Datum
+rst_stat_requests(PG_FUNCTION_ARGS) {
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *)fcinfo->resultinfo;
+    RequestTrace trace;
+
+    ensure_shared();
+    InitMaterializedSRF(fcinfo, 0);
+    if (!trace_ring)
+        return (Datum)0;
+
+    // Oldest first; entries being written are skipped
+    uint64 next = pg_atomic_read_u64(&trace_ring->next);
+    uint64 start = next > trace_ring->size ? next - trace_ring->size : 0;
+    for (uint64 n = start; n < next; n++) {
+        Datum values[STAT_REQUESTS_COLS];
+        bool nulls[STAT_REQUESTS_COLS] = { 0 };
+
+        if (!read_trace(&trace_ring->slots[n % trace_ring->size], &trace))
+            continue;
+        values[0] = TimestampTzGetDatum(trace.finished_at);
+        values[1] = Int32GetDatum(trace.worker_id);
+        values[2] = BoolGetDatum(trace.error);
+        values[3] = BoolGetDatum(trace.keep_alive);
+        values[4] = BoolGetDatum(trace.spawned_worker);
+        values[5] = Float8GetDatum(us_to_ms(trace.queue_us));
+        values[6] = Float8GetDatum(us_to_ms(trace.handoff_us));
+        values[7] = Float8GetDatum(us_to_ms(trace.load_us));
+        values[8] = Float8GetDatum(us_to_ms(trace.instantiate_us));
+        values[9] = Float8GetDatum(us_to_ms(trace.handler_us));
+        values[10] = Float8GetDatum(us_to_ms(trace.commit_us));
+        values[11] = Float8GetDatum(us_to_ms(trace.total_us));
+        tuplestore_putvalues(rsinfo->setResult,
+                             rsinfo->setDesc,
+                             values,
+                             nulls);
+    }
+    return (Datum)0;
+}
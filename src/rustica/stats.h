@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2024-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              https://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#ifndef RUSTICA_STATS_H
+#define RUSTICA_STATS_H
+
+#include "postgres.h"
+#include "fmgr.h"
+#include "portability/instr_time.h"
+
+#include "rustica/query.h"
+
+// Latency histograms
+#define HIST_REQUEST 0     // a whole request in a worker
+#define HIST_INSTANTIATE 1 // taking a module instance
+#define HIST_HANDLER 2     // running the guest
+#define HIST_COMMIT 3      // ending the transaction
+#define HIST_DISPATCH 4    // waiting in the master's job queue
+#define NUM_HISTOGRAMS 5
+
+// Phases of a request in microseconds, see rustica.stat_requests()
+typedef struct RequestTrace {
+    TimestampTz finished_at;
+    int32 worker_id;
+    bool error;
+    bool keep_alive;     // a later request on a kept-alive connection
+    bool spawned_worker; // the job waited for a new worker to start
+    int64 queue_us;      // from accept to dispatch, in the master
+    int64 handoff_us;    // from dispatch to the worker taking it
+    int64 load_us;       // preparing the module, if not loaded yet
+    int64 instantiate_us;
+    int64 handler_us;
+    int64 commit_us;
+    int64 total_us; // from accept, or from the start of a keep-alive request
+} RequestTrace;
+
+typedef struct StatTimer {
+    instr_time start;
+    int64 generic_plans;
+    int64 custom_plans;
+} StatTimer;
+
+void
+rst_init_stats();
+
+QueryStats *
+rst_stat_query_entry(const char *module, int32 index);
+
+void
+rst_stat_query_begin(QueryPlan *plan, StatTimer *timer);
+
+void
+rst_stat_query_end(QueryPlan *plan, StatTimer *timer, uint64 rows, bool call);
+
+void
+rst_stat_worker_attach(int worker_id);
+
+void
+rst_stat_worker_busy(bool busy);
+
+void
+rst_stat_worker_io(uint64 bytes_in, uint64 bytes_out);
+
+void
+rst_stat_request_phase(int histogram, uint64 us);
+
+void
+rst_stat_request_done(uint64 us, bool error);
+
+void
+rst_stat_request_trace(const RequestTrace *trace);
+
+void
+rst_stat_master_gauges(int workers, int idle_workers, int queue_depth);
+
+void
+rst_stat_master_queued(int queue_depth);
+
+void
+rst_stat_master_dispatched(uint64 wait_us);
+
+void
+rst_stat_master_rejected();
+
+void
+rst_stat_master_expired();
+
+Datum
+rst_stat_queries(PG_FUNCTION_ARGS);
+
+Datum
+rst_stat_queries_reset(PG_FUNCTION_ARGS);
+
+Datum
+rst_stat_workers(PG_FUNCTION_ARGS);
+
+Datum
+rst_stat_http(PG_FUNCTION_ARGS);
+
+Datum
+rst_stat_http_latency(PG_FUNCTION_ARGS);
+
+Datum
+rst_stat_requests(PG_FUNCTION_ARGS);
+
+#endif /* RUSTICA_STATS_H */
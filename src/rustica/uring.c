@@ -0,0 +1,327 @@
+/*
+ * Copyright (c) 2024-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              https://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#ifdef RUSTICA_IO_URING
+#include <liburing.h>
+#endif
+
+#include "postgres.h"
+#include "miscadmin.h"
+#include "storage/latch.h"
+#include "utils/timestamp.h"
+
+#include "rustica/uring.h"
+#include "rustica/utils.h"
+
+#ifdef RUSTICA_IO_URING
+
+#define TAG_IO 1
+#define TAG_CANCEL 2
+#define TAG_ACCEPT 16 // plus the index of the listen socket
+
+static struct io_uring ring;
+static bool ring_ready = false;
+static pgsocket accept_fds[MAXLISTEN];
+static int num_accept_fds = 0;
+static bool accepting = false;
+
+bool
+rst_uring_init(unsigned entries) {
+    struct io_uring_params params;
+    int rv;
+
+    // The ring is only ever used by the process' own thread
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    rv = io_uring_queue_init_params(entries, &ring, &params);
+    if (rv == -EINVAL) {
+        // Older kernels don't know about the flags above
+        memset(&params, 0, sizeof(params));
+        rv = io_uring_queue_init_params(entries, &ring, &params);
+    }
+    if (rv < 0) {
+        errno = -rv;
+        ereport(LOG,
+                errmsg("could not set up io_uring, falling back to epoll: %m"));
+        return false;
+    }
+    ring_ready = true;
+    return true;
+}
+
+void
+rst_uring_fini() {
+    if (!ring_ready)
+        return;
+    io_uring_queue_exit(&ring);
+    ring_ready = false;
+    accepting = false;
+    num_accept_fds = 0;
+}
+
+pgsocket
+rst_uring_fd() {
+    return ring.ring_fd;
+}
+
+static struct io_uring_sqe *
+get_sqe() {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+    if (sqe == NULL) {
+        // Submission queue is full, flush it and try again
+        io_uring_submit(&ring);
+        sqe = io_uring_get_sqe(&ring);
+        if (sqe == NULL)
+            ereport(ERROR, errmsg("io_uring submission queue is full"));
+    }
+    return sqe;
+}
+
+static ssize_t
+complete_io(long timeout) {
+    struct io_uring_cqe *cqe;
+    struct io_uring_sqe *sqe;
+    struct __kernel_timespec ts;
+    TimestampTz deadline = 0;
+    int cancelled = 0;
+    long remaining;
+    uint64 data;
+    int32 res;
+    int rv;
+
+    if (timeout >= 0)
+        deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(), timeout);
+
+    // Submit and wait in a single io_uring_enter(), waking up regularly to
+    // check the latch like WaitEventSetWait() would.
+    for (;;) {
+        remaining = 1000;
+        if (deadline != 0 && !cancelled)
+            remaining = Min(remaining,
+                            TimestampDifferenceMilliseconds(
+                                GetCurrentTimestamp(),
+                                deadline));
+        ts.tv_sec = remaining / 1000;
+        ts.tv_nsec = (remaining % 1000) * 1000000;
+        cqe = NULL;
+        rv = io_uring_submit_and_wait_timeout(&ring, &cqe, 1, &ts, NULL);
+        if (rv < 0 && rv != -ETIME && rv != -EINTR) {
+            errno = -rv;
+            ereport(ERROR, errmsg("could not wait for io_uring: %m"));
+        }
+        if (cqe != NULL) {
+            data = io_uring_cqe_get_data64(cqe);
+            res = cqe->res;
+            io_uring_cqe_seen(&ring, cqe);
+            if (data != TAG_IO)
+                continue;
+            if (res == -ECANCELED && cancelled)
+                res = -cancelled;
+            if (res < 0) {
+                errno = -res;
+                return -1;
+            }
+            return res;
+        }
+        if (cancelled)
+            continue;
+        if (MyLatch->is_set)
+            cancelled = EINTR;
+        else if (deadline != 0 && GetCurrentTimestamp() >= deadline)
+            cancelled = ETIMEDOUT;
+        if (cancelled) {
+            // The buffer belongs to the guest, so the request must be
+            // finished before returning; the cancellation is reaped later.
+            sqe = get_sqe();
+            io_uring_prep_cancel64(sqe, TAG_IO, 0);
+            io_uring_sqe_set_data64(sqe, TAG_CANCEL);
+        }
+    }
+}
+
+ssize_t
+rst_uring_recv(pgsocket fd, void *buf, size_t len, long timeout) {
+    struct io_uring_sqe *sqe = get_sqe();
+    ssize_t rv;
+
+    io_uring_prep_recv(sqe, fd, buf, len, 0);
+    io_uring_sqe_set_data64(sqe, TAG_IO);
+    rv = complete_io(timeout);
+
+    // Same as WL_SOCKET_CLOSED in the epoll implementation
+    if (rv < 0 && errno == ECONNRESET)
+        return 0;
+    return rv;
+}
+
+ssize_t
+rst_uring_send(pgsocket fd, const void *buf, size_t len, long timeout) {
+    struct io_uring_sqe *sqe = get_sqe();
+    ssize_t rv;
+
+    io_uring_prep_send(sqe, fd, buf, len, MSG_NOSIGNAL);
+    io_uring_sqe_set_data64(sqe, TAG_IO);
+    rv = complete_io(timeout);
+    if (rv < 0 && (errno == EPIPE || errno == ECONNRESET))
+        return 0;
+    return rv;
+}
+
+ssize_t
+rst_uring_sendmsg(pgsocket fd, struct msghdr *msg, int flags, long timeout) {
+    struct io_uring_sqe *sqe = get_sqe();
+    ssize_t rv;
+
+    io_uring_prep_sendmsg(sqe, fd, msg, flags | MSG_NOSIGNAL);
+    io_uring_sqe_set_data64(sqe, TAG_IO);
+    rv = complete_io(timeout);
+    if (rv < 0 && (errno == EPIPE || errno == ECONNRESET))
+        return 0;
+    return rv;
+}
+
+static void
+arm_accept(int idx) {
+    struct io_uring_sqe *sqe = get_sqe();
+    io_uring_prep_multishot_accept(sqe,
+                                   accept_fds[idx],
+                                   NULL,
+                                   NULL,
+                                   SOCK_NONBLOCK | SOCK_CLOEXEC);
+    io_uring_sqe_set_data64(sqe, TAG_ACCEPT + idx);
+}
+
+void
+rst_uring_listen(pgsocket *fds, int nfds) {
+    Assert(nfds <= MAXLISTEN);
+    memcpy(accept_fds, fds, sizeof(pgsocket) * nfds);
+    num_accept_fds = nfds;
+    rst_uring_resume_accept();
+}
+
+void
+rst_uring_pause_accept() {
+    struct io_uring_sqe *sqe;
+
+    if (!accepting)
+        return;
+    accepting = false;
+    for (int i = 0; i < num_accept_fds; i++) {
+        sqe = get_sqe();
+        io_uring_prep_cancel64(sqe, TAG_ACCEPT + i, 0);
+        io_uring_sqe_set_data64(sqe, TAG_CANCEL);
+    }
+    io_uring_submit(&ring);
+}
+
+void
+rst_uring_resume_accept() {
+    if (accepting)
+        return;
+    accepting = true;
+    for (int i = 0; i < num_accept_fds; i++)
+        arm_accept(i);
+    io_uring_submit(&ring);
+}
+
+bool
+rst_uring_reap_accepted(AcceptCallback callback,
+                        AcceptErrorCallback error_callback) {
+    struct io_uring_cqe *cqe;
+    unsigned head, seen = 0;
+    bool supported = true, rearm = false;
+    uint64 data;
+
+    io_uring_for_each_cqe(&ring, head, cqe) {
+        seen++;
+        data = io_uring_cqe_get_data64(cqe);
+        if (data < TAG_ACCEPT)
+            continue;
+        if (cqe->res >= 0)
+            callback(cqe->res);
+        else if (cqe->res == -EINVAL) {
+            // Multishot accept needs Linux 5.19
+            supported = false;
+            continue;
+        }
+        else if (cqe->res != -ECANCELED)
+            error_callback(accept_fds[data - TAG_ACCEPT], -cqe->res);
+
+        // The kernel stops a multishot request on errors or overflows
+        if (!(cqe->flags & IORING_CQE_F_MORE) && accepting) {
+            arm_accept((int)(data - TAG_ACCEPT));
+            rearm = true;
+        }
+    }
+    io_uring_cq_advance(&ring, seen);
+    if (rearm)
+        io_uring_submit(&ring);
+    if (!supported)
+        rst_uring_pause_accept();
+    return supported;
+}
+
+#else
+
+bool
+rst_uring_init(unsigned entries) {
+    ereport(LOG,
+            errmsg("io_uring support is not compiled in, falling back to "
+                   "epoll"));
+    return false;
+}
+
+void
+rst_uring_fini() {}
+
+pgsocket
+rst_uring_fd() {
+    return PGINVALID_SOCKET;
+}
+
+ssize_t
+rst_uring_recv(pgsocket fd, void *buf, size_t len, long timeout) {
+    pg_unreachable();
+}
+
+ssize_t
+rst_uring_send(pgsocket fd, const void *buf, size_t len, long timeout) {
+    pg_unreachable();
+}
+
+ssize_t
+rst_uring_sendmsg(pgsocket fd, struct msghdr *msg, int flags, long timeout) {
+    pg_unreachable();
+}
+
+void
+rst_uring_listen(pgsocket *fds, int nfds) {
+    pg_unreachable();
+}
+
+void
+rst_uring_pause_accept() {}
+
+void
+rst_uring_resume_accept() {}
+
+bool
+rst_uring_reap_accepted(AcceptCallback callback,
+                        AcceptErrorCallback error_callback) {
+    return false;
+}
+
+#endif /* RUSTICA_IO_URING */
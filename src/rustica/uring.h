@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2024-present 燕几（北京）科技有限公司
+ *
+ * Rustica Engine is licensed under Mulan PSL v2. You can use this
+ * software according to the terms and conditions of the Mulan PSL v2.
+ * You may obtain a copy of Mulan PSL v2 at:
+ *
+ *              https://license.coscl.org.cn/MulanPSL2
+ *
+ * THIS SOFTWARE IS PROVIDED ON AN "AS IS" BASIS, WITHOUT WARRANTIES
+ * OF ANY KIND, EITHER EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED
+ * TO NON-INFRINGEMENT, MERCHANTABILITY OR FIT FOR A PARTICULAR PURPOSE.
+ *
+ * See the Mulan PSL v2 for more details.
+ */
+
+#ifndef RUSTICA_URING_H
+#define RUSTICA_URING_H
+
+#include <sys/socket.h>
+
+#include "postgres.h"
+
+#define URING_ENTRIES 64
+
+typedef void (*AcceptCallback)(pgsocket sock);
+typedef void (*AcceptErrorCallback)(pgsocket listen_sock, int err);
+
+bool
+rst_uring_init(unsigned entries);
+
+void
+rst_uring_fini();
+
+pgsocket
+rst_uring_fd();
+
+ssize_t
+rst_uring_recv(pgsocket fd, void *buf, size_t len, long timeout);
+
+ssize_t
+rst_uring_send(pgsocket fd, const void *buf, size_t len, long timeout);
+
+ssize_t
+rst_uring_sendmsg(pgsocket fd, struct msghdr *msg, int flags, long timeout);
+
+void
+rst_uring_listen(pgsocket *fds, int nfds);
+
+void
+rst_uring_pause_accept();
+
+void
+rst_uring_resume_accept();
+
+bool
+rst_uring_reap_accepted(AcceptCallback callback,
+                        AcceptErrorCallback error_callback);
+
+#endif /* RUSTICA_URING_H */
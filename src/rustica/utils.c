@@ -17,6 +17,10 @@
 #include <stdio.h>
 #include <sys/un.h>
 
+#include "postgres.h"
+#include "libpq/libpq.h"
+
+#include "rustica/gucs.h"
 #include "rustica/utils.h"
 
 void
@@ -26,3 +30,50 @@ rst_make_ipc_addr(struct sockaddr_un *addr) {
     addr->sun_path[0] = '\0';
     snprintf(&addr->sun_path[1], sizeof(addr->sun_path) - 1, "rustica-ipc");
 }
+
+void
+rst_set_fd_batch(FDMessage *fd_msg, int njobs) {
+    Assert(njobs > 0 && njobs <= FD_BATCH_MAX);
+    fd_msg->io.iov_len = sizeof(FDPayload) * njobs;
+    fd_msg->msg.msg_controllen = CMSG_SPACE(sizeof(int) * njobs);
+    fd_msg->cmsg->cmsg_level = SOL_SOCKET;
+    fd_msg->cmsg->cmsg_type = SCM_RIGHTS;
+    fd_msg->cmsg->cmsg_len = CMSG_LEN(sizeof(int) * njobs);
+}
+
+void
+rst_shed_connection(int sock) {
+    static char response[128];
+    static int response_len = 0;
+    static int response_retry_after = -1;
+    char buf[4096];
+
+    // Composed again only when rustica.retry_after has changed
+    if (response_retry_after != rst_retry_after) {
+        response_retry_after = rst_retry_after;
+        if (rst_retry_after > 0)
+            response_len = snprintf(response,
+                                    sizeof(response),
+                                    "HTTP/1.1 503 Service Unavailable\r\n"
+                                    "Retry-After: %d\r\n"
+                                    "Content-Length: 0\r\n"
+                                    "Connection: close\r\n\r\n",
+                                    rst_retry_after);
+        else
+            response_len = snprintf(response,
+                                    sizeof(response),
+                                    "HTTP/1.1 503 Service Unavailable\r\n"
+                                    "Content-Length: 0\r\n"
+                                    "Connection: close\r\n\r\n");
+    }
+
+    // Best effort without blocking: read some of what the client has sent,
+    // so that closing doesn't reset the connection before the response is
+    // read.
+    for (int i = 0; i < 16; i++)
+        if (recv(sock, buf, sizeof(buf), MSG_DONTWAIT) <= 0)
+            break;
+    if (send(sock, response, response_len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0)
+        ereport(DEBUG1, (errmsg("could not send 503 to fd=%d: %m", sock)));
+    StreamClose(sock);
+}
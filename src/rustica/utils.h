@@ -17,9 +17,17 @@
 #ifndef RUSTICA_UTILS_H
 #define RUSTICA_UTILS_H
 
+#include <stdint.h>
 #include <sys/socket.h>
+#include <time.h>
 
 #define BACKEND_HELLO "RUSTICA!"
+#define BACKEND_HANDBACK "RUSTICA#"
+// Hello and hand-back messages of workers: the 8-byte prefix, the worker id,
+// the bitmap of routed modules the worker has loaded and how many jobs it
+// takes at once
+#define BACKEND_MSG_SIZE 24
+#define MAXLISTEN 64
 
 #define ERROR_BUF error_buf
 #define ERROR_BUF_PARAMS ERROR_BUF, ERROR_BUF##_size
@@ -27,15 +35,41 @@
     char ERROR_BUF[size];       \
     uint32 ERROR_BUF##_size = size;
 
+#define FD_SPAWNED_WORKER 1 // the job waited for a new worker to start
+#define FD_BATCH_MAX 16      // jobs passed in one message at most
+
+// Sent by the master along with a job fd, in monotonic microseconds
+typedef struct FDPayload {
+    int64_t accepted_at;
+    int64_t dispatched_at;
+    int32_t flags;
+} FDPayload;
+
+// Jobs passed to a worker in one message, as many fds in one SCM_RIGHTS
+// control message as payloads in the data
 typedef struct FDMessage {
     struct msghdr msg;
     struct cmsghdr *cmsg;
-    char buf[CMSG_SPACE(sizeof(int))];
+    char buf[CMSG_SPACE(sizeof(int) * FD_BATCH_MAX)];
     struct iovec io;
-    char byte;
+    FDPayload payload[FD_BATCH_MAX];
 } FDMessage;
 
+// Comparable across processes of the same host, unlike instr_time
+static inline int64_t
+rst_monotonic_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 void
 rst_make_ipc_addr(struct sockaddr_un *addr);
 
+void
+rst_set_fd_batch(FDMessage *fd_msg, int njobs);
+
+void
+rst_shed_connection(int sock);
+
 #endif /* RUSTICA_UTILS_H */
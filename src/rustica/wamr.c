@@ -16,11 +16,15 @@
 
 #include "postgres.h"
 #include "catalog/pg_type_d.h"
+#include "utils/memutils.h"
 
 #include "wasm_runtime_common.h"
 #include "wasm_c_api.h"
 #include "aot_runtime.h"
+#include "ems/ems_gc.h"
 
+#include "rustica/body.h"
+#include "rustica/copy.h"
 #include "rustica/datatypes.h"
 #include "rustica/query.h"
 #include "rustica/wamr.h"
@@ -30,6 +34,16 @@ native_noop(wasm_exec_env_t exec_env) {}
 
 TidOid *tid_map = NULL;
 int tid_map_len = 0;
+MemoryContext WamrMemoryContext = NULL;
+
+static void *
+wamr_malloc(unsigned int size) {
+    // Fall back to the current context when no dedicated one is configured,
+    // so that WAMR memory is released together with the transaction.
+    if (WamrMemoryContext)
+        return MemoryContextAlloc(WamrMemoryContext, size);
+    return palloc(size);
+}
 
 int32_t
 env_tid_to_oid(wasm_exec_env_t exec_env, wasm_obj_t obj) {
@@ -77,6 +91,18 @@ NativeSymbol rst_noop_native_env[] = {
     { "llhttp_get_method", native_noop, "()i" },
     { "llhttp_get_http_major", native_noop, "()i" },
     { "llhttp_get_http_minor", native_noop, "()i" },
+    { "header_count", native_noop, "(r)i" },
+    { "header_name", native_noop, "(ri)r" },
+    { "header_value", native_noop, "(ri)r" },
+    { "header_get", native_noop, "(rr)r" },
+    { "output_bytes", native_noop, "(rii)i" },
+    { "output_text", native_noop, "(r)i" },
+    { "output_sb", native_noop, "(r)i" },
+    { "flush", native_noop, "(i)i" },
+    { "send_bytea", native_noop, "(rII)I" },
+    { "send_large_object", native_noop, "(iII)I" },
+    { "large_object_size", native_noop, "(i)I" },
+    { "cursor_stream", native_noop, "(rri)I" },
     { "execute_statement", native_noop, "(i)i" },
     { "ereport", env_ereport, "(ir)i" },
     { "tid_to_oid", env_tid_to_oid, "(r)i" },
@@ -90,7 +116,7 @@ rst_init_wamr() {
     // Initialize WAMR runtime with native stubs
     RuntimeInitArgs init_args = { .mem_alloc_type = Alloc_With_Allocator,
                                   .mem_alloc_option = {
-                                      .allocator.malloc_func = palloc,
+                                      .allocator.malloc_func = wamr_malloc,
                                       .allocator.realloc_func = repalloc,
                                       .allocator.free_func = pfree,
                                   },
@@ -99,10 +125,13 @@ rst_init_wamr() {
         ereport(FATAL, (errmsg("cannot register WASM natives")));
     REGISTER_WASM_NATIVES("env", rst_noop_native_env);
     rst_register_natives_query();
+    rst_register_natives_body();
     rst_register_natives_bytea();
+    rst_register_natives_copy();
     rst_register_natives_date();
     rst_register_natives_jsonb();
     rst_register_natives_json();
+    rst_register_natives_json_schema();
     rst_register_natives_primitives();
     rst_register_natives_stringbuilder();
     rst_register_natives_text();
@@ -260,3 +289,11 @@ wasm_runtime_remove_local_obj_ref(wasm_exec_env_t exec_env,
         next->prev = me->prev;
     }
 }
+
+void
+wasm_runtime_gc_collect(wasm_module_inst_t instance) {
+    AOTModuleInstanceExtra *extra =
+        (AOTModuleInstanceExtra *)((AOTModuleInstance *)instance)->e;
+    if (extra->common.gc_heap_handle)
+        gci_gc_heap(extra->common.gc_heap_handle);
+}
@@ -32,6 +32,9 @@ extern int tid_map_len;
 
 extern NativeSymbol rst_noop_native_env[];
 
+// Memory context for WAMR runtime allocations; NULL means the current one
+extern MemoryContext WamrMemoryContext;
+
 typedef struct CommonHeapTypes {
     int32_t bytes;
 } CommonHeapTypes;
@@ -68,6 +71,9 @@ void
 wasm_runtime_remove_local_obj_ref(wasm_exec_env_t exec_env,
                                   wasm_local_obj_ref_t *me);
 
+void
+wasm_runtime_gc_collect(wasm_module_inst_t instance);
+
 int32_t
 env_ereport(wasm_exec_env_t exec_env, int32_t level, wasm_obj_t ref);
 
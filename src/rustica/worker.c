@@ -18,13 +18,21 @@
 
 #include "postgres.h"
 #include "miscadmin.h"
+#include "access/detoast.h"
 #include "postmaster/bgworker.h"
 #include "libpq/libpq.h"
 #include "libpq/pqformat.h"
 #include "access/xact.h"
 #include "commands/async.h"
+#include "common/ip.h"
+#include "common/pg_prng.h"
+#include "storage/large_object.h"
 #include "tcop/utility.h"
+#include "utils/acl.h"
+#include "utils/memutils.h"
 #include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+#include "utils/varlena.h"
 #ifdef RUSTICA_SQL_BACKDOOR
 #include "utils/builtins.h"
 #include "utils/jsonb.h"
@@ -33,10 +41,17 @@
 
 #include "llhttp.h"
 
+#include "rustica/body.h"
+#include "rustica/copy.h"
 #include "rustica/datatypes.h"
+#include "rustica/export.h"
 #include "rustica/gucs.h"
 #include "rustica/module.h"
+#include "rustica/output.h"
 #include "rustica/query.h"
+#include "rustica/routes.h"
+#include "rustica/stats.h"
+#include "rustica/uring.h"
 #include "rustica/utils.h"
 #include "rustica/wamr.h"
 
@@ -44,36 +59,227 @@
 #define WAIT_READ 0
 static int worker_id;
 static pgsocket sock;
-static char hello[12];
+static char hello[BACKEND_MSG_SIZE];
 static WaitEventSet *wait_set = NULL;
 static bool shutdown_requested = false;
 static char state = WAIT_WRITE;
 static int sent = 0;
 static FDMessage fd_msg;
+static pgsocket listen_sockets[MAXLISTEN];
+static int num_listen_sockets = 0;
+static bool use_uring = false;
+static uint32 client_wait_events = 0;
+static OutputBuffer output;
+
+// Bytes received after the end of the current HTTP message on a keep-alive
+// connection, served to the next request before reading the socket again
+static StringInfoData carry;
+// Bytes put back into the carry after the current message, which go before
+// whatever is still unread there
+static int carry_put_back = 0;
+
+#define STREAM_CHUNK_SIZE (64 * 1024)
+#define STREAM_EXPAND_WARN_SIZE (64 * 1024 * 1024)
+#define NEXT_REQUEST 0
+#define CONNECTION_IDLE 1
+#define CONNECTION_CLOSED 2
+
+// Header table of the current request, filled natively by llhttp callbacks
+// when the guest opts in with a one-argument on_headers_complete(). Names are
+// stored lower-cased in header_data, together with the values.
+#define MAX_HEADERS 128
+
+typedef struct HeaderEntry {
+    uint32 hash;
+    int32 name_off;
+    int32 name_len;
+    int32 value_off;
+    int32 value_len;
+} HeaderEntry;
+
+static StringInfoData header_data;
+static HeaderEntry headers[MAX_HEADERS];
+static int num_headers = 0;
+static bool header_started = false;
+static uint32 header_generation = 0;
+static bool routes_invalidated = false;
+
+// The response is parsed as it goes out, so that the connection is only kept
+// alive if the client can tell where the response ends without an EOF
+static llhttp_t response_parser;
+static llhttp_settings_t response_settings;
+static bool response_complete = false;
+
+static void
+arm_client_wait(WaitEventSet *set, uint32 events) {
+    // Only re-arm when the direction changes, saving an epoll_ctl() per call
+    if (client_wait_events != events) {
+        ModifyWaitEvent(set, 1, events, NULL);
+        client_wait_events = events;
+    }
+}
+
+static long
+time_left(TimestampTz deadline) {
+    if (deadline == 0)
+        return -1;
+    return TimestampDifferenceMilliseconds(GetCurrentTimestamp(), deadline);
+}
+
+static int
+wait_client(Context *ctx,
+            uint32 events,
+            TimestampTz deadline,
+            uint32 wait_event_info) {
+    WaitEvent occurred[1];
+    long timeout = time_left(deadline);
+
+    if (timeout == 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    arm_client_wait(ctx->wait_set, events);
+    if (WaitEventSetWait(ctx->wait_set,
+                         timeout,
+                         occurred,
+                         1,
+                         wait_event_info)
+        == 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if (occurred[0].events & WL_LATCH_SET) {
+        errno = EINTR;
+        return -1;
+    }
+    return 1;
+}
 
 static int32_t
 env_recv(wasm_exec_env_t exec_env,
          wasm_obj_t refobj,
          int32_t start,
          int32_t len) {
-    WaitEvent events[1];
     Context *ctx = wasm_runtime_get_user_data(exec_env);
     Datum bytes = wasm_externref_obj_get_datum(refobj, BYTEAOID);
     char *view = VARDATA_ANY(DatumGetPointer(bytes));
-    ModifyWaitEvent(ctx->wait_set,
-                    1,
-                    WL_SOCKET_READABLE | WL_SOCKET_CLOSED,
-                    NULL);
-    WaitEventSetWait(ctx->wait_set, -1, events, 1, WAIT_EVENT_CLIENT_READ);
-    if (events[0].events & WL_LATCH_SET) {
-        return -1;
+    ssize_t rv;
+
+    if (carry.cursor < carry.len) {
+        int32_t size = Min(len, carry.len - carry.cursor);
+        memcpy(view + start, carry.data + carry.cursor, size);
+        carry.cursor += size;
+        carry_put_back = Max(0, carry_put_back - size);
+        if (carry.cursor == carry.len)
+            resetStringInfo(&carry);
+        return size;
     }
-    else if (events[0].events & WL_SOCKET_CLOSED) {
-        return 0;
+    if (use_uring) {
+        rv = rst_uring_recv(ctx->fd,
+                            view + start,
+                            len,
+                            time_left(ctx->recv_deadline));
+        if (rv > 0)
+            rst_stat_worker_io(rv, 0);
+        return rv;
     }
-    else {
-        return recv(ctx->fd, view + start, len, 0);
+
+    // The socket is non-blocking, only wait when there's nothing to read yet
+    for (;;) {
+        rv = recv(ctx->fd, view + start, len, 0);
+        if (rv >= 0) {
+            rst_stat_worker_io(rv, 0);
+            return rv;
+        }
+        if (errno == ECONNRESET)
+            return 0;
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            return -1;
+        if (wait_client(ctx,
+                        WL_SOCKET_READABLE | WL_SOCKET_CLOSED,
+                        ctx->recv_deadline,
+                        WAIT_EVENT_CLIENT_READ)
+            < 0)
+            return -1;
+    }
+}
+
+static int
+on_response_begin(llhttp_t *parser) {
+    response_complete = false;
+    return HPE_OK;
+}
+
+static int
+on_response_headers_complete(llhttp_t *parser) {
+    // Responses to HEAD have no body, whatever their headers say
+    Context *ctx = parser->data;
+    return ctx->http_parser.method == HTTP_HEAD ? 1 : HPE_OK;
+}
+
+static int
+on_response_complete(llhttp_t *parser) {
+    response_complete = llhttp_should_keep_alive(parser);
+    return HPE_OK;
+}
+
+static inline void
+track_response(const char *data, size_t len) {
+    if (llhttp_execute(&response_parser, data, len) != HPE_OK)
+        response_complete = false;
+}
+
+static inline void
+start_send_deadline(Context *ctx) {
+    // The response must go out in time since its first byte
+    if (ctx->send_deadline == 0 && rst_send_timeout > 0)
+        ctx->send_deadline =
+            TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+                                        rst_send_timeout);
+}
+
+static int32_t
+flush_output(Context *ctx, bool more) {
+    struct iovec iov[OUTPUT_MAX_CHUNKS];
+    struct msghdr msg;
+    int flags = more ? MSG_MORE : 0;
+    size_t total = output.pending;
+    ssize_t rv;
+    int n = rst_output_iov(&output, iov);
+
+    for (int i = 0; i < n; i++)
+        track_response(iov[i].iov_base, iov[i].iov_len);
+    start_send_deadline(ctx);
+    while (output.pending > 0) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = rst_output_iov(&output, iov);
+        if (use_uring)
+            rv = rst_uring_sendmsg(ctx->fd,
+                                   &msg,
+                                   flags,
+                                   time_left(ctx->send_deadline));
+        else
+            rv = sendmsg(ctx->fd, &msg, flags | MSG_NOSIGNAL);
+        if (rv > 0) {
+            rst_output_consume(&output, rv);
+            rst_stat_worker_io(0, rv);
+            continue;
+        }
+        if (rv < 0 && !use_uring
+            && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            && wait_client(ctx,
+                           WL_SOCKET_WRITEABLE | WL_SOCKET_CLOSED,
+                           ctx->send_deadline,
+                           WAIT_EVENT_CLIENT_WRITE)
+                   > 0)
+            continue;
+
+        // The connection is gone or timed out, drop the rest of the output
+        rst_output_reset(&output);
+        return (rv == 0 || errno == EPIPE || errno == ECONNRESET) ? 0 : -1;
     }
+    return (int32_t)total;
 }
 
 static int32_t
@@ -81,24 +287,390 @@ env_send(wasm_exec_env_t exec_env,
          wasm_obj_t refobj,
          int32_t start,
          int32_t len) {
-    WaitEvent events[1];
     Context *ctx = wasm_runtime_get_user_data(exec_env);
     Datum bytes = wasm_externref_obj_get_datum(refobj, BYTEAOID);
     char *view = VARDATA_ANY(DatumGetPointer(bytes));
-    ModifyWaitEvent(ctx->wait_set,
-                    1,
-                    WL_SOCKET_WRITEABLE | WL_SOCKET_CLOSED,
-                    NULL);
-    WaitEventSetWait(ctx->wait_set, -1, events, 1, WAIT_EVENT_CLIENT_WRITE);
-    if (events[0].events & WL_LATCH_SET) {
+    ssize_t rv;
+
+    // Keep the order with anything buffered before
+    if (output.pending > 0 && flush_output(ctx, true) <= 0)
         return -1;
+    start_send_deadline(ctx);
+    if (use_uring) {
+        rv = rst_uring_send(ctx->fd,
+                            view + start,
+                            len,
+                            time_left(ctx->send_deadline));
+        if (rv > 0) {
+            track_response(view + start, rv);
+            rst_stat_worker_io(0, rv);
+        }
+        return rv;
     }
-    else if (events[0].events & WL_SOCKET_CLOSED) {
-        return 0;
+
+    for (;;) {
+        rv = send(ctx->fd, view + start, len, MSG_NOSIGNAL);
+        if (rv >= 0) {
+            track_response(view + start, rv);
+            rst_stat_worker_io(0, rv);
+            return rv;
+        }
+        if (errno == EPIPE || errno == ECONNRESET)
+            return 0;
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            return -1;
+        if (wait_client(ctx,
+                        WL_SOCKET_WRITEABLE | WL_SOCKET_CLOSED,
+                        ctx->send_deadline,
+                        WAIT_EVENT_CLIENT_WRITE)
+            < 0)
+            return -1;
     }
-    else {
-        return send(ctx->fd, view + start, len, 0);
+}
+
+static int
+send_all(Context *ctx, const char *data, size_t len, int flags) {
+    struct iovec iov;
+    struct msghdr msg;
+    ssize_t rv;
+
+    track_response(data, len);
+    while (len > 0) {
+        if (use_uring) {
+            iov.iov_base = (char *)data;
+            iov.iov_len = len;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            rv = rst_uring_sendmsg(ctx->fd,
+                                   &msg,
+                                   flags,
+                                   time_left(ctx->send_deadline));
+        }
+        else
+            rv = send(ctx->fd, data, len, flags | MSG_NOSIGNAL);
+        if (rv > 0) {
+            data += rv;
+            len -= rv;
+            rst_stat_worker_io(0, rv);
+            continue;
+        }
+        if (rv < 0 && !use_uring
+            && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            && wait_client(ctx,
+                           WL_SOCKET_WRITEABLE | WL_SOCKET_CLOSED,
+                           ctx->send_deadline,
+                           WAIT_EVENT_CLIENT_WRITE)
+                   > 0)
+            continue;
+        return -1;
     }
+    return 0;
+}
+
+static inline void
+clamp_range(int64 size, int64_t offset, int64_t *length) {
+    if (offset < 0 || offset > size)
+        ereport(ERROR,
+                errmsg("offset " INT64_FORMAT " out of range 0.." INT64_FORMAT,
+                       offset,
+                       size));
+    if (*length < 0 || *length > size - offset)
+        *length = size - offset;
+}
+
+static bool
+begin_stream(Context *ctx) {
+    // Headers buffered so far go first, in the same segment if possible
+    if (output.pending > 0 && flush_output(ctx, true) <= 0)
+        return false;
+    start_send_deadline(ctx);
+    return true;
+}
+
+static int64_t
+env_send_bytea(wasm_exec_env_t exec_env,
+               wasm_obj_t refobj,
+               int64_t offset,
+               int64_t length) {
+    Context *ctx = wasm_runtime_get_user_data(exec_env);
+    struct varlena *attr = (struct varlena *)DatumGetPointer(
+        wasm_externref_obj_get_datum(refobj, BYTEAOID));
+    struct varatt_external toast_pointer;
+    MemoryContext chunk_mctx, old_mctx;
+    struct varlena *slice;
+    int64 sent = 0;
+    int32 n;
+    int rv = 0;
+
+    clamp_range(toast_raw_datum_size(PointerGetDatum(attr)) - VARHDRSZ,
+                offset,
+                &length);
+    if (!begin_stream(ctx))
+        return -1;
+
+    // Compressed values can't be sliced without decompressing from the
+    // start every time, so those are expanded once, though only up to the
+    // end of the range. Values stored out of line uncompressed are fetched
+    // one slice of TOAST chunks at a time.
+    if (VARATT_IS_EXTERNAL_ONDISK(attr))
+        VARATT_EXTERNAL_GET_POINTER(toast_pointer, attr);
+    if (!VARATT_IS_EXTERNAL_ONDISK(attr)
+        || VARATT_EXTERNAL_IS_COMPRESSED(toast_pointer)) {
+        if (VARATT_IS_EXTENDED(attr)) {
+            if (offset + length > STREAM_EXPAND_WARN_SIZE)
+                ereport(WARNING,
+                        errmsg("sending " INT64_FORMAT " bytes of a "
+                               "compressed bytea expands them in memory",
+                               offset + length),
+                        errhint("Store large values with STORAGE EXTERNAL "
+                                "to stream them."));
+            attr = detoast_attr_slice(attr, offset, length);
+            offset = 0;
+        }
+        if (send_all(ctx, VARDATA_ANY(attr) + offset, length, 0) < 0)
+            return -1;
+        return length;
+    }
+
+    chunk_mctx = AllocSetContextCreate(CurrentMemoryContext,
+                                       "rustica stream",
+                                       ALLOCSET_DEFAULT_SIZES);
+    PG_TRY();
+    {
+        while (sent < length) {
+            n = (int32)Min(STREAM_CHUNK_SIZE, length - sent);
+            old_mctx = MemoryContextSwitchTo(chunk_mctx);
+            slice = detoast_attr_slice(attr, offset + sent, n);
+            MemoryContextSwitchTo(old_mctx);
+            rv = send_all(ctx,
+                          VARDATA_ANY(slice),
+                          VARSIZE_ANY_EXHDR(slice),
+                          sent + n < length ? MSG_MORE : 0);
+            MemoryContextReset(chunk_mctx);
+            if (rv < 0)
+                break;
+            sent += n;
+        }
+    }
+    PG_FINALLY();
+    {
+        MemoryContextDelete(chunk_mctx);
+    }
+    PG_END_TRY();
+    return rv < 0 ? -1 : sent;
+}
+
+static LargeObjectDesc *
+open_large_object(Oid lobj_id) {
+    LargeObjectDesc *lobj = inv_open(lobj_id, INV_READ, CurrentMemoryContext);
+    if (!lo_compat_privileges
+        && pg_largeobject_aclcheck_snapshot(lobj->id,
+                                            GetUserId(),
+                                            ACL_SELECT,
+                                            lobj->snapshot)
+               != ACLCHECK_OK) {
+        inv_close(lobj);
+        ereport(ERROR,
+                errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                errmsg("permission denied for large object %u", lobj_id));
+    }
+    return lobj;
+}
+
+static int64_t
+env_large_object_size(wasm_exec_env_t exec_env, int32_t lobj_id) {
+    LargeObjectDesc *lobj = open_large_object((Oid)lobj_id);
+    int64 size = inv_seek(lobj, 0, SEEK_END);
+    inv_close(lobj);
+    return size;
+}
+
+static int64_t
+env_send_large_object(wasm_exec_env_t exec_env,
+                      int32_t lobj_id,
+                      int64_t offset,
+                      int64_t length) {
+    Context *ctx = wasm_runtime_get_user_data(exec_env);
+    LargeObjectDesc *lobj = open_large_object((Oid)lobj_id);
+    char *volatile buf = NULL;
+    int64 sent = 0;
+    int n, rv = 0;
+
+    PG_TRY();
+    {
+        clamp_range(inv_seek(lobj, 0, SEEK_END), offset, &length);
+        if (!begin_stream(ctx))
+            rv = -1;
+        else {
+            // Read through a fixed buffer, whatever the size of the object
+            buf = palloc(STREAM_CHUNK_SIZE);
+            inv_seek(lobj, offset, SEEK_SET);
+            while (sent < length) {
+                n = inv_read(lobj,
+                             buf,
+                             (int)Min(STREAM_CHUNK_SIZE, length - sent));
+                if (n <= 0)
+                    break;
+                rv = send_all(ctx, buf, n, sent + n < length ? MSG_MORE : 0);
+                if (rv < 0)
+                    break;
+                sent += n;
+            }
+        }
+    }
+    PG_FINALLY();
+    {
+        inv_close(lobj);
+        if (buf)
+            pfree(buf);
+    }
+    PG_END_TRY();
+    return rv < 0 ? -1 : sent;
+}
+
+// Room for a zero-padded chunk size line, filled in once the chunk is done
+#define CHUNK_HEADER_SIZE 10
+
+static int
+send_chunk(Context *ctx, StringInfo buf, bool last) {
+    char size[CHUNK_HEADER_SIZE + 1];
+    int start = 0;
+    int len = buf->len - CHUNK_HEADER_SIZE;
+
+    // A zero-sized chunk would end the body, so only send it as the last one
+    if (len > 0) {
+        snprintf(size, sizeof(size), "%08x\r\n", len);
+        memcpy(buf->data, size, CHUNK_HEADER_SIZE);
+        appendStringInfoString(buf, "\r\n");
+    }
+    else
+        start = CHUNK_HEADER_SIZE;
+    if (last)
+        appendStringInfoString(buf, "0\r\n\r\n");
+    return send_all(ctx,
+                    buf->data + start,
+                    buf->len - start,
+                    last ? 0 : MSG_MORE);
+}
+
+static int64_t
+env_cursor_stream(wasm_exec_env_t exec_env,
+                  wasm_obj_t cursor_ref,
+                  wasm_obj_t format_ref,
+                  int32_t chunk_rows) {
+    Context *ctx = wasm_runtime_get_user_data(exec_env);
+    obj_t obj = wasm_externref_obj_get_obj(cursor_ref, OBJ_PORTAL);
+    Portal portal = obj->body.portal;
+    if (!PortalIsValid(portal))
+        ereport(ERROR, errmsg("portal already closed"));
+    if (chunk_rows <= 0)
+        ereport(ERROR, errmsg("cursor_stream: chunk_rows must be positive"));
+    int format = rst_export_format(wasm_text_copy_cstring(format_ref));
+    QueryPlan *plan = ctx->module->queries + obj->query_idx;
+    StatTimer timer;
+    if (!begin_stream(ctx))
+        return -1;
+
+    // The guest sends the response head with "Transfer-Encoding: chunked",
+    // then each fetched batch goes out as one chunk of the body, which ends
+    // here too. Only the batch being sent is kept in memory.
+    MemoryContext mctx = AllocSetContextCreate(CurrentMemoryContext,
+                                               "rustica cursor stream",
+                                               ALLOCSET_DEFAULT_SIZES);
+    int64 rows = 0;
+    int rv = 0;
+    PG_TRY();
+    {
+        MemoryContext old_mctx = MemoryContextSwitchTo(mctx);
+        MemoryContext row_mctx = AllocSetContextCreate(mctx,
+                                                       "rustica cursor row",
+                                                       ALLOCSET_DEFAULT_SIZES);
+        ExportState state;
+        StringInfoData buf;
+        initStringInfo(&buf);
+        appendStringInfoSpaces(&buf, CHUNK_HEADER_SIZE);
+        rst_export_begin(&state, format, portal->tupDesc, &buf);
+        MemoryContextSwitchTo(old_mctx);
+
+        for (;;) {
+            rst_stat_query_begin(plan, &timer);
+            SPI_cursor_fetch(portal, true, chunk_rows);
+            rst_stat_query_end(plan, &timer, SPI_processed, false);
+            SPITupleTable *tuptable = SPI_tuptable;
+            uint64 n = SPI_processed;
+            for (uint64 i = 0; i < n; i++) {
+                old_mctx = MemoryContextSwitchTo(row_mctx);
+                rst_export_row(&state, tuptable->vals[i], &buf);
+                MemoryContextSwitchTo(old_mctx);
+                MemoryContextReset(row_mctx);
+            }
+            SPI_freetuptable(tuptable);
+            if (n == 0)
+                rst_export_end(&state, &buf);
+            rv = send_chunk(ctx, &buf, n == 0);
+            if (rv < 0 || n == 0)
+                break;
+            rows += (int64)n;
+            resetStringInfo(&buf);
+            appendStringInfoSpaces(&buf, CHUNK_HEADER_SIZE);
+        }
+    }
+    PG_FINALLY();
+    {
+        MemoryContextDelete(mctx);
+    }
+    PG_END_TRY();
+    return rv < 0 ? -1 : rows;
+}
+
+static int32_t
+output_append(wasm_exec_env_t exec_env,
+              wasm_obj_t ref,
+              const char *data,
+              int32 len) {
+    // A non-NULL object is pinned and referenced until flushed instead of
+    // being copied, so it must be immutable.
+    rst_output_append(&output, exec_env, ref, data, len);
+    if (rst_output_full(&output)
+        && flush_output(wasm_runtime_get_user_data(exec_env), true) < 0)
+        return -1;
+    return 0;
+}
+
+static int32_t
+env_output_bytes(wasm_exec_env_t exec_env,
+                 wasm_obj_t refobj,
+                 int32_t start,
+                 int32_t len) {
+    Datum bytes = wasm_externref_obj_get_datum(refobj, BYTEAOID);
+    bytea *b = DatumGetByteaPP(bytes);
+    if (start < 0 || len < 0 || start + len > VARSIZE_ANY_EXHDR(b))
+        ereport(ERROR, errmsg("output range out of bounds"));
+    // The guest may recv() into the same bytea before it is flushed
+    return output_append(exec_env, NULL, VARDATA_ANY(b) + start, len);
+}
+
+static int32_t
+env_output_text(wasm_exec_env_t exec_env, wasm_obj_t refobj) {
+    text *t = DatumGetTextPP(wasm_externref_obj_get_datum(refobj, TEXTOID));
+    return output_append(exec_env,
+                         refobj,
+                         VARDATA_ANY(t),
+                         VARSIZE_ANY_EXHDR(t));
+}
+
+static int32_t
+env_output_sb(wasm_exec_env_t exec_env, wasm_obj_t refobj) {
+    obj_t obj = wasm_externref_obj_get_obj(refobj, OBJ_STRING_INFO);
+    StringInfo sb = obj->body.sb;
+    // Appending to the buffer later may move or overwrite its data
+    return output_append(exec_env, NULL, sb->data, sb->len);
+}
+
+static int32_t
+env_flush(wasm_exec_env_t exec_env, int32_t more) {
+    return flush_output(wasm_runtime_get_user_data(exec_env), more != 0);
 }
 
 static void
@@ -124,6 +696,27 @@ maybe_call_on_error(wasm_exec_env_t exec_env, llhttp_errno_t rv) {
     }
 }
 
+// Returns bytes the guest has received but that belong to the next request to
+// the carry, in front of what the guest hasn't received yet
+static void
+put_back_carry(const char *data, int len) {
+    int pos = carry.cursor + carry_put_back;
+
+    // Mostly they have just been taken from the carry, so rewind over them
+    if (carry_put_back == 0 && carry.cursor >= len) {
+        carry.cursor -= len;
+        memmove(carry.data + carry.cursor, data, len);
+    }
+    else {
+        enlargeStringInfo(&carry, len);
+        memmove(carry.data + pos + len, carry.data + pos, carry.len - pos);
+        memcpy(carry.data + pos, data, len);
+        carry.len += len;
+        carry.data[carry.len] = '\0';
+    }
+    carry_put_back += len;
+}
+
 static int32_t
 env_llhttp_execute(wasm_exec_env_t exec_env,
                    wasm_obj_t buf,
@@ -133,9 +726,23 @@ env_llhttp_execute(wasm_exec_env_t exec_env,
     Context *ctx = wasm_runtime_get_user_data(exec_env);
     char *view = VARDATA_ANY(DatumGetPointer(bytes));
     llhttp_errno_t rv;
+
+    // Anything after the end of the message belongs to the next request
+    if (ctx->message_complete) {
+        put_back_carry(view + start, len);
+        return HPE_OK;
+    }
+
     ctx->current_buf = buf;
     rv = llhttp_execute(&ctx->http_parser, view + start, len);
     ctx->current_buf = NULL;
+    if (rv == HPE_PAUSED && ctx->message_complete) {
+        const char *pos = llhttp_get_error_pos(&ctx->http_parser);
+        const char *end = view + start + len;
+        if (pos < end)
+            put_back_carry(pos, (int)(end - pos));
+        return HPE_OK;
+    }
     maybe_call_on_error(exec_env, rv);
     return rv;
 }
@@ -262,6 +869,84 @@ env_sql_backdoor(wasm_exec_env_t exec_env,
 }
 #endif
 
+static inline uint32
+header_hash_step(uint32 hash, char ch) {
+    // FNV-1a over the lower-cased name
+    return (hash ^ (uint8)pg_ascii_tolower((unsigned char)ch)) * 16777619;
+}
+
+// The table is refilled for every request, so a handle is only valid during
+// the request it was delivered for
+static void
+check_headers(wasm_obj_t headers_ref) {
+    obj_t obj = wasm_externref_obj_get_obj(headers_ref, OBJ_HEADERS);
+    if (obj->generation != header_generation)
+        ereport(ERROR, errmsg("headers of a previous request"));
+}
+
+static HeaderEntry *
+header_at(wasm_obj_t headers_ref, int32_t idx) {
+    check_headers(headers_ref);
+    if (idx < 0 || idx >= num_headers)
+        ereport(ERROR, errmsg("header index out of range"));
+    return &headers[idx];
+}
+
+static int32_t
+env_header_count(wasm_exec_env_t exec_env, wasm_obj_t headers_ref) {
+    check_headers(headers_ref);
+    return num_headers;
+}
+
+static wasm_externref_obj_t
+env_header_name(wasm_exec_env_t exec_env,
+                wasm_obj_t headers_ref,
+                int32_t idx) {
+    HeaderEntry *entry = header_at(headers_ref, idx);
+    return cstring_into_varatt_obj(exec_env,
+                                   header_data.data + entry->name_off,
+                                   entry->name_len,
+                                   BYTEAOID);
+}
+
+static wasm_externref_obj_t
+env_header_value(wasm_exec_env_t exec_env,
+                 wasm_obj_t headers_ref,
+                 int32_t idx) {
+    HeaderEntry *entry = header_at(headers_ref, idx);
+    return cstring_into_varatt_obj(exec_env,
+                                   header_data.data + entry->value_off,
+                                   entry->value_len,
+                                   BYTEAOID);
+}
+
+static wasm_externref_obj_t
+env_header_get(wasm_exec_env_t exec_env,
+               wasm_obj_t headers_ref,
+               wasm_obj_t name_ref) {
+    check_headers(headers_ref);
+    bytea *name =
+        DatumGetByteaPP(wasm_externref_obj_get_datum(name_ref, BYTEAOID));
+    const char *data = VARDATA_ANY(name);
+    int32 len = VARSIZE_ANY_EXHDR(name);
+    uint32 hash = 2166136261;
+    for (int32 i = 0; i < len; i++)
+        hash = header_hash_step(hash, data[i]);
+
+    // The first header of the given name wins
+    for (int i = 0; i < num_headers; i++) {
+        HeaderEntry *entry = &headers[i];
+        if (entry->hash == hash && entry->name_len == len
+            && pg_strncasecmp(header_data.data + entry->name_off, data, len)
+                   == 0)
+            return cstring_into_varatt_obj(exec_env,
+                                           header_data.data + entry->value_off,
+                                           entry->value_len,
+                                           BYTEAOID);
+    }
+    return NULL;
+}
+
 static NativeSymbol native_env[] = {
     { "recv", env_recv, "(rii)i" },
     { "send", env_send, "(rii)i" },
@@ -273,6 +958,18 @@ static NativeSymbol native_env[] = {
     { "llhttp_get_method", env_llhttp_get_method, "()i" },
     { "llhttp_get_http_major", env_llhttp_get_http_major, "()i" },
     { "llhttp_get_http_minor", env_llhttp_get_http_minor, "()i" },
+    { "header_count", env_header_count, "(r)i" },
+    { "header_name", env_header_name, "(ri)r" },
+    { "header_value", env_header_value, "(ri)r" },
+    { "header_get", env_header_get, "(rr)r" },
+    { "output_bytes", env_output_bytes, "(rii)i" },
+    { "output_text", env_output_text, "(r)i" },
+    { "output_sb", env_output_sb, "(r)i" },
+    { "flush", env_flush, "(i)i" },
+    { "send_bytea", env_send_bytea, "(rII)I" },
+    { "send_large_object", env_send_large_object, "(iII)I" },
+    { "large_object_size", env_large_object_size, "(i)I" },
+    { "cursor_stream", env_cursor_stream, "(rri)I" },
     { "ereport", env_ereport, "(ir)i" },
 #ifdef RUSTICA_SQL_BACKDOOR
     { "tid_to_oid", env_tid_to_oid, "(r)i" },
@@ -414,6 +1111,81 @@ on_headers_complete(llhttp_t *p) {
     return llhttp_cb_impl(exec_env, ctx->on_headers_complete);
 }
 
+static int
+record_header_field(llhttp_t *p, const char *at, size_t length) {
+    if (!header_started) {
+        if (num_headers == MAX_HEADERS)
+            return -1;
+        HeaderEntry *entry = &headers[num_headers];
+        entry->hash = 2166136261;
+        entry->name_off = header_data.len;
+        entry->name_len = 0;
+        entry->value_off = 0;
+        entry->value_len = 0;
+        header_started = true;
+    }
+
+    // Field names may arrive in pieces across reads, hash them as they come
+    HeaderEntry *entry = &headers[num_headers];
+    enlargeStringInfo(&header_data, (int)length);
+    for (size_t i = 0; i < length; i++) {
+        header_data.data[header_data.len++] =
+            (char)pg_ascii_tolower((unsigned char)at[i]);
+        entry->hash = header_hash_step(entry->hash, at[i]);
+    }
+    entry->name_len += (int32)length;
+    return HPE_OK;
+}
+
+static int
+record_header_field_complete(llhttp_t *p) {
+    headers[num_headers].value_off = header_data.len;
+    return HPE_OK;
+}
+
+static int
+record_header_value(llhttp_t *p, const char *at, size_t length) {
+    appendBinaryStringInfoNT(&header_data, at, (int)length);
+    headers[num_headers].value_len += (int32)length;
+    return HPE_OK;
+}
+
+static int
+record_header_value_complete(llhttp_t *p) {
+    num_headers++;
+    header_started = false;
+    return HPE_OK;
+}
+
+static int
+deliver_headers(llhttp_t *p) {
+    wasm_exec_env_t exec_env = p->data;
+    Context *ctx = wasm_runtime_get_user_data(exec_env);
+    obj_t obj = rst_obj_new(exec_env, OBJ_HEADERS, NULL, 0);
+    obj->generation = header_generation;
+    wasm_val_t results[1];
+    wasm_val_t args[1] = {
+        { .kind = WASM_EXTERNREF,
+          .of.foreign = (uintptr_t)rst_externref_of_obj(exec_env, obj) },
+    };
+    if (!wasm_runtime_call_wasm_a(exec_env,
+                                  ctx->on_headers_complete,
+                                  1,
+                                  results,
+                                  1,
+                                  args))
+        return -1;
+    switch (results[0].of.i32) {
+        case 0:
+            return HPE_OK;
+        case 1:
+            return -1;
+        case 2:
+            return HPE_PAUSED;
+    }
+    return -1;
+}
+
 static int
 on_header_value_complete(llhttp_t *p) {
     wasm_exec_env_t exec_env = p->data;
@@ -425,6 +1197,14 @@ static int
 on_body(llhttp_t *p, const char *at, size_t length) {
     wasm_exec_env_t exec_env = p->data;
     Context *ctx = wasm_runtime_get_user_data(exec_env);
+
+    // A body sink set up by the guest takes the body without a round trip
+    if (rst_body_sink_active()) {
+        rst_body_sink_write(at, length);
+        return HPE_OK;
+    }
+    if (!ctx->on_body)
+        return HPE_OK;
     return llhttp_data_cb_impl(exec_env, ctx->on_body, at, length);
 }
 
@@ -432,7 +1212,16 @@ static int
 on_message_complete(llhttp_t *p) {
     wasm_exec_env_t exec_env = p->data;
     Context *ctx = wasm_runtime_get_user_data(exec_env);
-    return llhttp_cb_impl(exec_env, ctx->on_message_complete);
+    ctx->message_complete = true;
+    if (ctx->on_message_complete) {
+        int rv = llhttp_cb_impl(exec_env, ctx->on_message_complete);
+        if (rv != HPE_OK && rv != HPE_PAUSED)
+            return rv;
+    }
+
+    // Always stop at the end of the message, so that pipelined bytes are
+    // left for the next request on the same connection.
+    return HPE_PAUSED;
 }
 
 static bool
@@ -467,30 +1256,133 @@ wasm_module_completer_callback(wasm_module_t module) {
     PreparedModule *pmod =
         (PreparedModule *)wasm_runtime_get_module_name(module);
     pmod->module = (AOTModule *)module;
-    SPI_freetuptable(pmod->loading_tuptable);
-    pmod->loading_tuptable = NULL;
+    rst_module_release_bin_code(pmod);
     return true;
 }
 
 static void
 wasm_module_destroyer_callback(uint8 *buffer, uint32 size) {}
 
+static void
+bind_reuseport(const char *host) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC,
+                              .ai_socktype = SOCK_STREAM,
+                              .ai_flags = AI_PASSIVE };
+    struct addrinfo *addrs = NULL, *ai;
+    char service[32];
+    int one = 1;
+    int ret;
+
+    snprintf(service, sizeof(service), "%d", rst_port);
+    ret = pg_getaddrinfo_all(host, service, &hints, &addrs);
+    if (ret || !addrs) {
+        ereport(WARNING,
+                (errmsg("rustica-%d: could not translate host name \"%s\", "
+                        "service \"%s\" to address: %s",
+                        worker_id,
+                        host ? host : "*",
+                        service,
+                        gai_strerror(ret))));
+        if (addrs)
+            pg_freeaddrinfo_all(hints.ai_family, addrs);
+        return;
+    }
+
+    for (ai = addrs; ai && num_listen_sockets < MAXLISTEN; ai = ai->ai_next) {
+        pgsocket fd;
+
+        if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6)
+            continue;
+        fd = socket(ai->ai_family, SOCK_STREAM, 0);
+        if (fd == PGINVALID_SOCKET) {
+            ereport(WARNING,
+                    (errmsg("rustica-%d: could not create socket: %m",
+                            worker_id)));
+            continue;
+        }
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0
+            || setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0
+            || (ai->ai_family == AF_INET6
+                && setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one))
+                       < 0)
+            || bind(fd, ai->ai_addr, ai->ai_addrlen) < 0
+            || listen(fd, SOMAXCONN) < 0) {
+            ereport(WARNING,
+                    (errmsg("rustica-%d: could not listen with SO_REUSEPORT: "
+                            "%m",
+                            worker_id)));
+            closesocket(fd);
+            continue;
+        }
+        if (!pg_set_noblock(fd))
+            ereport(WARNING,
+                    (errmsg("rustica-%d: could not set socket to nonblocking "
+                            "mode: %m",
+                            worker_id)));
+        listen_sockets[num_listen_sockets++] = fd;
+    }
+    pg_freeaddrinfo_all(hints.ai_family, addrs);
+}
+
+static void
+listen_reuseport() {
+    char *addr_string;
+    List *list;
+    ListCell *cell;
+
+    addr_string = pstrdup(rst_listen_addresses);
+    if (!SplitGUCList(addr_string, ',', &list))
+        ereport(FATAL,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("invalid list syntax in parameter \"%s\"",
+                        "listen_addresses")));
+    foreach (cell, list) {
+        char *addr = (char *)lfirst(cell);
+        bind_reuseport(strcmp(addr, "*") == 0 ? NULL : addr);
+    }
+    list_free(list);
+    pfree(addr_string);
+    if (num_listen_sockets == 0)
+        ereport(FATAL,
+                (errmsg("rustica-%d: could not create any TCP/IP sockets",
+                        worker_id)));
+}
+
 static void
 startup() {
     struct sockaddr_un addr;
 
     memset(&fd_msg, 0, sizeof(FDMessage));
-    fd_msg.io.iov_base = &fd_msg.byte;
-    fd_msg.io.iov_len = 1;
+    fd_msg.io.iov_base = fd_msg.payload;
+    fd_msg.io.iov_len = sizeof(fd_msg.payload);
     fd_msg.msg.msg_iov = &fd_msg.io;
     fd_msg.msg.msg_iovlen = 1;
     fd_msg.msg.msg_control = fd_msg.buf;
     fd_msg.msg.msg_controllen = sizeof(fd_msg.buf);
     fd_msg.cmsg = CMSG_FIRSTHDR(&fd_msg.msg);
 
-    wait_set = CreateWaitEventSet(CurrentMemoryContext, 2);
+    // Pooled WASM instances outlive jobs, so must the runtime memory they use
+    WamrMemoryContext =
+        AllocSetContextCreate(TopMemoryContext, "WAMR", ALLOCSET_DEFAULT_SIZES);
+
+    if (rst_reuseport)
+        listen_reuseport();
+    if (rst_io_method == IO_METHOD_IO_URING)
+        use_uring = rst_uring_init(URING_ENTRIES);
+    wait_set = CreateWaitEventSet(CurrentMemoryContext, 2 + num_listen_sockets);
     AddWaitEventToSet(wait_set, WL_LATCH_SET, PGINVALID_SOCKET, MyLatch, NULL);
 
+    MemoryContext mctx = MemoryContextSwitchTo(TopMemoryContext);
+    initStringInfo(&carry);
+    initStringInfo(&header_data);
+    rst_output_init(&output);
+    MemoryContextSwitchTo(mctx);
+    llhttp_settings_init(&response_settings);
+    response_settings.on_message_begin = on_response_begin;
+    response_settings.on_headers_complete = on_response_headers_complete;
+    response_settings.on_message_complete = on_response_complete;
+
+    rst_stat_worker_attach(worker_id);
     snprintf(hello, 12, BACKEND_HELLO);
     *((int *)&hello[8]) = worker_id;
 
@@ -504,11 +1396,23 @@ startup() {
         ereport(FATAL,
                 (errmsg("rustica-%d: could not connect Unix socket: %m",
                         worker_id)));
-    AddWaitEventToSet(wait_set,
-                      WL_SOCKET_WRITEABLE | WL_SOCKET_CLOSED,
-                      sock,
-                      NULL,
-                      NULL);
+    if (rst_reuseport) {
+        // Only watch the master going away, jobs come from our own sockets
+        state = WAIT_READ;
+        AddWaitEventToSet(wait_set, WL_SOCKET_CLOSED, sock, NULL, NULL);
+        for (int i = 0; i < num_listen_sockets; i++)
+            AddWaitEventToSet(wait_set,
+                              WL_SOCKET_ACCEPT,
+                              listen_sockets[i],
+                              NULL,
+                              NULL);
+    }
+    else
+        AddWaitEventToSet(wait_set,
+                          WL_SOCKET_WRITEABLE | WL_SOCKET_CLOSED,
+                          sock,
+                          NULL,
+                          NULL);
     if (rst_database != NULL) {
         BackgroundWorkerInitializeConnection(rst_database, NULL, 0);
 
@@ -517,6 +1421,7 @@ startup() {
         SPI_connect();
 
         Async_Listen("rustica_module_cache_invalidation");
+        Async_Listen("rustica_routes_invalidation");
 
         rst_module_worker_startup();
 
@@ -530,11 +1435,26 @@ startup() {
                                    wasm_module_destroyer_callback);
 }
 
+// Jobs of a batch are served in turn, so with keep-alive a job would wait for
+// the whole session of the connection before it.
+static int32
+job_capacity() {
+    return rst_keepalive_timeout > 0 ? 1 : rst_dispatch_batch_size;
+}
+
 static inline void
 on_writeable() {
     ssize_t nbytes;
-
-    nbytes = send(sock, hello + sent, 12 - sent, 0);
+    uint64 loaded;
+
+    // Tell the master which routed modules are loaded here, for affinity,
+    // and how many jobs to pass at once
+    if (sent == 0) {
+        loaded = rst_routes_loaded_modules();
+        memcpy(&hello[12], &loaded, sizeof(loaded));
+        *((int32 *)&hello[20]) = job_capacity();
+    }
+    nbytes = send(sock, hello + sent, BACKEND_MSG_SIZE - sent, 0);
     if (nbytes < 0) {
         ereport(DEBUG1,
                 (errmsg("rustica-%d: could not send over Unix socket: %m",
@@ -542,7 +1462,7 @@ on_writeable() {
         return;
     }
     sent += (int)nbytes;
-    if (sent == 12) {
+    if (sent == BACKEND_MSG_SIZE) {
         ereport(DEBUG1,
                 (errmsg("rustica-%d: idle message sent, wait for jobs",
                         worker_id)));
@@ -559,9 +1479,6 @@ static inline void
 init_llhttp(Context *ctx, wasm_module_inst_t instance) {
     wasm_function_inst_t func;
 
-    llhttp_init(&ctx->http_parser, HTTP_REQUEST, &ctx->http_settings);
-    ctx->bytes_view = -1;
-
     if ((func = wasm_runtime_lookup_function(instance, "on_message_begin"))) {
         ctx->on_message_begin = func;
         ctx->http_settings.on_message_begin = on_message_begin;
@@ -624,18 +1541,30 @@ init_llhttp(Context *ctx, wasm_module_inst_t instance) {
              wasm_runtime_lookup_function(instance, "on_headers_complete"))) {
         ctx->on_headers_complete = func;
         ctx->http_settings.on_headers_complete = on_headers_complete;
+
+        // A one-argument on_headers_complete(headers) opts in to the native
+        // header table instead of the per-header callbacks.
+        wasm_func_type_t func_type =
+            wasm_runtime_get_function_type(func, instance->module_type);
+        if (wasm_func_type_get_param_count(func_type) == 1) {
+            ctx->http_settings.on_header_field = record_header_field;
+            ctx->http_settings.on_header_field_complete =
+                record_header_field_complete;
+            ctx->http_settings.on_header_value = record_header_value;
+            ctx->http_settings.on_header_value_complete =
+                record_header_value_complete;
+            ctx->http_settings.on_headers_complete = deliver_headers;
+        }
     }
 
-    if ((func = wasm_runtime_lookup_function(instance, "on_body"))) {
+    if ((func = wasm_runtime_lookup_function(instance, "on_body")))
         ctx->on_body = func;
-        ctx->http_settings.on_body = on_body;
-    }
+    ctx->http_settings.on_body = on_body;
 
     if ((func =
-             wasm_runtime_lookup_function(instance, "on_message_complete"))) {
+             wasm_runtime_lookup_function(instance, "on_message_complete")))
         ctx->on_message_complete = func;
-        ctx->http_settings.on_message_complete = on_message_complete;
-    }
+    ctx->http_settings.on_message_complete = on_message_complete;
 
     if ((func = wasm_runtime_lookup_function(instance, "on_error"))) {
         ctx->on_error = func;
@@ -643,20 +1572,240 @@ init_llhttp(Context *ctx, wasm_module_inst_t instance) {
 }
 
 static void
-on_readable() {
-    // Take a job from the FD channel
-    if (recvmsg(sock, &fd_msg.msg, 0) < 0) {
-        ereport(FATAL, errmsg("rustica-%d: failed to recvmsg: %m", worker_id));
+init_context(Context *ctx, wasm_module_inst_t instance) {
+    ctx->start = wasm_runtime_lookup_function(instance, "_start");
+    init_llhttp(ctx, instance);
+}
+
+static void
+reload_routes() {
+    MemoryContext mctx = CurrentMemoryContext;
+
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+    SPI_connect();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    PG_TRY();
+    {
+        rst_load_routes();
+
+        SPI_finish();
+        PopActiveSnapshot();
+        CommitTransactionCommand();
     }
-    pgsocket client = *((int *)CMSG_DATA(fd_msg.cmsg));
-    ereport(DEBUG1,
-            errmsg("rustica-%d: received job: fd=%d", worker_id, client));
+    PG_CATCH();
+    {
+        // Keep routing with the routes published before
+        MemoryContextSwitchTo(mctx);
+        ErrorData *edata = CopyErrorData();
+        FlushErrorState();
+        ereport(LOG,
+                errmsg("rustica-%d: could not load routes: %s",
+                       worker_id,
+                       edata->message));
+        FreeErrorData(edata);
+        AbortCurrentTransaction();
+    }
+    PG_END_TRY();
+}
+
+static void
+warm_up() {
+    if (rst_database == NULL)
+        return;
+    reload_routes();
+
+    // Load the application, its pooled instance and query plans before
+    // taking any job, so that bursts don't wait for cold workers.
+    const char *name = "main";
+    MemoryContext mctx = CurrentMemoryContext;
+    pgstat_report_activity(STATE_RUNNING, "loading WASM application");
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+    SPI_connect();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    PG_TRY();
+    {
+        PreparedModule *pmod = rst_lookup_module(name);
+        if (!pmod)
+            pmod = rst_prepare_module(name, NULL, NULL);
+        rst_module_warm_up(pmod);
+
+        Context context;
+        wasm_exec_env_t exec_env = rst_module_acquire_instance(pmod,
+                                                               256 * 1024,
+                                                               1024 * 1024,
+                                                               &context,
+                                                               init_context);
+        rst_module_release_instance(pmod, exec_env, true);
 
-    // Prepare to handle the connection
+        SPI_finish();
+        PopActiveSnapshot();
+        CommitTransactionCommand();
+    }
+    PG_CATCH();
+    {
+        // The application may be deployed later, it's loaded on demand then
+        MemoryContextSwitchTo(mctx);
+        ErrorData *edata = CopyErrorData();
+        FlushErrorState();
+        ereport(LOG,
+                errmsg("rustica-%d: could not warm up module \"%s\": %s",
+                       worker_id,
+                       name,
+                       edata->message));
+        FreeErrorData(edata);
+        AbortCurrentTransaction();
+    }
+    PG_END_TRY();
+    pgstat_report_activity(STATE_IDLE, NULL);
+}
+
+// The job received last, with the master's timestamps of it
+static FDPayload job;
+static int64 job_received_at = 0;
+
+// Trace of the current request, in monotonic microseconds. Not kept in locals
+// of handle_request(), as they are read again after errors.
+static RequestTrace trace;
+static int64 request_start; // accepted, or started on a kept-alive connection
+static int64 worker_start;
+static int64 phase_start;
+
+static inline void
+start_phase() {
+    phase_start = rst_monotonic_us();
+}
+
+static inline int64
+end_phase(int histogram) {
+    int64 us = rst_monotonic_us() - phase_start;
+    if (histogram >= 0)
+        rst_stat_request_phase(histogram, us);
+    return us;
+}
+
+static void
+begin_trace() {
+    worker_start = rst_monotonic_us();
+    memset(&trace, 0, sizeof(RequestTrace));
+    trace.worker_id = worker_id;
+    if (job_received_at) {
+        // The first request of a job, which was accepted and queued before
+        trace.queue_us = job.dispatched_at - job.accepted_at;
+        trace.handoff_us = worker_start - job.dispatched_at;
+        trace.spawned_worker = (job.flags & FD_SPAWNED_WORKER) != 0;
+        request_start = job.accepted_at;
+        job_received_at = 0;
+    }
+    else {
+        trace.keep_alive = true;
+        request_start = worker_start;
+    }
+}
+
+static void
+end_trace(bool error) {
+    int64 now = rst_monotonic_us();
+
+    rst_stat_request_done(now - worker_start, error);
+    trace.error = error;
+    trace.total_us = now - request_start;
+    trace.finished_at = GetCurrentTimestamp();
+    rst_stat_request_trace(&trace);
+
+    // Only a sample of the slow requests is logged, if so configured
+    if (rst_log_min_duration < 0
+        || trace.total_us < rst_log_min_duration * 1000L)
+        return;
+    if (rst_log_sample_rate < 1.0
+        && pg_prng_double(&pg_global_prng_state) >= rst_log_sample_rate)
+        return;
+    ereport(LOG,
+            errmsg("rustica-%d: slow request: total=%.3f ms queue=%.3f ms "
+                   "handoff=%.3f ms load=%.3f ms instantiate=%.3f ms "
+                   "handler=%.3f ms commit=%.3f ms spawned_worker=%s "
+                   "keep_alive=%s error=%s",
+                   worker_id,
+                   trace.total_us / 1000.0,
+                   trace.queue_us / 1000.0,
+                   trace.handoff_us / 1000.0,
+                   trace.load_us / 1000.0,
+                   trace.instantiate_us / 1000.0,
+                   trace.handler_us / 1000.0,
+                   trace.commit_us / 1000.0,
+                   trace.spawned_worker ? "true" : "false",
+                   trace.keep_alive ? "true" : "false",
+                   trace.error ? "true" : "false"),
+            errhidestmt(true));
+}
+
+static void
+read_request_head(pgsocket client,
+                  WaitEventSet *client_wait_set,
+                  TimestampTz deadline,
+                  RouteHead *head) {
+    WaitEvent occurred[1];
+    ssize_t rv;
+
+    // Read ahead into the carry, from where the guest receives it again
+    for (;;) {
+        int avail = carry.len - carry.cursor;
+        if (rst_route_parse_head(carry.data + carry.cursor, avail, head)
+                != ROUTE_HEAD_INCOMPLETE
+            || avail >= ROUTE_HEAD_MAXLEN)
+            return;
+        enlargeStringInfo(&carry, ROUTE_HEAD_MAXLEN - avail);
+        if (use_uring) {
+            rv = rst_uring_recv(client,
+                                carry.data + carry.len,
+                                ROUTE_HEAD_MAXLEN - avail,
+                                time_left(deadline));
+            if (rv <= 0)
+                return;
+        }
+        else {
+            rv = recv(client,
+                      carry.data + carry.len,
+                      ROUTE_HEAD_MAXLEN - avail,
+                      0);
+            if (rv == 0
+                || (rv < 0 && errno != EAGAIN && errno != EWOULDBLOCK
+                    && errno != EINTR))
+                return;
+            if (rv < 0) {
+                // Route with what's there, the guest sees the same timeout
+                if (time_left(deadline) == 0)
+                    return;
+                arm_client_wait(client_wait_set,
+                                WL_SOCKET_READABLE | WL_SOCKET_CLOSED);
+                if (WaitEventSetWait(client_wait_set,
+                                     time_left(deadline),
+                                     occurred,
+                                     1,
+                                     WAIT_EVENT_CLIENT_READ)
+                        == 0
+                    || occurred[0].events & WL_LATCH_SET)
+                    return;
+                continue;
+            }
+        }
+        rst_stat_worker_io(rv, 0);
+        carry.len += (int)rv;
+        carry.data[carry.len] = '\0';
+    }
+}
+
+static bool
+handle_request(pgsocket client, WaitEventSet *client_wait_set) {
     bool spi_connected = false;
+    PreparedModule *pmod = NULL;
     wasm_exec_env_t exec_env = NULL;
     bool success = false;
+    bool keep_alive = false;
 
+    begin_trace();
+    rst_stat_worker_busy(true);
     PG_TRY();
     {
         if (rst_database == NULL)
@@ -671,78 +1820,322 @@ on_readable() {
         PushActiveSnapshot(GetTransactionSnapshot());
         spi_connected = true;
 
+        // Route by the request head, if any routes are configured
+        char name[RST_MODULE_NAME_MAXLEN + 1] = "main";
+        if (rst_routes_enabled()) {
+            RouteHead head;
+            TimestampTz deadline = 0;
+            if (rst_recv_timeout > 0)
+                deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+                                                       rst_recv_timeout);
+            read_request_head(client, client_wait_set, deadline, &head);
+            rst_route_match(&head, name);
+        }
+
         // Load module if it's not loaded already
-        const char *name = "main";
-        PreparedModule *pmod = rst_lookup_module(name);
+        pmod = rst_lookup_module(name);
         if (!pmod) {
             pgstat_report_activity(STATE_RUNNING, "loading WASM application");
             ereport(DEBUG1,
                     errmsg("rustica-%d: load module \"%s\"", worker_id, name));
+            start_phase();
             pmod = rst_prepare_module(name, NULL, NULL);
+            trace.load_us = end_phase(-1);
         }
 
-        // Instantiate the WASM module
+        // Take a pooled instance of the WASM module, or instantiate one. The
+        // context comes pre-initialized from the module's snapshot.
         pgstat_report_activity(STATE_RUNNING, "running WASM application");
-        exec_env = rst_module_instantiate(pmod, 256 * 1024, 1024 * 1024);
+        Context context;
+        start_phase();
+        exec_env = rst_module_acquire_instance(pmod,
+                                               256 * 1024,
+                                               1024 * 1024,
+                                               &context,
+                                               init_context);
+        trace.instantiate_us = end_phase(HIST_INSTANTIATE);
 
         // Prepare context for execution
-        Context context = { .fd = client, .module = pmod };
-        wasm_runtime_set_user_data(exec_env, &context);
-        context.wait_set = CreateWaitEventSet(CurrentMemoryContext, 2);
-        AddWaitEventToSet(context.wait_set,
-                          WL_LATCH_SET,
-                          PGINVALID_SOCKET,
-                          MyLatch,
-                          NULL);
-        AddWaitEventToSet(context.wait_set,
-                          WL_SOCKET_CLOSED,
-                          client,
-                          NULL,
-                          NULL);
-
-        // Initialize context
-        rst_init_instance_context(exec_env);
-        rst_init_context_for_jsonb(exec_env);
-        wasm_module_inst_t instance = wasm_exec_env_get_module_inst(exec_env);
-        init_llhttp(&context, instance);
+        resetStringInfo(&header_data);
+        num_headers = 0;
+        header_started = false;
+        header_generation++;
+        carry_put_back = 0;
+        context.fd = client;
+        context.wait_set = client_wait_set;
+        context.recv_deadline = 0;
+        context.send_deadline = 0;
+        if (rst_recv_timeout > 0)
+            context.recv_deadline =
+                TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+                                            rst_recv_timeout);
+        llhttp_init(&context.http_parser, HTTP_REQUEST, &context.http_settings);
         context.http_parser.data = exec_env;
+        llhttp_init(&response_parser, HTTP_RESPONSE, &response_settings);
+        response_parser.data = &context;
+        response_complete = false;
 
         // Run the WASM module instance
-        wasm_function_inst_t start_func =
-            wasm_runtime_lookup_function(instance, "_start");
-        if (!start_func)
+        if (!context.start)
             ereport(ERROR, errmsg("cannot find WASM entrypoint"));
-        success = wasm_runtime_call_wasm(exec_env, start_func, 0, NULL);
+        start_phase();
+        success = wasm_runtime_call_wasm(exec_env, context.start, 0, NULL);
+
+        // Whatever the guest left in the output buffer goes out now
+        if (success && output.pending > 0 && flush_output(&context, false) < 0)
+            success = false;
+        trace.handler_us = end_phase(HIST_HANDLER);
+        keep_alive = success && rst_keepalive_timeout > 0
+                     && context.message_complete
+                     && llhttp_should_keep_alive(&context.http_parser)
+                     && response_complete;
     }
     PG_FINALLY();
     {
         if (exec_env) {
-            wasm_module_inst_t instance =
-                wasm_exec_env_get_module_inst(exec_env);
-            wasm_runtime_deinstantiate(instance);
-            rst_free_instance_context(exec_env);
-            wasm_runtime_destroy_exec_env(exec_env);
+            // Unpin the guest objects of unflushed output first
+            rst_output_reset(&output);
+            rst_body_sink_reset(!_do_rethrow);
+            rst_copy_reset(!_do_rethrow);
+
+            // Put the instance back before SPI_finish(), so that finalizers
+            // of the job's objects can still close portals and tuptables.
+            rst_module_release_instance(pmod,
+                                        exec_env,
+                                        success && !_do_rethrow);
         }
 
         if (spi_connected) {
             SPI_finish();
             PopActiveSnapshot();
-            if (success && !_do_rethrow)
+            if (success && !_do_rethrow) {
+                start_phase();
                 CommitTransactionCommand();
+                trace.commit_us = end_phase(HIST_COMMIT);
+            }
             else
                 AbortCurrentTransaction();
             pgstat_report_stat(true);
             pgstat_report_activity(STATE_IDLE, NULL);
         }
 
-        StreamClose(client);
-        state = WAIT_WRITE;
-        ModifyWaitEvent(wait_set,
-                        1,
-                        WL_SOCKET_WRITEABLE | WL_SOCKET_CLOSED,
-                        NULL);
+        end_trace(!success || _do_rethrow);
+        rst_stat_worker_busy(false);
+
+        if (_do_rethrow) {
+            FreeWaitEventSet(client_wait_set);
+            StreamClose(client);
+            resetStringInfo(&carry);
+        }
+    }
+    PG_END_TRY();
+
+    return keep_alive;
+}
+
+static int
+wait_next_request(WaitEventSet *client_wait_set) {
+    WaitEvent events[1];
+
+    // Pipelined requests are served right away
+    if (carry.cursor < carry.len)
+        return NEXT_REQUEST;
+
+    pgstat_report_activity(STATE_IDLE, "waiting for keep-alive request");
+    arm_client_wait(client_wait_set, WL_SOCKET_READABLE | WL_SOCKET_CLOSED);
+    for (;;) {
+        // Without a master, the idle connection is closed afterwards rather
+        // than waited out for the whole keep-alive timeout: meanwhile nobody
+        // would accept from this worker's own SO_REUSEPORT listen socket,
+        // and connections the kernel hashed to it would stall.
+        int nevents = WaitEventSetWait(client_wait_set,
+                                       rst_keepalive_linger,
+                                       events,
+                                       1,
+                                       WAIT_EVENT_CLIENT_READ);
+        if (nevents == 0)
+            return CONNECTION_IDLE;
+        if (events[0].events & WL_LATCH_SET) {
+            ResetLatch(MyLatch);
+            if (shutdown_requested)
+                return CONNECTION_CLOSED;
+            continue;
+        }
+        if (events[0].events & WL_SOCKET_CLOSED)
+            return CONNECTION_CLOSED;
+        return NEXT_REQUEST;
+    }
+}
+
+static bool
+hand_back_connection(pgsocket client) {
+    char msg[BACKEND_MSG_SIZE];
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct iovec io = { .iov_base = msg, .iov_len = BACKEND_MSG_SIZE };
+    struct msghdr hdr = { .msg_iov = &io,
+                          .msg_iovlen = 1,
+                          .msg_control = buf,
+                          .msg_controllen = sizeof(buf) };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+
+    uint64 loaded = rst_routes_loaded_modules();
+
+    memcpy(msg, BACKEND_HANDBACK, 8);
+    *((int *)&msg[8]) = worker_id;
+    memcpy(&msg[12], &loaded, sizeof(loaded));
+    *((int32 *)&msg[20]) = job_capacity();
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    *((int *)CMSG_DATA(cmsg)) = client;
+    if (sendmsg(sock, &hdr, 0) != BACKEND_MSG_SIZE) {
+        ereport(DEBUG1,
+                errmsg("rustica-%d: failed to hand back fd=%d: %m",
+                       worker_id,
+                       client));
+        return false;
+    }
+    ereport(DEBUG1,
+            errmsg("rustica-%d: handed back idle fd=%d", worker_id, client));
+    return true;
+}
+
+static void
+on_notification_received();
+
+static void
+serve_connection(pgsocket client) {
+    // Serve requests on the connection, each in its own transaction, until
+    // the client closes it, asks so, or stays idle for too long.
+    WaitEventSet *client_wait_set = CreateWaitEventSet(TopMemoryContext, 2);
+    AddWaitEventToSet(client_wait_set,
+                      WL_LATCH_SET,
+                      PGINVALID_SOCKET,
+                      MyLatch,
+                      NULL);
+    AddWaitEventToSet(client_wait_set, WL_SOCKET_CLOSED, client, NULL, NULL);
+    client_wait_events = WL_SOCKET_CLOSED;
+    if (use_uring) {
+        // The master accepts non-blocking, but io_uring would then fail
+        // reads with EAGAIN instead of waiting for data
+        if (!pg_set_block(client))
+            ereport(DEBUG1,
+                    errmsg("rustica-%d: could not set fd=%d blocking: %m",
+                           worker_id,
+                           client));
+    }
+    else if (!pg_set_noblock(client))
+        ereport(DEBUG1,
+                errmsg("rustica-%d: could not set fd=%d non-blocking: %m",
+                       worker_id,
+                       client));
+    int next = CONNECTION_CLOSED;
+    while (handle_request(client, client_wait_set)) {
+        next = wait_next_request(client_wait_set);
+        if (next != NEXT_REQUEST)
+            break;
+
+        // A busy connection never returns to the main loop, so modules and
+        // routes redeployed meanwhile are reloaded before the next request
+        if (notifyInterruptPending)
+            on_notification_received();
+    }
+    FreeWaitEventSet(client_wait_set);
+    if (next != CONNECTION_IDLE || rst_reuseport
+        || !hand_back_connection(client))
+        ereport(DEBUG1,
+                errmsg("rustica-%d: close connection fd=%d", worker_id, client));
+    StreamClose(client);
+    resetStringInfo(&carry);
+}
+
+static void
+on_readable() {
+    ssize_t received;
+    int njobs;
+    volatile int i = 0;
+    int clients[FD_BATCH_MAX];
+    FDPayload jobs[FD_BATCH_MAX];
+
+    // Take jobs from the FD channel, the master may pass several at once
+    fd_msg.msg.msg_controllen = sizeof(fd_msg.buf);
+    received = recvmsg(sock, &fd_msg.msg, MSG_CMSG_CLOEXEC);
+    if (received < 0) {
+        ereport(FATAL, errmsg("rustica-%d: failed to recvmsg: %m", worker_id));
+    }
+    if (fd_msg.msg.msg_controllen < CMSG_LEN(sizeof(int))
+        || fd_msg.cmsg->cmsg_type != SCM_RIGHTS)
+        ereport(FATAL,
+                errmsg("rustica-%d: received no job from the master",
+                       worker_id));
+    njobs = (int)((fd_msg.cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+    memcpy(clients, CMSG_DATA(fd_msg.cmsg), sizeof(int) * njobs);
+    memcpy(jobs, fd_msg.payload, sizeof(FDPayload) * njobs);
+    Assert(received == sizeof(FDPayload) * njobs);
+
+    PG_TRY();
+    {
+        for (; i < njobs; i++) {
+            pgsocket client = clients[i];
+
+            // Later jobs of a batch may have waited too long behind earlier
+            // ones
+            job_received_at = rst_monotonic_us();
+            if (rst_queue_timeout > 0
+                && job_received_at - jobs[i].accepted_at
+                       > rst_queue_timeout * 1000L) {
+                ereport(DEBUG1,
+                        errmsg("rustica-%d: job fd=%d waited too long",
+                               worker_id,
+                               client));
+                rst_shed_connection(client);
+                rst_stat_master_expired();
+                continue;
+            }
+            job = jobs[i];
+            ereport(DEBUG1,
+                    errmsg("rustica-%d: received job: fd=%d",
+                           worker_id,
+                           client));
+
+            serve_connection(client);
+        }
+    }
+    PG_CATCH();
+    {
+        // The worker exits with the error, tell the rest of the batch to
+        // retry instead of resetting their connections
+        for (int j = i + 1; j < njobs; j++)
+            rst_shed_connection(clients[j]);
+        PG_RE_THROW();
     }
     PG_END_TRY();
+
+    state = WAIT_WRITE;
+    ModifyWaitEvent(wait_set, 1, WL_SOCKET_WRITEABLE | WL_SOCKET_CLOSED, NULL);
+}
+
+static void
+on_acceptable(pgsocket listen_sock) {
+    SockAddr addr;
+    pgsocket client;
+
+    addr.salen = sizeof(addr.addr);
+    client = accept(listen_sock, (struct sockaddr *)&addr.addr, &addr.salen);
+    if (client == PGINVALID_SOCKET) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            ereport(LOG,
+                    (errcode_for_socket_access(),
+                     errmsg("rustica-%d: could not accept new connection: %m",
+                            worker_id)));
+        return;
+    }
+    ereport(DEBUG1,
+            errmsg("rustica-%d: accepted connection: fd=%d", worker_id, client));
+    job.accepted_at = job.dispatched_at = job_received_at = rst_monotonic_us();
+    job.flags = 0;
+
+    serve_connection(client);
 }
 
 static void
@@ -768,6 +2161,8 @@ mock_comm_putmessage(char msgtype, const char *s, size_t len) {
             const char *payload = pq_getmsgstring(&msg);
             invalidate_cached_module(payload);
         }
+        else if (strcmp(channel, "rustica_routes_invalidation") == 0)
+            routes_invalidated = true;
     }
     return 0;
 }
@@ -778,36 +2173,32 @@ static const PQcommMethods mock_comm_methods = {
 
 static void
 on_notification_received() {
-    ereport(
-        DEBUG1,
-        (errmsg(
-            "rustica-%d: received notification for module cache invalidation",
-            worker_id)));
+    ereport(DEBUG1,
+            (errmsg("rustica-%d: received notification for cache invalidation",
+                    worker_id)));
     const PQcommMethods *old_methods = PqCommMethods;
     PqCommMethods = &mock_comm_methods;
     whereToSendOutput = DestRemote;
     ProcessNotifyInterrupt(false);
     whereToSendOutput = DestNone;
     PqCommMethods = old_methods;
+
+    // Reloaded out of the transaction that delivered the notifications
+    if (routes_invalidated) {
+        routes_invalidated = false;
+        reload_routes();
+    }
 }
 
 static void
 main_loop() {
-    WaitEvent events[2];
+    WaitEvent events[2 + MAXLISTEN];
     int nevents;
-    long timeout;
 
-    if (rst_worker_idle_timeout == 0)
-        timeout = -1;
-    else
-        timeout = rst_worker_idle_timeout * 1000;
+    // Idle workers are stopped by the master closing the Unix socket
     for (;;) {
-        nevents = WaitEventSetWait(wait_set, timeout, events, 2, 0);
+        nevents = WaitEventSetWait(wait_set, -1, events, lengthof(events), 0);
 
-        if (nevents == 0 && state == WAIT_READ) {
-            ereport(DEBUG1, (errmsg("rustica-%d: idle timeout", worker_id)));
-            return;
-        }
         for (int i = 0; i < nevents; i++) {
             if (events[i].events & WL_LATCH_SET) {
                 if (shutdown_requested)
@@ -819,6 +2210,11 @@ main_loop() {
                         (errmsg("rustica-%d: Unix socket closed", worker_id)));
                 return;
             }
+            if (events[i].pos >= 2) {
+                if (events[i].events & WL_SOCKET_ACCEPT)
+                    on_acceptable(events[i].fd);
+                continue;
+            }
             if (state == WAIT_WRITE && events[i].events & WL_SOCKET_WRITEABLE)
                 on_writeable();
             if (state == WAIT_READ && events[i].events & WL_SOCKET_READABLE)
@@ -834,9 +2230,13 @@ main_loop() {
 static void
 teardown() {
     rst_module_worker_teardown();
+    rst_uring_fini();
     FreeWaitEventSet(wait_set);
     StreamClose(sock);
     sock = PGINVALID_SOCKET;
+    for (int i = 0; i < num_listen_sockets; i++)
+        StreamClose(listen_sockets[i]);
+    num_listen_sockets = 0;
 }
 
 static void
@@ -859,6 +2259,7 @@ rustica_worker(Datum index) {
 
     worker_id = DatumGetInt32(index);
     startup();
+    warm_up();
 
     ereport(DEBUG1, (errmsg("rustica-%d: worker started", worker_id)));
     main_loop();